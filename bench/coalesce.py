@@ -0,0 +1,67 @@
+#!/usr/bin/env python3
+# Replays the file operations of a compiler writing temporary and object files, and prints how
+# many events and bytes the daemon sends with each --coalesce-ms window.
+#
+#   coalesce.py path/to/wsl-fs-notify [MS...]
+import os
+import shutil
+import sys
+import tempfile
+import threading
+import time
+
+sys.path.insert(0, os.path.join(os.path.dirname(os.path.abspath(__file__)), '..', 'tests'))
+from daemon import *
+
+UNITS = 300
+OBJECTS = 100
+CHUNKS = 8
+
+
+def run(binary, window):
+    root = tempfile.mkdtemp(prefix='wfn-bench-')
+    try:
+        os.mkdir(root + '/obj')
+        daemon = Daemon(binary, ['--backend=inotify', '--coalesce-ms=' + window],
+                        CAP_WATCH_PROGRESS)
+        daemon.watch(1, root)
+        daemon.wait_ready(1)
+
+        msgs = []
+        is_done = False
+
+        def read():
+            while not is_done:
+                msg = daemon.recv(0.2)
+                if msg is not None and msg[:1] == b'U':
+                    msgs.append(msg)
+
+        reader = threading.Thread(target=read)
+        reader.start()
+        for i in range(UNITS):
+            tmp = '%s/obj/cc%d.s' % (root, i)
+            obj = '%s/obj/f%d.o' % (root, i % OBJECTS)
+            for path in (tmp, obj):
+                with open(path, 'w') as f:
+                    for k in range(CHUNKS):
+                        f.write('x' * 4096)
+                        f.flush()
+                        time.sleep(0.0003)
+            os.unlink(tmp)
+        time.sleep(0.5)
+        is_done = True
+        reader.join()
+        daemon.close()
+        print('window %3s ms: %5d events, %6d bytes' %
+              (window, len(msgs), sum(8 + len(msg) for msg in msgs)))
+    finally:
+        shutil.rmtree(root, ignore_errors=True)
+
+
+def main():
+    for window in sys.argv[2:] or ['0', '5', '20', '50']:
+        run(sys.argv[1], window)
+
+
+if __name__ == '__main__':
+    main()
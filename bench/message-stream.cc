@@ -0,0 +1,40 @@
+// Splits a stream of 200k Event messages that arrives in pieces of 1 KB and 64 KB, the sizes the
+// daemon and the DLL read, and prints the time per message. Built by the message-stream-bench
+// target.
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <string>
+
+#include "config.h"
+#include "message.h"
+
+const int MESSAGE_CNT = 200 * 1000;
+const int ROUNDS = 10;
+
+int main() {
+  std::string wire;
+  for (int i = 0; i < MESSAGE_CNT; i++) {
+    auto name = "some/dir/path/file-" + std::to_string(i) + ".txt";
+    Message::from(Event{.directory = (void *) 1, .action = 1}, name.data(), name.size())
+        ->write_to(wire);
+  }
+
+  for (size_t piece : {1024, 64 * 1024}) {
+    auto start = std::chrono::steady_clock::now();
+    size_t cnt = 0, bytes = 0;
+    for (int round = 0; round < ROUNDS; round++) {
+      MessageStream stream;
+      for (size_t pos = 0; pos < wire.size(); pos += piece) {
+        stream.feed(wire.data() + pos, std::min(piece, wire.size() - pos));
+        while (auto msg = stream.get_message()) {
+          ++cnt;
+          bytes += msg->length;
+        }
+      }
+    }
+    std::chrono::duration<double, std::nano> elapsed = std::chrono::steady_clock::now() - start;
+    printf("pieces of %6zu bytes: %.1f ns per message, %zu messages, %zu bytes\n", piece,
+           elapsed.count() / (double) cnt, cnt, bytes);
+  }
+}
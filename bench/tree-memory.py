@@ -0,0 +1,58 @@
+#!/usr/bin/env python3
+# Watches a generated tree of about N directories with inotify and prints how long the watch took
+# to get ready and the RSS of the daemon. The per-watch memory from SIGUSR1 goes to stderr.
+#
+#   tree-memory.py path/to/wsl-fs-notify [N]
+import os
+import shutil
+import sys
+import tempfile
+import time
+
+sys.path.insert(0, os.path.join(os.path.dirname(os.path.abspath(__file__)), '..', 'tests'))
+from daemon import *
+
+
+def make_tree(root, cnt):
+    # 64 directories per level with a few files each, like a source tree.
+    made, level = 0, [root]
+    while made < cnt:
+        next_level = []
+        for parent in level:
+            for i in range(64):
+                if made == cnt:
+                    break
+                path = '%s/d%d' % (parent, i)
+                os.mkdir(path)
+                for k in range(4):
+                    open('%s/f%d.c' % (path, k), 'w').close()
+                next_level.append(path)
+                made += 1
+        level = next_level
+
+
+def main():
+    binary = sys.argv[1]
+    cnt = int(sys.argv[2]) if len(sys.argv) > 2 else 65536
+    root = tempfile.mkdtemp(prefix='wfn-bench-')
+    try:
+        make_tree(root, cnt)
+        daemon = Daemon(binary, ['--backend=inotify'], CAP_WATCH_PROGRESS)
+        start = time.monotonic()
+        daemon.watch(1, root)
+        daemon.wait_ready(1, timeout=600)
+        ready = time.monotonic() - start
+        time.sleep(0.5)
+        print('%d directories: ready in %.2f s, RSS %d KB' %
+              (cnt, ready, get_rss_kb(daemon.process.pid)))
+        daemon.stats()
+        time.sleep(0.3)
+        start = time.monotonic()
+        daemon.close()
+        print('exit in %.3f s' % (time.monotonic() - start))
+    finally:
+        shutil.rmtree(root, ignore_errors=True)
+
+
+if __name__ == '__main__':
+    main()
@@ -0,0 +1,48 @@
+#!/usr/bin/env python3
+# Creates, renames and then removes N subdirectories of one watched directory and prints the CPU
+# time the daemon spent on each phase.
+#
+#   wide-directory.py path/to/wsl-fs-notify [N...]
+import os
+import shutil
+import sys
+import tempfile
+
+sys.path.insert(0, os.path.join(os.path.dirname(os.path.abspath(__file__)), '..', 'tests'))
+from daemon import *
+
+
+def run(binary, cnt):
+    root = tempfile.mkdtemp(prefix='wfn-bench-')
+    try:
+        daemon = Daemon(binary, ['--backend=inotify'], CAP_WATCH_PROGRESS)
+        daemon.watch(1, root)
+        daemon.wait_ready(1)
+        res = []
+        for phase in ('create', 'rename', 'delete'):
+            start = get_cpu_time(daemon.process.pid)
+            for i in range(cnt):
+                if phase == 'create':
+                    os.mkdir('%s/dir-%d' % (root, i))
+                elif phase == 'rename':
+                    os.rename('%s/dir-%d' % (root, i), '%s/renamed-%d' % (root, i))
+                else:
+                    os.rmdir('%s/renamed-%d' % (root, i))
+                # Keep the pipe from filling up.
+                if i % 2000 == 0:
+                    daemon.events(0)
+            daemon.events()
+            res.append('%s %.2f s' % (phase, get_cpu_time(daemon.process.pid) - start))
+        daemon.close()
+        print('%6d directories:' % cnt, ', '.join(res))
+    finally:
+        shutil.rmtree(root, ignore_errors=True)
+
+
+def main():
+    for cnt in sys.argv[2:] or ['10000', '20000', '40000']:
+        run(sys.argv[1], int(cnt))
+
+
+if __name__ == '__main__':
+    main()
@@ -1,7 +1,72 @@
+find_package(Threads REQUIRED)
+
 add_executable(wsl-fs-notify
+	src/client.cc
+	src/crawler.cc
+	src/directory-tree.cc
+	src/dirty-set.cc
+	src/event-coalescer.cc
+	src/exclude-rules.cc
+	src/fanotify-watcher.cc
+	src/file-digest.cc
+	src/inotify-watcher.cc
+	src/latency-stats.cc
 	src/main-wsl.cc
 	src/message.cc
+	src/mount-table.cc
+	src/output.cc
+	src/shared-daemon.cc
+	src/storm-detector.cc
 	src/utils.cc
+	src/watcher.cc
+	src/write-settler.cc
 )
-target_link_libraries(wsl-fs-notify PRIVATE ev)
+target_link_libraries(wsl-fs-notify PRIVATE ev Threads::Threads)
 install(TARGETS wsl-fs-notify)
+
+enable_testing()
+
+# Unit tests are executables that abort on a failed assert.
+add_executable(message-stream-test
+	src/message.cc
+	src/utils.cc
+	tests/message-stream-test.cc
+)
+target_include_directories(message-stream-test PRIVATE src)
+add_test(NAME message-stream COMMAND message-stream-test)
+
+add_executable(exclude-rules-test
+	src/exclude-rules.cc
+	tests/exclude-rules-test.cc
+)
+target_include_directories(exclude-rules-test PRIVATE src)
+add_test(NAME exclude-rules COMMAND exclude-rules-test)
+
+add_executable(file-digest-test
+	src/crawler.cc
+	src/file-digest.cc
+	tests/file-digest-test.cc
+)
+target_include_directories(file-digest-test PRIVATE src)
+target_link_libraries(file-digest-test PRIVATE ev Threads::Threads)
+add_test(NAME file-digest COMMAND file-digest-test)
+
+# The protocol tests drive the daemon over stdin and stdout, see tests/protocol-test.py.
+find_package(Python3 COMPONENTS Interpreter)
+if(Python3_Interpreter_FOUND)
+	foreach(backend inotify fanotify)
+		add_test(NAME protocol-${backend}
+			COMMAND Python3::Interpreter ${CMAKE_SOURCE_DIR}/tests/protocol-test.py
+				$<TARGET_FILE:wsl-fs-notify> --backend=${backend})
+		# fanotify needs capabilities that the tests may not have.
+		set_tests_properties(protocol-${backend} PROPERTIES SKIP_RETURN_CODE 77)
+	endforeach()
+endif()
+
+# Benchmarks, see bench/.
+add_executable(message-stream-bench EXCLUDE_FROM_ALL
+	bench/message-stream.cc
+	src/message.cc
+	src/utils.cc
+)
+target_include_directories(message-stream-bench PRIVATE src)
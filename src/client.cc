@@ -0,0 +1,276 @@
+#include "client.h"
+
+#include <unistd.h>
+
+#include <cerrno>
+#include <cstring>
+
+#include "fanotify-watcher.h"
+#include "inotify-watcher.h"
+
+std::vector<PClient> clients;
+
+const uint32_t SUPPORTED_CAPABILITIES =
+    CAP_WATCH_PROGRESS | CAP_EXCLUDE_RULES | CAP_MOUNT_SKIPPED | CAP_SUBTREE_DIRTY |
+    CAP_EVENT_STAT | CAP_DIRECTORY_LIST | CAP_FILE_DIGEST | CAP_SETTLE_WRITES |
+    CAP_EVENT_CREDITS;
+
+namespace {
+  // Watches that later requests with the same path and options subscribe to instead of
+  // crawling the tree again, by get_share_key.
+  std::map<std::string, WWatcher> shared_watches;
+
+  // Everything that decides what a watch reports. Clients that differ in any of it get watches
+  // of their own, which still share the kernel watches.
+  std::string get_share_key(const DirectoryWatchRequest &req, std::string_view path,
+                            uint32_t capabilities, ev_tstamp settle_time,
+                            std::string_view rules) {
+    std::string res{path};
+    res += '\0';
+    res.append((const char *) &req.filter, sizeof(req.filter));
+    res += (char) req.recursive;
+    res.append((const char *) &capabilities, sizeof(capabilities));
+    res.append((const char *) &settle_time, sizeof(settle_time));
+    res += rules;
+    return res;
+  }
+
+  // The fixed part of a request. Shorter messages are malformed, they come from a broken or
+  // hostile client that may share the daemon with others.
+  uint64_t get_min_length(char msg_type) {
+    switch (msg_type) {
+      case 'D':
+        return sizeof(DirectoryWatchRequest);
+      case 'X':
+        return sizeof(DirectoryExcludeRequest);
+      case 'C':
+        return sizeof(EventCredits);
+      case 'W':
+        return sizeof(DirectorySettleRequest);
+      case 'S':
+        return sizeof(DirectoryUnwatchRequest);
+      case 'L':
+        return sizeof(DirectoryListRequest);
+      case 'H':
+        return sizeof(FileDigestRequest);
+      default:
+        return 1;
+    }
+  }
+
+  void reader_cb(EV_P_ ev_io *w, int) {
+    auto client = (Client *) w->data;
+    if (!client->read()) {
+      close_client(client);
+    }
+  }
+
+  // Not right away: the output overflows in the middle of writing to it.
+  void overflow_cb(EV_P_ ev_prepare *w, int) {
+    auto client = (Client *) w->data;
+    if (client->output.is_overflowed()) {
+      close_client(client);
+    }
+  }
+}  // namespace
+
+Client::Client(int in_fd_, int out_fd_) : in_fd(in_fd_), out_fd(out_fd_) {
+  ev_io_init(&reader, reader_cb, in_fd, EV_READ);
+  reader.data = this;
+  // Requests of clients go before events and crawling that are ready at the same time.
+  ev_set_priority(&reader, EV_MAXPRI);
+  ev_io_start(loop, &reader);
+  ev_prepare_init(&overflow_check, overflow_cb);
+  overflow_check.data = this;
+  ev_prepare_start(loop, &overflow_check);
+  output.start(loop, out_fd);
+}
+
+Client::~Client() {
+  ev_io_stop(loop, &reader);
+  ev_prepare_stop(loop, &overflow_check);
+  for (auto &[directory, watcher] : watches) {
+    watcher->unsubscribe(output, directory);
+  }
+  watches.clear();
+  std::erase_if(shared_watches, [](const auto &entry) { return entry.second.expired(); });
+  close(in_fd);
+  if (out_fd != in_fd) {
+    close(out_fd);
+  }
+}
+
+bool Client::read() {
+  const size_t BUFF = 4096;
+
+  auto space = in_stream.prepare(BUFF);
+  ssize_t buff_len = ::read(in_fd, space.data(), space.size());
+  if (buff_len < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)) {
+    return true;
+  }
+  if (buff_len <= 0) {
+    return false;
+  }
+  in_stream.commit(buff_len);
+
+  while (auto msg = in_stream.get_message()) {
+    if (!is_greeted) {
+      if (!do_hello(*msg)) {
+        return false;
+      }
+    } else if (!msg->length || msg->length < get_min_length(msg->data[0])) {
+      return false;
+    } else if (msg->data[0] == 'D') {
+      do_directory_watch(msg->as<DirectoryWatchRequest>(),
+                         msg->get_trailer<DirectoryWatchRequest>());
+    } else if (msg->data[0] == 'X') {
+      do_directory_exclude(msg->as<DirectoryExcludeRequest>(),
+                           msg->get_trailer<DirectoryExcludeRequest>());
+    } else if (msg->data[0] == 'C') {
+      do_event_credits(msg->as<EventCredits>());
+    } else if (msg->data[0] == 'W') {
+      do_directory_settle(msg->as<DirectorySettleRequest>());
+    } else if (msg->data[0] == 'S') {
+      do_directory_unwatch(msg->as<DirectoryUnwatchRequest>());
+    } else if (msg->data[0] == 'L') {
+      do_directory_list(msg->as<DirectoryListRequest>(),
+                        msg->get_trailer<DirectoryListRequest>());
+    } else if (msg->data[0] == 'H') {
+      do_file_digest(msg->as<FileDigestRequest>(), msg->get_trailer<FileDigestRequest>());
+    }
+  }
+  schedule_crawl();
+  return true;
+}
+
+bool Client::do_hello(const MessageView &msg) {
+  auto hello = msg.read<HelloRequest>();
+  if (!hello.is_eq(CLIENT_HELLO)) {
+    return false;
+  }
+  capabilities = hello.capabilities & SUPPORTED_CAPABILITIES;
+  is_greeted = true;
+
+  HelloRequest req;
+  memcpy(req.data, SERVER_HELLO, HELLO_LENGTH);
+  req.capabilities = capabilities;
+  output.write(req);
+  return true;
+}
+
+void Client::do_directory_exclude(DirectoryExcludeRequest *req, std::string_view rules) {
+  pending_excludes[req->directory] = rules;
+}
+
+void Client::do_directory_settle(DirectorySettleRequest *req) {
+  pending_settles[req->directory] = req->settle_ms / 1000.0;
+}
+
+void Client::do_directory_watch(DirectoryWatchRequest *req, std::string_view path) {
+  // A handle that is watched again replaces its watch, which may be shared with others.
+  if (auto node = watches.extract(req->directory)) {
+    node.mapped()->unsubscribe(output, req->directory);
+  }
+  std::string rules;
+  if (auto node = pending_excludes.extract(req->directory)) {
+    rules = std::move(node.mapped());
+  }
+  ev_tstamp settle_time = settle_window;
+  if (auto node = pending_settles.extract(req->directory)) {
+    settle_time = node.mapped();
+  }
+
+  auto key = get_share_key(*req, path, capabilities, settle_time, rules);
+  if (auto it = shared_watches.find(key); it != shared_watches.end()) {
+    if (auto watcher = it->second.lock(); watcher && !watcher->is_failed) {
+      watcher->subscribe(output, req->directory);
+      watches[req->directory] = watcher;
+      return;
+    }
+  }
+
+  PWatcher watcher;
+  ExcludeRules excludes;
+  if (rules.size()) {
+    excludes.compile(rules);
+  }
+
+  // fanotify only pays off when a whole tree would otherwise have to be crawled. It is not
+  // available on every filesystem, so fall back to inotify quietly.
+  if (req->recursive && fanotify.is_available()) {
+    auto fanotify_watcher =
+        std::make_shared<FanotifyWatcher>(path, req->filter, req->recursive, capabilities);
+    fanotify_watcher->excludes = excludes;
+    fanotify_watcher->settle_time = settle_time;
+    if (fanotify_watcher->start()) {
+      watcher = fanotify_watcher;
+    }
+  }
+
+  if (!watcher) {
+    auto inotify_watcher =
+        std::make_shared<InotifyWatcher>(path, req->filter, req->recursive, capabilities);
+    inotify_watcher->excludes = std::move(excludes);
+    inotify_watcher->settle_time = settle_time;
+    if (!inotify_watcher->start()) {
+      inotify_watcher->subscribe(output, req->directory);
+      inotify_watcher->fail();
+      return;
+    }
+    watcher = inotify_watcher;
+  }
+
+  // Mounts skipped by start() are caught up on here.
+  watcher->subscribe(output, req->directory);
+  watches[req->directory] = watcher;
+  shared_watches[key] = watcher;
+  // Watches without anything to crawl are ready right away, and nothing else would wake up
+  // crawl_check_cb to tell.
+  watcher->report_progress();
+}
+
+void Client::do_directory_unwatch(DirectoryUnwatchRequest *req) {
+  if (auto node = watches.extract(req->directory)) {
+    node.mapped()->unsubscribe(output, req->directory);
+  }
+  pending_excludes.erase(req->directory);
+  pending_settles.erase(req->directory);
+  std::erase_if(shared_watches, [](const auto &entry) { return entry.second.expired(); });
+}
+
+void Client::do_event_credits(EventCredits *req) {
+  if (auto it = watches.find(req->directory); it != watches.end()) {
+    it->second->add_credits(output, req->directory, req->credits);
+  }
+}
+
+void Client::do_directory_list(DirectoryListRequest *req, std::string_view rel_path) {
+  auto it = watches.find(req->directory);
+  if (it == watches.end()) {
+    output.write(DirectoryListChunk{
+        .directory = req->directory,
+        .id = req->id,
+        .error = ENOENT,
+        .is_last = true,
+    });
+    return;
+  }
+  it->second->send_listing(output, *req, rel_path);
+}
+
+void Client::do_file_digest(FileDigestRequest *req, std::string_view paths) {
+  auto it = watches.find(req->directory);
+  if (it != watches.end()) {
+    it->second->send_digests(output, *req, paths);
+    return;
+  }
+  std::string res;
+  for (auto c : paths) {
+    if (c == '\0') {
+      FileDigest digest;
+      digest.error = ENOENT;
+      res.append((const char *) &digest, sizeof(digest));
+    }
+  }
+  output.write(FileDigestReply{.directory = req->directory, .id = req->id}, {res});
+}
@@ -0,0 +1,60 @@
+#pragma once
+
+#include <ev.h>
+
+#include <cstdint>
+#include <map>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "config.h"
+#include "message.h"
+#include "output.h"
+#include "watcher.h"
+
+// A DLL talking to the daemon, over stdin and stdout or over a connection to the shared socket.
+// The first message is the hello, everything after it is a request about the client's watches.
+struct Client {
+  int in_fd, out_fd;
+  ev_io reader;
+  ev_prepare overflow_check;  // closes the client once `output` overflowed
+  MessageStream in_stream;
+  Output output;
+  bool is_greeted = false;
+  uint32_t capabilities = 0;  // negotiated in the hello
+  std::map<void *, PWatcher> watches;  // by the directory handle of the client
+  // Rules from DirectoryExcludeRequest, waiting for the DirectoryWatchRequest they belong to.
+  std::map<void *, std::string> pending_excludes;
+  // Settle times from DirectorySettleRequest, likewise.
+  std::map<void *, ev_tstamp> pending_settles;
+
+  // Both descriptors are closed along with the client, they may be the same socket.
+  Client(int in_fd_, int out_fd_);
+  Client(const Client &) = delete;
+  Client &operator=(const Client &) = delete;
+  ~Client();
+
+  // Handles what arrived on `in_fd`. Returns false once the client hung up or broke the
+  // protocol.
+  bool read();
+
+  bool do_hello(const MessageView &msg);
+  void do_directory_exclude(DirectoryExcludeRequest *req, std::string_view rules);
+  void do_directory_settle(DirectorySettleRequest *req);
+  void do_directory_watch(DirectoryWatchRequest *req, std::string_view path);
+  void do_directory_unwatch(DirectoryUnwatchRequest *req);
+  void do_event_credits(EventCredits *req);
+  void do_directory_list(DirectoryListRequest *req, std::string_view rel_path);
+  void do_file_digest(FileDigestRequest *req, std::string_view paths);
+};
+
+using PClient = std::unique_ptr<Client>;
+
+extern std::vector<PClient> clients;
+
+// main-wsl.cc: drops `client` once it is gone, which may end the daemon.
+void close_client(Client *client);
+// main-wsl.cc: to be called by whoever creates crawl work.
+void schedule_crawl();
@@ -1,5 +1,6 @@
 #pragma once
 
+#include <cstddef>
 #include <cstdint>
 
 #define SHOW_DEBUG_CONSOLE 0
@@ -10,8 +11,23 @@ const char CLIENT_HELLO[] = "WFN\n\0";
 const char SERVER_HELLO[] = "WFN\n\1";
 const int HELLO_LENGTH = 5;
 
+// Optional protocol features, announced by both sides in HelloRequest::capabilities. Messages
+// that belong to a capability are only sent if the peer announced it too.
+const uint32_t CAP_WATCH_PROGRESS = 1 << 0;  // WatchProgress and WatchReady
+const uint32_t CAP_EXCLUDE_RULES = 1 << 1;   // DirectoryExcludeRequest
+const uint32_t CAP_MOUNT_SKIPPED = 1 << 2;   // MountSkipped
+const uint32_t CAP_SUBTREE_DIRTY = 1 << 3;   // SubtreeDirty
+const uint32_t CAP_EVENT_STAT = 1 << 4;      // EventStat instead of Event
+const uint32_t CAP_DIRECTORY_LIST = 1 << 5;  // DirectoryListRequest
+const uint32_t CAP_FILE_DIGEST = 1 << 6;     // FileDigestRequest
+const uint32_t CAP_SETTLE_WRITES = 1 << 7;   // DirectorySettleRequest
+const uint32_t CAP_EVENT_CREDITS = 1 << 8;   // EventCredits, only along with CAP_SUBTREE_DIRTY
+
 const int DIR_FAIL_CNT = 10;
 
+// Events that the daemon may send for a watch before the client returns any EventCredits.
+const uint32_t INITIAL_EVENT_CREDITS = 4096;
+
 #ifndef WIN32
 enum FileAction : uint32_t {
   FILE_ACTION_FAILED = 0xffffffff,
@@ -21,6 +37,15 @@ enum FileAction : uint32_t {
   FILE_ACTION_RENAMED_OLD_NAME = 0x00000004,
   FILE_ACTION_RENAMED_NEW_NAME = 0x00000005,
 };
+
+const uint32_t FILE_NOTIFY_CHANGE_FILE_NAME = 0x00000001;
+const uint32_t FILE_NOTIFY_CHANGE_DIR_NAME = 0x00000002;
+const uint32_t FILE_NOTIFY_CHANGE_ATTRIBUTES = 0x00000004;
+const uint32_t FILE_NOTIFY_CHANGE_SIZE = 0x00000008;
+const uint32_t FILE_NOTIFY_CHANGE_LAST_WRITE = 0x00000010;
+const uint32_t FILE_NOTIFY_CHANGE_LAST_ACCESS = 0x00000020;
+const uint32_t FILE_NOTIFY_CHANGE_CREATION = 0x00000040;
+const uint32_t FILE_NOTIFY_CHANGE_SECURITY = 0x00000100;
 #endif
 
 const uint32_t ERROR_WSL_START_FAILED = (1 << 29) | 1;
@@ -31,6 +56,8 @@ const uint32_t ERROR_INOTIFY_FAILED = (1 << 29) | 4;
 #pragma pack(push, 1)
 struct HelloRequest {
   char data[HELLO_LENGTH];
+  // Peers that predate capabilities send only `data`.
+  uint32_t capabilities = 0;
 
   bool is_eq(const char *hello_str);  // utils.cc
 };
@@ -48,10 +75,222 @@ struct DirectoryUnwatchRequest {
   void *directory;
 };
 
+// Sent right before the DirectoryWatchRequest of `directory`, which then skips the paths that
+// match the rules (see exclude-rules.h).
+struct DirectoryExcludeRequest {
+  char msg_type = 'X';
+  void *directory;
+  // trailer: rules, one per line
+};
+
+// Sent right before the DirectoryWatchRequest of `directory` to report writes to a file once it
+// is closed instead of for every write, see --settle-ms.
+struct DirectorySettleRequest {
+  char msg_type = 'W';
+  void *directory;
+  uint32_t settle_ms;  // how long a write to a file that stays open is held back, 0 does not
+};
+
+// Returns credits for events of `directory` that the client is done with. Each Event or EventStat
+// takes one. A watch that runs out drops its events and sends SubtreeDirty for the directories
+// that had any once it gets credits again, so that neither side buffers without bounds.
+struct EventCredits {
+  char msg_type = 'C';
+  void *directory;
+  uint32_t credits;
+};
+
 struct Event {
   char msg_type = 'U';
   void *directory;
   uint32_t action;
   // trailer: path
 };
+
+// Metadata of a file, all zeros if it is gone.
+struct FileStat {
+  uint32_t mode = 0;       // st_mode, including the file type
+  uint64_t size = 0;       // bytes
+  uint64_t allocated = 0;  // bytes
+  uint64_t ino = 0;
+  int64_t btime = 0;  // nanoseconds since the Unix epoch, 0 if the filesystem does not know
+  int64_t mtime = 0;
+  int64_t ctime = 0;
+  int64_t atime = 0;
+};
+
+// An Event with the metadata of the file right after it was reported. Both start the same way.
+// Removals and failures come with zeros.
+struct EventStat {
+  char msg_type = 'E';
+  void *directory;
+  uint32_t action;
+  FileStat stat;
+  // trailer: path
+};
+
+// Asks for the entries of a directory of a watch, which are sent back as DirectoryListChunks.
+struct DirectoryListRequest {
+  char msg_type = 'L';
+  void *directory;  // of the watch
+  uint64_t id;      // chosen by the client, repeated in the chunks
+  bool with_stat;
+  // trailer: path relative to the watched directory, empty for the directory itself
+};
+
+// Part of the answer to a DirectoryListRequest. Huge directories take several chunks, the last
+// one has `is_last` set. Errors come in a last chunk of their own.
+struct DirectoryListChunk {
+  char msg_type = 'l';
+  void *directory;
+  uint64_t id;
+  uint32_t error = 0;      // errno
+  bool is_last = false;
+  bool is_cached = false;  // whether the daemon answered without listing the directory
+  // trailer: DirectoryListEntries
+};
+
+struct DirectoryListEntry {
+  uint32_t type;  // the S_IFMT bits of st_mode
+  uint32_t name_length;
+  // followed by the name and, if asked for, a FileStat
+};
+
+// Asks for digests of the contents of files of a watch, answered by a FileDigestReply.
+struct FileDigestRequest {
+  char msg_type = 'H';
+  void *directory;  // of the watch
+  uint64_t id;      // chosen by the client, repeated in the reply
+  // trailer: paths relative to the watched directory, each followed by a NUL
+};
+
+struct FileDigestReply {
+  char msg_type = 'h';
+  void *directory;
+  uint64_t id;
+  // trailer: a FileDigest for each requested path, in the same order
+};
+
+struct FileDigest {
+  uint64_t digest = 0;  // XXH64 of the contents, see file-digest.h
+  uint64_t size = 0;    // what was digested
+  int64_t mtime = 0;    // nanoseconds since the Unix epoch
+  // errno, EISDIR for directories, EINVAL for other non-regular files and for paths that would
+  // leave the watch, and EFBIG for files too large to be digested
+  uint32_t error = 0;
+};
+
+// Sent periodically while a recursive watch is being set up.
+struct WatchProgress {
+  char msg_type = 'P';
+  void *directory;
+  uint64_t watched;  // directories that already have a watch
+  uint64_t queued;   // directories that still have to be crawled
+};
+
+// Sent once the watch covers the whole tree for the first time.
+struct WatchReady {
+  char msg_type = 'R';
+  void *directory;
+};
+
+// Sent for each mount below a recursive watch that the watch does not descend into.
+struct MountSkipped {
+  char msg_type = 'M';
+  void *directory;
+  // trailer: path relative to the watched directory
+};
+
+// Sent instead of the events of a subtree that changes too fast for them to be of any use. The
+// client should list the subtree again, and is sent another one if the storm lasted beyond that.
+struct SubtreeDirty {
+  char msg_type = 'O';
+  void *directory;
+  // trailer: path relative to the watched directory, empty for the whole tree
+};
 #pragma pack(pop)
+
+// The structs above are copied to and from the pipe as they are, by a daemon and a DLL that are
+// built by different compilers. Pin their layout down so that a change shows up at build time.
+static_assert(sizeof(void *) == 8, "the protocol carries 64-bit handles");
+
+static_assert(sizeof(HelloRequest) == 9);
+static_assert(offsetof(HelloRequest, capabilities) == 5);
+
+static_assert(sizeof(DirectoryWatchRequest) == 14);
+static_assert(offsetof(DirectoryWatchRequest, directory) == 1);
+static_assert(offsetof(DirectoryWatchRequest, filter) == 9);
+static_assert(offsetof(DirectoryWatchRequest, recursive) == 13);
+
+static_assert(sizeof(DirectoryUnwatchRequest) == 9);
+static_assert(offsetof(DirectoryUnwatchRequest, directory) == 1);
+
+static_assert(sizeof(DirectoryExcludeRequest) == 9);
+static_assert(offsetof(DirectoryExcludeRequest, directory) == 1);
+
+static_assert(sizeof(DirectorySettleRequest) == 13);
+static_assert(offsetof(DirectorySettleRequest, directory) == 1);
+static_assert(offsetof(DirectorySettleRequest, settle_ms) == 9);
+
+static_assert(sizeof(EventCredits) == 13);
+static_assert(offsetof(EventCredits, directory) == 1);
+static_assert(offsetof(EventCredits, credits) == 9);
+
+static_assert(sizeof(Event) == 13);
+static_assert(offsetof(Event, directory) == 1);
+static_assert(offsetof(Event, action) == 9);
+
+static_assert(sizeof(FileStat) == 60);
+static_assert(offsetof(FileStat, size) == 4);
+static_assert(offsetof(FileStat, allocated) == 12);
+static_assert(offsetof(FileStat, ino) == 20);
+static_assert(offsetof(FileStat, btime) == 28);
+static_assert(offsetof(FileStat, mtime) == 36);
+static_assert(offsetof(FileStat, ctime) == 44);
+static_assert(offsetof(FileStat, atime) == 52);
+
+static_assert(sizeof(EventStat) == 73);
+static_assert(offsetof(EventStat, directory) == offsetof(Event, directory));
+static_assert(offsetof(EventStat, action) == offsetof(Event, action));
+static_assert(offsetof(EventStat, stat) == 13);
+
+static_assert(sizeof(DirectoryListRequest) == 18);
+static_assert(offsetof(DirectoryListRequest, directory) == 1);
+static_assert(offsetof(DirectoryListRequest, id) == 9);
+static_assert(offsetof(DirectoryListRequest, with_stat) == 17);
+
+static_assert(sizeof(DirectoryListChunk) == 23);
+static_assert(offsetof(DirectoryListChunk, directory) == 1);
+static_assert(offsetof(DirectoryListChunk, id) == 9);
+static_assert(offsetof(DirectoryListChunk, error) == 17);
+static_assert(offsetof(DirectoryListChunk, is_last) == 21);
+static_assert(offsetof(DirectoryListChunk, is_cached) == 22);
+
+static_assert(sizeof(DirectoryListEntry) == 8);
+
+static_assert(sizeof(FileDigestRequest) == 17);
+static_assert(offsetof(FileDigestRequest, directory) == 1);
+static_assert(offsetof(FileDigestRequest, id) == 9);
+
+static_assert(sizeof(FileDigestReply) == 17);
+static_assert(offsetof(FileDigestReply, directory) == 1);
+static_assert(offsetof(FileDigestReply, id) == 9);
+
+static_assert(sizeof(FileDigest) == 28);
+static_assert(offsetof(FileDigest, size) == 8);
+static_assert(offsetof(FileDigest, mtime) == 16);
+static_assert(offsetof(FileDigest, error) == 24);
+
+static_assert(sizeof(WatchProgress) == 25);
+static_assert(offsetof(WatchProgress, directory) == 1);
+static_assert(offsetof(WatchProgress, watched) == 9);
+static_assert(offsetof(WatchProgress, queued) == 17);
+
+static_assert(sizeof(WatchReady) == 9);
+static_assert(offsetof(WatchReady, directory) == 1);
+
+static_assert(sizeof(MountSkipped) == 9);
+static_assert(offsetof(MountSkipped, directory) == 1);
+
+static_assert(sizeof(SubtreeDirty) == 9);
+static_assert(offsetof(SubtreeDirty, directory) == 1);
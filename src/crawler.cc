@@ -0,0 +1,195 @@
+#include "crawler.h"
+
+#include <dirent.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <cassert>
+#include <cerrno>
+#include <cstring>
+
+Crawler crawler;
+
+// Requests a worker takes at once, so that results come back in batches.
+const size_t WORKER_BATCH = 16;
+
+Crawler::~Crawler() {
+  {
+    std::lock_guard lock{mutex};
+    is_stopping = true;
+  }
+  has_requests.notify_all();
+  for (auto &thread : threads) {
+    thread.join();
+  }
+}
+
+void Crawler::start(struct ev_loop *loop_, unsigned thread_cnt) {
+  assert(threads.empty());
+  loop = loop_;
+  for (unsigned i = 0; i < thread_cnt; ++i) {
+    threads.emplace_back(&Crawler::work, this);
+  }
+}
+
+void Crawler::submit(CrawlRequest request) {
+  {
+    std::lock_guard lock{mutex};
+    requests.push_back(std::move(request));
+  }
+  if (threads.size()) {
+    has_requests.notify_one();
+  }
+}
+
+bool Crawler::has_results() {
+  std::lock_guard lock{mutex};
+  return results.size() || (threads.empty() && requests.size());
+}
+
+std::vector<CrawlResult> Crawler::take_results(size_t max_cnt) {
+  std::vector<CrawlResult> batch;
+  std::lock_guard lock{mutex};
+  if (threads.empty()) {
+    while (requests.size() && batch.size() < max_cnt) {
+      batch.emplace_back().request = std::move(requests.front());
+      requests.pop_front();
+      list(batch.back());
+    }
+  }
+  while (results.size() && batch.size() < max_cnt) {
+    batch.push_back(std::move(results.front()));
+    results.pop_front();
+  }
+  return batch;
+}
+
+void Crawler::work() {
+  std::vector<CrawlResult> batch;
+
+  while (true) {
+    {
+      std::unique_lock lock{mutex};
+      has_requests.wait(lock, [&] { return requests.size() || is_stopping; });
+      if (is_stopping) {
+        return;
+      }
+      while (requests.size() && batch.size() < WORKER_BATCH) {
+        batch.emplace_back().request = std::move(requests.front());
+        requests.pop_front();
+      }
+    }
+
+    for (auto &result : batch) {
+      list(result);
+    }
+
+    {
+      std::lock_guard lock{mutex};
+      for (auto &result : batch) {
+        results.push_back(std::move(result));
+      }
+    }
+    batch.clear();
+    ev_async_send(loop, &ev_watcher);
+  }
+}
+
+void Crawler::list(CrawlResult &result) {
+  const size_t BUFF = 32 * 1024;
+  static thread_local char buff[BUFF] __attribute__((aligned(alignof(dirent64))));
+
+  int fd = open(result.request.path.data(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+  if (fd == -1) {
+    result.error = errno;
+    return;
+  }
+  // Listing mounts such as drvfs and 9p is slow, so it is skipped before getdents.
+  if (result.request.mount_id) {
+    auto mount_id = get_mount_id(fd);
+    if (mount_id && mount_id != result.request.mount_id) {
+      result.error = EXDEV;
+      close(fd);
+      return;
+    }
+  }
+
+  result.time = ev_time();
+  while (true) {
+    ssize_t len = getdents64(fd, buff, BUFF);
+    if (len <= 0) {
+      if (len == -1) {
+        result.error = errno;
+      }
+      break;
+    }
+
+    const dirent64 *entry = nullptr;
+    for (char *ptr = buff; ptr < buff + len; ptr += entry->d_reclen) {
+      entry = (const dirent64 *) ptr;
+
+      const char *name = entry->d_name;
+      if (name[0] == '.' && (name[1] == '\0' || (name[1] == '.' && name[2] == '\0'))) {
+        continue;
+      }
+      auto type = entry->d_type;
+      int64_t ctime = 0;
+      if (type == DT_UNKNOWN || (type != DT_DIR && result.request.with_ctime)) {
+        struct statx stx;
+        if (statx(fd, name, AT_SYMLINK_NOFOLLOW, STATX_TYPE | STATX_CTIME, &stx) == -1) {
+          continue;  // gone already
+        }
+        type = (uint8_t) IFTODT(stx.stx_mode);
+        ctime = stx.stx_ctime.tv_sec * 1'000'000'000LL + stx.stx_ctime.tv_nsec;
+      }
+      if (type == DT_DIR) {
+        result.subdirs.emplace_back(name);
+      } else {
+        result.files.push_back({
+            .name = (uint32_t) result.file_names.size(),
+            .type = type,
+            .ctime = ctime,
+        });
+        result.file_names.append(name, strlen(name) + 1);
+      }
+    }
+  }
+  close(fd);
+}
+
+uint64_t get_mount_id(int dir_fd, const char *path) {
+  struct statx stx;
+  int flags = AT_SYMLINK_NOFOLLOW | AT_NO_AUTOMOUNT | (*path ? 0 : AT_EMPTY_PATH);
+  if (statx(dir_fd, path, flags, STATX_MNT_ID, &stx) == -1) {
+    return 0;
+  }
+  if (stx.stx_mask & STATX_MNT_ID) {
+    return stx.stx_mnt_id;
+  }
+  return (uint64_t) stx.stx_dev_major << 32 | stx.stx_dev_minor;
+}
+
+namespace {
+  int64_t to_ns(const statx_timestamp &ts) {
+    return ts.tv_sec * 1'000'000'000LL + ts.tv_nsec;
+  }
+}  // namespace
+
+bool get_file_stat(int dir_fd, const char *path, FileStat &stat) {
+  struct statx stx;
+  // Whatever the page cache knows is good enough, network filesystems need not ask the server.
+  if (statx(dir_fd, path, AT_SYMLINK_NOFOLLOW | AT_STATX_DONT_SYNC,
+            STATX_BASIC_STATS | STATX_BTIME, &stx) == -1) {
+    return false;
+  }
+  stat.mode = stx.stx_mode;
+  stat.size = stx.stx_size;
+  stat.allocated = stx.stx_blocks * 512;
+  stat.ino = stx.stx_ino;
+  stat.btime = stx.stx_mask & STATX_BTIME ? to_ns(stx.stx_btime) : 0;
+  stat.mtime = to_ns(stx.stx_mtime);
+  stat.ctime = to_ns(stx.stx_ctime);
+  stat.atime = to_ns(stx.stx_atime);
+  return true;
+}
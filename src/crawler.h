@@ -0,0 +1,80 @@
+#pragma once
+
+#include <ev.h>
+
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <vector>
+
+#include "config.h"
+
+struct CrawlRequest {
+  uint64_t token;         // opaque to the crawler, identifies the directory for the requester
+  std::string path;       // absolute, with a trailing slash
+  uint64_t mount_id = 0;  // if set, directories on other mounts are not listed, see EXDEV
+  bool with_ctime = false;  // stat files for CrawlFile::ctime, which costs more than the listing
+};
+
+struct CrawlFile {
+  uint32_t name;  // offset in CrawlResult::file_names
+  uint8_t type;   // DT_*
+  int64_t ctime;  // in nanoseconds, 0 unless asked for
+};
+
+struct CrawlResult {
+  CrawlRequest request;
+  int error = 0;  // errno from opening or reading the directory, EXDEV if on another mount
+  double time = 0;  // wall clock before the directory was read
+  std::vector<std::string> subdirs;  // names of subdirectories, symlinks are not included
+  std::vector<CrawlFile> files;      // everything else
+  std::string file_names;            // of `files`, each followed by a NUL
+
+  std::string_view get_name(const CrawlFile &file) const {
+    return file_names.data() + file.name;
+  }
+};
+
+// Lists directories on a pool of worker threads. Requests are submitted and results are taken
+// back on the event loop thread only; `ev_watcher` fires when there are new results. Without
+// threads, directories are listed in take_results instead.
+class Crawler {
+  private:
+  struct ev_loop *loop = nullptr;
+  std::mutex mutex;
+  std::condition_variable has_requests;
+  std::deque<CrawlRequest> requests;
+  std::deque<CrawlResult> results;
+  std::vector<std::thread> threads;
+  bool is_stopping = false;
+
+  void work();
+
+  public:
+  ev_async ev_watcher;
+
+  ~Crawler();
+
+  void start(struct ev_loop *loop_, unsigned thread_cnt);
+
+  void submit(CrawlRequest request);
+
+  bool has_results();
+  std::vector<CrawlResult> take_results(size_t max_cnt);
+
+  static void list(CrawlResult &result);
+};
+
+extern Crawler crawler;
+
+// Identifies the mount that `path` (relative to `dir_fd`, or `dir_fd` itself if empty) is on:
+// the mount ID where statx reports it, st_dev before Linux 5.8. 0 if it cannot be told.
+uint64_t get_mount_id(int dir_fd, const char *path = "");
+
+// Fills `stat` for `path` relative to `dir_fd`, without following symlinks. Returns false if the
+// file is gone.
+bool get_file_stat(int dir_fd, const char *path, FileStat &stat);
@@ -0,0 +1,355 @@
+#include "directory-tree.h"
+
+#include <dirent.h>
+
+#include <algorithm>
+#include <functional>
+
+const size_t MIN_COMPACT_CHARS = 64 * 1024;
+// Only directories that see events end up in the cache, so it rarely gets this big.
+const size_t PATH_CACHE_SIZE = 64 * 1024;
+
+name_t NameArena::intern(std::string_view name) {
+  uint32_t hash = (uint32_t) std::hash<std::string_view>{}(name);
+  if (slots.size()) {
+    auto slot = find_slot(name, hash);
+    if (slots[slot] != NO_NAME) {
+      ++entries[slots[slot]].refs;
+      return slots[slot];
+    }
+  }
+
+  if (2 * (used_slots + 1) > slots.size()) {
+    grow();
+  }
+
+  name_t id;
+  if (free_entries.size()) {
+    id = free_entries.back();
+    free_entries.pop_back();
+  } else {
+    id = (name_t) entries.size();
+    entries.emplace_back();
+  }
+  entries[id] = {
+      .offset = (uint32_t) chars.size(),
+      .length = (uint32_t) name.size(),
+      .refs = 1,
+      .hash = hash,
+  };
+  chars += name;
+
+  slots[find_slot(name, hash)] = id;
+  ++used_slots;
+  return id;
+}
+
+name_t NameArena::find(std::string_view name) const {
+  if (!slots.size()) {
+    return NO_NAME;
+  }
+  return slots[find_slot(name, (uint32_t) std::hash<std::string_view>{}(name))];
+}
+
+void NameArena::release(name_t name) {
+  auto &entry = entries[name];
+  if (--entry.refs) {
+    return;
+  }
+  erase_slot(find_slot(get(name), entry.hash));
+  dead_chars += entry.length;
+  free_entries.push_back(name);
+
+  if (chars.size() >= MIN_COMPACT_CHARS && 2 * dead_chars > chars.size()) {
+    compact();
+  }
+}
+
+size_t NameArena::find_slot(std::string_view name, uint32_t hash) const {
+  size_t mask = slots.size() - 1;
+  for (size_t slot = hash & mask;; slot = (slot + 1) & mask) {
+    auto id = slots[slot];
+    if (id == NO_NAME || (entries[id].hash == hash && get(id) == name)) {
+      return slot;
+    }
+  }
+}
+
+// Backward shift deletion: moves later entries of the probe sequence into the hole so that
+// lookups never have to skip tombstones.
+void NameArena::erase_slot(size_t slot) {
+  size_t mask = slots.size() - 1;
+  size_t hole = slot;
+  for (size_t curr = (slot + 1) & mask; slots[curr] != NO_NAME; curr = (curr + 1) & mask) {
+    size_t home = entries[slots[curr]].hash & mask;
+    if (((curr - home) & mask) >= ((curr - hole) & mask)) {
+      slots[hole] = slots[curr];
+      hole = curr;
+    }
+  }
+  slots[hole] = NO_NAME;
+  --used_slots;
+}
+
+void NameArena::grow() {
+  std::vector<name_t> old_slots(std::max<size_t>(16, 2 * slots.size()), NO_NAME);
+  old_slots.swap(slots);
+  size_t mask = slots.size() - 1;
+  for (auto id : old_slots) {
+    if (id == NO_NAME) {
+      continue;
+    }
+    size_t slot = entries[id].hash & mask;
+    while (slots[slot] != NO_NAME) {
+      slot = (slot + 1) & mask;
+    }
+    slots[slot] = id;
+  }
+}
+
+void NameArena::compact() {
+  std::string live;
+  live.reserve(chars.size() - dead_chars);
+  for (auto &entry : entries) {
+    if (entry.refs) {
+      auto offset = (uint32_t) live.size();
+      live.append(chars, entry.offset, entry.length);
+      entry.offset = offset;
+    }
+  }
+  chars = std::move(live);
+  dead_chars = 0;
+}
+
+size_t NameArena::memory_usage() const {
+  return chars.capacity() + entries.capacity() * sizeof(Entry) +
+         free_entries.capacity() * sizeof(name_t) + slots.capacity() * sizeof(name_t);
+}
+
+size_t DirMap::get_home(uint64_t key) const {
+  // splitmix64 finalizer, keys are far from random.
+  key ^= key >> 30;
+  key *= 0xbf58476d1ce4e5b9;
+  key ^= key >> 27;
+  key *= 0x94d049bb133111eb;
+  key ^= key >> 31;
+  return key & (slots.size() - 1);
+}
+
+size_t DirMap::find_slot(uint64_t key) const {
+  size_t mask = slots.size() - 1;
+  for (size_t slot = get_home(key);; slot = (slot + 1) & mask) {
+    if (slots[slot].dir == NO_DIR || get_key(slots[slot]) == key) {
+      return slot;
+    }
+  }
+}
+
+dir_t DirMap::find(uint64_t key) const {
+  return slots.size() ? slots[find_slot(key)].dir : NO_DIR;
+}
+
+void DirMap::set(uint64_t key, dir_t dir) {
+  if (4 * (used + 1) > 3 * slots.size()) {
+    grow();
+  }
+  auto &slot = slots[find_slot(key)];
+  if (slot.dir == NO_DIR) {
+    ++used;
+  }
+  slot = {(uint32_t) key, (uint32_t) (key >> 32), dir};
+}
+
+void DirMap::erase(uint64_t key, dir_t dir) {
+  if (!slots.size()) {
+    return;
+  }
+  size_t hole = find_slot(key);
+  if (slots[hole].dir != dir) {
+    return;
+  }
+  // Backward shift deletion, see NameArena::erase_slot.
+  size_t mask = slots.size() - 1;
+  for (size_t curr = (hole + 1) & mask; slots[curr].dir != NO_DIR; curr = (curr + 1) & mask) {
+    size_t home = get_home(get_key(slots[curr]));
+    if (((curr - home) & mask) >= ((curr - hole) & mask)) {
+      slots[hole] = slots[curr];
+      hole = curr;
+    }
+  }
+  slots[hole].dir = NO_DIR;
+  --used;
+}
+
+void DirMap::grow() {
+  std::vector<Slot> old_slots(std::max<size_t>(16, 2 * slots.size()), Slot{0, 0, NO_DIR});
+  old_slots.swap(slots);
+  for (const auto &slot : old_slots) {
+    if (slot.dir != NO_DIR) {
+      slots[find_slot(get_key(slot))] = slot;
+    }
+  }
+}
+
+dir_t DirectoryTree::add(int wd_, dir_t parent_, std::string_view name_) {
+  dir_t dir;
+  if (free_dirs.size()) {
+    dir = free_dirs.back();
+    free_dirs.pop_back();
+  } else {
+    dir = (dir_t) wd.size();
+    wd.emplace_back();
+    name.emplace_back();
+    parent.emplace_back();
+    first_child.emplace_back();
+    next_sibling.emplace_back();
+    prev_sibling.emplace_back();
+    move_cookie.emplace_back();
+    gen.emplace_back();
+    fail_cnt.emplace_back();
+    flags.emplace_back();
+    files.emplace_back();
+  }
+  ++live_cnt;
+
+  wd[dir] = wd_;
+  name[dir] = names.intern(name_);
+  first_child[dir] = NO_DIR;
+  move_cookie[dir] = 0;
+  fail_cnt[dir] = 0;
+  flags[dir] = 0;
+  link(dir, parent_);
+  return dir;
+}
+
+void DirectoryTree::move(dir_t dir, dir_t new_parent, std::string_view new_name) {
+  unlink(dir);
+  auto old_name = name[dir];
+  name[dir] = names.intern(new_name);
+  names.release(old_name);
+  link(dir, new_parent);
+  ++move_gen;
+}
+
+dir_t DirectoryTree::find_child(dir_t dir, std::string_view child_name) const {
+  auto id = names.find(child_name);
+  return id == NO_NAME ? NO_DIR : children.find(child_key(dir, id));
+}
+
+FileEntry *DirectoryTree::find_file(dir_t dir, std::string_view file_name) {
+  auto id = names.find(file_name);
+  if (id == NO_NAME) {
+    return nullptr;
+  }
+  auto pos = file_pos.find(child_key(dir, id));
+  return pos == NO_DIR ? nullptr : &files[dir][pos];
+}
+
+FileEntry &DirectoryTree::add_file(dir_t dir, std::string_view file_name) {
+  auto id = names.intern(file_name);
+  file_pos.set(child_key(dir, id), (uint32_t) files[dir].size());
+  auto &file = files[dir].emplace_back();
+  file = {.name = id, .type = DT_UNKNOWN, .flags = 0, .since = 0, .seq = 0};
+  return file;
+}
+
+void DirectoryTree::erase_file(dir_t dir, size_t pos) {
+  auto &entries = files[dir];
+  file_pos.erase(child_key(dir, entries[pos].name), (uint32_t) pos);
+  names.release(entries[pos].name);
+  if (pos + 1 != entries.size()) {
+    entries[pos] = entries.back();
+    file_pos.set(child_key(dir, entries[pos].name), (uint32_t) pos);
+  }
+  entries.pop_back();
+}
+
+std::string_view DirectoryTree::get_rel_path(dir_t dir) {
+  if (path_cache.size() >= PATH_CACHE_SIZE) {
+    path_cache.clear();
+  }
+  return get_cached_path(dir);
+}
+
+std::string_view DirectoryTree::get_cached_path(dir_t dir) {
+  if (parent[dir] == NO_DIR) {
+    return {};
+  }
+  // Entries do not move when the map rehashes, so neither the reference nor the parent's view
+  // are invalidated by the recursion.
+  auto &cached = path_cache[dir];
+  if (cached.gen != gen[dir] || cached.move_gen != move_gen) {
+    auto parent_path = get_cached_path(parent[dir]);
+    cached.path.assign(parent_path);
+    cached.path += get_name(dir);
+    cached.path += '/';
+    cached.gen = gen[dir];
+    cached.move_gen = move_gen;
+  }
+  return cached.path;
+}
+
+size_t DirectoryTree::memory_usage() const {
+  size_t file_bytes = files.capacity() * sizeof(files[0]);
+  for (const auto &entries : files) {
+    file_bytes += entries.capacity() * sizeof(FileEntry);
+  }
+  return file_bytes + file_pos.memory_usage() + wd.capacity() * sizeof(int) +
+         name.capacity() * sizeof(name_t) +
+         (parent.capacity() + first_child.capacity() + next_sibling.capacity() +
+          prev_sibling.capacity() + free_dirs.capacity()) *
+             sizeof(dir_t) +
+         move_cookie.capacity() * sizeof(uint64_t) + gen.capacity() * sizeof(uint32_t) +
+         fail_cnt.capacity() + flags.capacity() + names.memory_usage() +
+         children.memory_usage() +
+         path_cache.size() * sizeof(std::pair<const dir_t, CachedPath>);
+}
+
+void DirectoryTree::link(dir_t dir, dir_t new_parent) {
+  parent[dir] = new_parent;
+  prev_sibling[dir] = NO_DIR;
+  next_sibling[dir] = NO_DIR;
+  if (new_parent == NO_DIR) {
+    return;
+  }
+  auto next = first_child[new_parent];
+  if (next != NO_DIR) {
+    prev_sibling[next] = dir;
+  }
+  next_sibling[dir] = next;
+  first_child[new_parent] = dir;
+  children.set(child_key(new_parent, name[dir]), dir);
+}
+
+void DirectoryTree::unlink(dir_t dir) {
+  if (parent[dir] != NO_DIR) {
+    children.erase(child_key(parent[dir], name[dir]), dir);
+  }
+  auto prev = prev_sibling[dir], next = next_sibling[dir];
+  if (prev != NO_DIR) {
+    next_sibling[prev] = next;
+  } else if (parent[dir] != NO_DIR) {
+    first_child[parent[dir]] = next;
+  }
+  if (next != NO_DIR) {
+    prev_sibling[next] = prev;
+  }
+  parent[dir] = prev_sibling[dir] = next_sibling[dir] = NO_DIR;
+}
+
+void DirectoryTree::recycle(dir_t dir) {
+  // Only the top of a removed subtree is unlinked, the rest still has its parent.
+  if (parent[dir] != NO_DIR) {
+    children.erase(child_key(parent[dir], name[dir]), dir);
+  }
+  names.release(name[dir]);
+  for (const auto &file : files[dir]) {
+    file_pos.erase(child_key(dir, file.name), (uint32_t) (&file - files[dir].data()));
+    names.release(file.name);
+  }
+  std::vector<FileEntry>{}.swap(files[dir]);
+  wd[dir] = -1;
+  ++gen[dir];
+  free_dirs.push_back(dir);
+  --live_cnt;
+}
@@ -0,0 +1,222 @@
+#pragma once
+
+#include <cstdint>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+using name_t = uint32_t;
+const name_t NO_NAME = UINT32_MAX;
+
+// Names of directories and files, each stored once however many entries share it. Names are
+// reference counted; the bytes of released names are reclaimed by compacting the arena once they
+// make up most of it.
+class NameArena {
+  private:
+  struct Entry {
+    uint32_t offset;
+    uint32_t length;
+    uint32_t refs;
+    uint32_t hash;
+  };
+
+  std::string chars;
+  size_t dead_chars = 0;
+  std::vector<Entry> entries;
+  std::vector<name_t> free_entries;
+  // Open addressing with linear probing, NO_NAME marks an empty slot.
+  std::vector<name_t> slots;
+  size_t used_slots = 0;
+
+  size_t find_slot(std::string_view name, uint32_t hash) const;
+  void erase_slot(size_t slot);
+  void grow();
+  void compact();
+
+  public:
+  // Returns the name with one more reference.
+  name_t intern(std::string_view name);
+  name_t find(std::string_view name) const;
+  void release(name_t name);
+
+  std::string_view get(name_t name) const {
+    const auto &entry = entries[name];
+    return {chars.data() + entry.offset, entry.length};
+  }
+
+  size_t memory_usage() const;
+};
+
+using dir_t = uint32_t;
+const dir_t NO_DIR = UINT32_MAX;
+
+// Refers to a directory across calls that may remove it. get() tells a removed directory apart
+// from one that reuses its slot.
+struct DirRef {
+  dir_t dir = NO_DIR;
+  uint32_t gen = 0;
+};
+
+// Maps 64-bit keys to directories, or to any other 32-bit value but NO_DIR, with open addressing
+// and linear probing. A slot takes 12 bytes; empty slots hold NO_DIR.
+class DirMap {
+  private:
+  struct Slot {
+    uint32_t key_lo, key_hi;
+    dir_t dir;
+  };
+
+  std::vector<Slot> slots;
+  size_t used = 0;
+
+  static uint64_t get_key(const Slot &slot) {
+    return (uint64_t) slot.key_hi << 32 | slot.key_lo;
+  }
+
+  size_t get_home(uint64_t key) const;
+  size_t find_slot(uint64_t key) const;
+  void grow();
+
+  public:
+  dir_t find(uint64_t key) const;
+  void set(uint64_t key, dir_t dir);
+  // Only erases the key if it still maps to `dir`.
+  void erase(uint64_t key, dir_t dir);
+
+  template <typename F>
+  void for_each(F &&f) const {
+    for (const auto &slot : slots) {
+      if (slot.dir != NO_DIR) {
+        f(get_key(slot), slot.dir);
+      }
+    }
+  }
+
+  size_t size() const {
+    return used;
+  }
+
+  size_t memory_usage() const {
+    return slots.capacity() * sizeof(Slot);
+  }
+};
+
+// What the last listing of a directory said about an entry that is not in the tree, kept up to
+// date by events as far as they tell.
+struct FileEntry {
+  enum : uint8_t {
+    DELETED = 1 << 0,  // kept until a listing that may still show the entry comes back
+    SEEN = 1 << 1,     // only used while comparing with a listing
+  };
+
+  name_t name;
+  uint8_t type;  // DT_*, DT_UNKNOWN if only known from an event
+  uint8_t flags;
+  // Wall clock shortly before the entry was last listed or had an event, in nanoseconds. Only
+  // files with a later ctime can have changed unnoticed, which even writes that set the mtime
+  // back bump, so listings need no stat.
+  int64_t since;
+  // Inotify::event_seq as of the last event about the entry, 0 if there was none since the last
+  // listing.
+  uint64_t seq;
+};
+
+// The directories of a watch, stored as parallel arrays indexed by dir_t. Slots of removed
+// directories are recycled through a free list. Children form a doubly linked list through
+// `first_child` and the sibling arrays, and can be looked up by name through `children`.
+struct DirectoryTree {
+  enum : uint8_t {
+    ALREADY_ADDED = 1 << 0,  // crawled successfully at least once
+    IN_QUEUE = 1 << 1,
+    RESCAN = 1 << 2,  // events may have been lost since the last listing
+    SEEN = 1 << 3,    // only used while comparing with a listing
+  };
+
+  std::vector<int> wd;
+  std::vector<name_t> name;
+  std::vector<dir_t> parent, first_child, next_sibling, prev_sibling;
+  // Inotify::event_seq as of the last time the directory was added, moved or deleted. A listing
+  // made before that cannot be trusted.
+  std::vector<uint64_t> move_cookie;
+  std::vector<uint32_t> gen;
+  std::vector<uint8_t> fail_cnt, flags;
+  // The other entries of each directory, in no particular order.
+  std::vector<std::vector<FileEntry>> files;
+
+  NameArena names;
+  DirMap children;  // see child_key
+  DirMap file_pos;  // child_key -> index in files[dir]
+  std::vector<dir_t> free_dirs;
+  size_t live_cnt = 0;
+  // Bumped by every move, which makes all cached paths stale at once. Moves are rare compared
+  // to events, and stale paths are rebuilt from their parents' cached paths.
+  uint64_t move_gen = 1;
+
+  dir_t add(int wd_, dir_t parent_, std::string_view name_);
+  // Removes `dir` and everything below it, calling `on_remove` for each of them first.
+  template <typename F>
+  void remove(dir_t dir, F &&on_remove);
+  void move(dir_t dir, dir_t new_parent, std::string_view new_name);
+
+  dir_t find_child(dir_t dir, std::string_view child_name) const;
+
+  // Pointers into `files` are only valid until the next add_file or erase_file.
+  FileEntry *find_file(dir_t dir, std::string_view file_name);
+  // The name must not be in files[dir] yet. Everything but the name is left to the caller.
+  FileEntry &add_file(dir_t dir, std::string_view file_name);
+  // Moves the last entry of files[dir] into `pos`.
+  void erase_file(dir_t dir, size_t pos);
+
+  DirRef ref(dir_t dir) const {
+    return {dir, gen[dir]};
+  }
+
+  dir_t get(DirRef ref) const {
+    return ref.dir < gen.size() && gen[ref.dir] == ref.gen ? ref.dir : NO_DIR;
+  }
+
+  std::string_view get_name(dir_t dir) const {
+    return names.get(name[dir]);
+  }
+
+  // Path relative to the root with a trailing slash, empty for the root. The view is valid until
+  // the next call.
+  std::string_view get_rel_path(dir_t dir);
+
+  size_t memory_usage() const;
+
+  private:
+  static uint64_t child_key(dir_t dir, name_t child_name) {
+    return (uint64_t) dir << 32 | child_name;
+  }
+
+  struct CachedPath {
+    uint32_t gen = 0;
+    uint64_t move_gen = 0;
+    std::string path;
+  };
+
+  std::unordered_map<dir_t, CachedPath> path_cache;
+
+  std::string_view get_cached_path(dir_t dir);
+  void link(dir_t dir, dir_t new_parent);
+  void unlink(dir_t dir);
+  void recycle(dir_t dir);
+};
+
+template <typename F>
+void DirectoryTree::remove(dir_t dir, F &&on_remove) {
+  unlink(dir);
+
+  std::vector<dir_t> stack{dir};
+  while (stack.size()) {
+    auto curr = stack.back();
+    stack.pop_back();
+    for (auto child = first_child[curr]; child != NO_DIR; child = next_sibling[child]) {
+      stack.push_back(child);
+    }
+    on_remove(curr);
+    recycle(curr);
+  }
+}
@@ -0,0 +1,36 @@
+#include "dirty-set.h"
+
+bool DirtySet::has_ancestor(std::string_view dir) const {
+  if (dir.empty()) {
+    return false;
+  }
+  for (auto slash = dir.rfind('/'); slash != dir.npos; slash = dir.rfind('/', slash - 1)) {
+    if (dirs.contains(dir.substr(0, slash))) {
+      return true;
+    }
+    if (!slash) {
+      break;
+    }
+  }
+  return dirs.contains(std::string_view{});
+}
+
+void DirtySet::add(std::string_view dir) {
+  if (dirs.contains(std::string_view{})) {
+    return;
+  }
+  dirs.emplace(dir);
+  if (dirs.size() > MAX_DIRS) {
+    dirs.clear();
+    dirs.emplace();
+  }
+}
+
+size_t DirtySet::memory_usage() const {
+  // Roughly, a red-black tree node holds three pointers and a color next to the value.
+  size_t res = dirs.size() * (sizeof(std::string) + 4 * sizeof(void *));
+  for (const auto &dir : dirs) {
+    res += dir.capacity();
+  }
+  return res;
+}
@@ -0,0 +1,45 @@
+#pragma once
+
+#include <cstddef>
+#include <set>
+#include <string>
+#include <string_view>
+#include <vector>
+
+// Directories of a watch that had events dropped, to be reported as dirty subtrees later. Past
+// `MAX_DIRS` it stops telling them apart and covers the whole watch.
+class DirtySet {
+  private:
+  static constexpr size_t MAX_DIRS = 256;
+
+  std::set<std::string, std::less<>> dirs;  // relative to the watch, "" for the whole watch
+
+  bool has_ancestor(std::string_view dir) const;
+
+  public:
+  bool empty() const {
+    return dirs.empty();
+  }
+
+  void add(std::string_view dir);
+
+  // Calls f(dir) for every directory that is not below another one, and forgets them all.
+  template <typename F>
+  void drain(F &&f);
+
+  size_t memory_usage() const;
+};
+
+template <typename F>
+void DirtySet::drain(F &&f) {
+  std::vector<std::string> outermost;
+  for (const auto &dir : dirs) {
+    if (!has_ancestor(dir)) {
+      outermost.push_back(dir);
+    }
+  }
+  dirs.clear();
+  for (const auto &dir : outermost) {
+    f(std::string_view{dir});
+  }
+}
@@ -0,0 +1,41 @@
+#include "event-coalescer.h"
+
+void EventCoalescer::add(FileAction action, std::initializer_list<std::string_view> parts) {
+  ++added_cnt;
+  std::string path;
+  for (auto part : parts) {
+    path += part;
+  }
+
+  auto [it, is_new] = last.try_emplace(std::move(path), NO_EVENT);
+  auto prev = it->second;
+  auto prev_action = prev == NO_EVENT ? FILE_ACTION_FAILED : events[prev].action;
+  if (action == FILE_ACTION_MODIFIED &&
+      (prev_action == FILE_ACTION_ADDED || prev_action == FILE_ACTION_MODIFIED)) {
+    ++dropped_cnt;
+    return;
+  }
+  if (action == FILE_ACTION_REMOVED && prev_action == FILE_ACTION_ADDED) {
+    events[prev].is_dropped = true;
+    dropped_cnt += 2;
+    if (events[prev].prev == NO_EVENT) {
+      last.erase(it);
+    } else {
+      it->second = events[prev].prev;
+    }
+    return;
+  }
+
+  it->second = (uint32_t) events.size();
+  events.push_back({.action = action, .is_dropped = false, .prev = prev, .path = it->first});
+}
+
+size_t EventCoalescer::memory_usage() const {
+  size_t res = events.capacity() * sizeof(Pending) + last.bucket_count() * sizeof(void *) +
+               last.size() * (sizeof(std::pair<const std::string, uint32_t>) + sizeof(void *));
+  // Roughly, paths are stored both in `events` and as keys of `last`.
+  for (const auto &event : events) {
+    res += 2 * event.path.size();
+  }
+  return res;
+}
@@ -0,0 +1,56 @@
+#pragma once
+
+#include <cstdint>
+#include <initializer_list>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+#include "config.h"
+
+// Holds back the events of a watch so that bursts for the same path collapse:
+//  - a MODIFIED right after an ADDED or MODIFIED of the same path is dropped
+//  - a REMOVED right after an ADDED of the same path drops both
+// What is left comes out in the order it went in.
+class EventCoalescer {
+  private:
+  static constexpr uint32_t NO_EVENT = UINT32_MAX;
+
+  struct Pending {
+    FileAction action;
+    bool is_dropped;
+    uint32_t prev;  // the pending event before it for the same path
+    std::string path;
+  };
+
+  std::vector<Pending> events;
+  std::unordered_map<std::string, uint32_t> last;  // path -> its latest pending event
+
+  public:
+  uint64_t added_cnt = 0, dropped_cnt = 0;
+
+  bool empty() const {
+    return events.empty();
+  }
+
+  // The path is the concatenation of `parts`.
+  void add(FileAction action, std::initializer_list<std::string_view> parts);
+
+  // Calls f(action, path) for every event that is left, and forgets them.
+  template <typename F>
+  void drain(F &&f);
+
+  size_t memory_usage() const;
+};
+
+template <typename F>
+void EventCoalescer::drain(F &&f) {
+  for (const auto &event : events) {
+    if (!event.is_dropped) {
+      f(event.action, std::string_view{event.path});
+    }
+  }
+  events.clear();
+  last.clear();
+}
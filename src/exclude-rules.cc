@@ -0,0 +1,248 @@
+#include "exclude-rules.h"
+
+#include <algorithm>
+
+// Transitions take 1 KiB per state. Pathological rules could need exponentially many states,
+// those are dropped all at once and rebuilt as paths need them.
+const size_t MAX_DFA_STATES = 1024;
+
+namespace {
+  // Parses the "[...]" starting at line[i] and leaves `i` on its ']'. Returns false if the set is
+  // not closed, the '[' is then taken literally like git does.
+  bool parse_set(std::string_view line, size_t &i, std::bitset<256> &set) {
+    size_t j = i + 1;
+    bool negated = j < line.size() && (line[j] == '!' || line[j] == '^');
+    if (negated) {
+      ++j;
+    }
+    // A ']' right after the '[' is part of the set.
+    for (size_t first = j; j < line.size() && (line[j] != ']' || j == first); ++j) {
+      auto lo = (uint8_t) line[j];
+      if (lo == '\\' && j + 1 < line.size()) {
+        lo = (uint8_t) line[++j];
+      }
+      auto hi = lo;
+      if (j + 2 < line.size() && line[j + 1] == '-' && line[j + 2] != ']') {
+        hi = (uint8_t) line[j + 2];
+        j += 2;
+      }
+      for (unsigned c = lo; c <= hi; ++c) {
+        set.set(c);
+      }
+    }
+    if (j >= line.size()) {
+      return false;
+    }
+    if (negated) {
+      set.flip();
+    }
+    set.reset('/');
+    i = j;
+    return true;
+  }
+}  // namespace
+
+void ExcludeRules::compile(std::string_view text) {
+  *this = {};
+  while (text.size()) {
+    auto eol = text.find('\n');
+    add_rule(text.substr(0, eol));
+    text.remove_prefix(eol == text.npos ? text.size() : eol + 1);
+  }
+  reset_dfa();
+}
+
+void ExcludeRules::add_rule(std::string_view line) {
+  while (line.size() && (line.back() == '\r' || line.back() == ' ')) {
+    line.remove_suffix(1);
+  }
+  if (line.empty() || line[0] == '#') {
+    return;
+  }
+  Rule rule{.negated = line[0] == '!', .dir_only = false};
+  if (rule.negated) {
+    line.remove_prefix(1);
+  }
+  if (line.size() && line.back() == '/') {
+    rule.dir_only = true;
+    line.remove_suffix(1);
+  }
+  bool anchored = line.find('/') != line.npos;
+  if (line.size() && line[0] == '/') {
+    line.remove_prefix(1);
+  }
+  if (line.empty()) {
+    return;
+  }
+
+  auto start = (uint32_t) tokens.size();
+  if (!anchored) {
+    tokens.push_back({.kind = DIRS});
+  }
+  for (size_t i = 0; i < line.size(); ++i) {
+    char c = line[i];
+    if (c == '\\' && i + 1 < line.size()) {
+      tokens.push_back({.kind = CHAR, .c = (uint8_t) line[++i]});
+    } else if (c == '*') {
+      auto end = std::min(line.find_first_not_of('*', i), line.size());
+      // "**" only means more than '*' as a whole path component.
+      bool is_component = end - i >= 2 && (i == 0 || line[i - 1] == '/');
+      if (is_component && end == line.size()) {
+        tokens.push_back({.kind = ALL});
+      } else if (is_component && line[end] == '/') {
+        tokens.push_back({.kind = DIRS});
+        ++end;
+      } else {
+        tokens.push_back({.kind = STAR});
+      }
+      i = end - 1;
+    } else if (c == '?') {
+      tokens.push_back({.kind = ANY});
+    } else if (std::bitset<256> set; c == '[' && parse_set(line, i, set)) {
+      tokens.push_back({.kind = SET, .set = (uint32_t) sets.size()});
+      sets.push_back(set);
+    } else {
+      tokens.push_back({.kind = CHAR, .c = (uint8_t) c});
+    }
+  }
+  tokens.push_back({.kind = END, .rule = (uint32_t) rules.size()});
+  rules.push_back(rule);
+  starts.push_back(start);
+}
+
+bool ExcludeRules::is_excluded(std::initializer_list<std::string_view> parts, bool is_dir) {
+  if (rules.empty()) {
+    return false;
+  }
+  int32_t state = 0;
+  for (auto part : parts) {
+    for (char c : part) {
+      if (c == '/' && states[state].excludes_dir) {
+        return true;  // so is everything below
+      }
+      state = step(state, (uint8_t) c);
+      if (states[state].nfa.empty()) {
+        return false;
+      }
+    }
+  }
+  return is_dir ? states[state].excludes_dir : states[state].excludes_file;
+}
+
+size_t ExcludeRules::memory_usage() const {
+  size_t res = tokens.capacity() * sizeof(Token) + sets.capacity() * sizeof(sets[0]) +
+               rules.capacity() * sizeof(Rule) + starts.capacity() * sizeof(uint32_t) +
+               states.capacity() * sizeof(State) + next.capacity() * sizeof(int32_t);
+  for (const auto &state : states) {
+    // Once for the state and once for its key in `ids`.
+    res += 2 * state.nfa.capacity() * sizeof(uint32_t);
+  }
+  return res;
+}
+
+void ExcludeRules::add_closure(std::vector<uint32_t> &nfa, uint32_t pos) const {
+  nfa.push_back(pos);
+  auto kind = tokens[pos].kind;
+  if (kind == STAR || kind == DIRS || kind == ALL) {
+    add_closure(nfa, pos + 1);
+  }
+}
+
+int32_t ExcludeRules::add_state(std::vector<uint32_t> nfa) {
+  std::sort(nfa.begin(), nfa.end());
+  nfa.erase(std::unique(nfa.begin(), nfa.end()), nfa.end());
+  if (auto it = ids.find(nfa); it != ids.end()) {
+    return it->second;
+  }
+
+  // Rules are laid out in order, so the last END is the rule that wins.
+  State state{.nfa = nfa, .excludes_file = false, .excludes_dir = false};
+  bool has_file = false, has_dir = false;
+  for (auto it = nfa.rbegin(); it != nfa.rend() && !(has_file && has_dir); ++it) {
+    const auto &token = tokens[*it];
+    if (token.kind != END) {
+      continue;
+    }
+    const auto &rule = rules[token.rule];
+    if (!has_dir) {
+      state.excludes_dir = !rule.negated;
+      has_dir = true;
+    }
+    if (!has_file && !rule.dir_only) {
+      state.excludes_file = !rule.negated;
+      has_file = true;
+    }
+  }
+
+  auto id = (int32_t) states.size();
+  states.push_back(std::move(state));
+  next.resize(next.size() + 256, UNKNOWN);
+  ids.insert({std::move(nfa), id});
+  return id;
+}
+
+int32_t ExcludeRules::step(int32_t state, uint8_t c) {
+  auto idx = (size_t) state * 256 + c;
+  if (next[idx] != UNKNOWN) {
+    return next[idx];
+  }
+
+  std::vector<uint32_t> nfa;
+  for (auto pos : states[state].nfa) {
+    const auto &token = tokens[pos];
+    switch (token.kind) {
+      case CHAR:
+        if (c == token.c) {
+          add_closure(nfa, pos + 1);
+        }
+        break;
+      case ANY:
+        if (c != '/') {
+          add_closure(nfa, pos + 1);
+        }
+        break;
+      case SET:
+        if (sets[token.set][c]) {
+          add_closure(nfa, pos + 1);
+        }
+        break;
+      case STAR:
+        if (c != '/') {
+          add_closure(nfa, pos);
+        }
+        break;
+      case DIRS:
+        // The rest of the rule may only follow once a directory name ended with '/'.
+        if (c == '/') {
+          add_closure(nfa, pos);
+        } else {
+          nfa.push_back(pos);
+        }
+        break;
+      case ALL:
+        add_closure(nfa, pos);
+        break;
+      case END:
+        break;
+    }
+  }
+
+  if (states.size() >= MAX_DFA_STATES) {
+    reset_dfa();
+    return add_state(std::move(nfa));
+  }
+  auto id = add_state(std::move(nfa));
+  next[idx] = id;
+  return id;
+}
+
+void ExcludeRules::reset_dfa() {
+  states.clear();
+  next.clear();
+  ids.clear();
+  std::vector<uint32_t> nfa;
+  for (auto start : starts) {
+    add_closure(nfa, start);
+  }
+  add_state(std::move(nfa));
+}
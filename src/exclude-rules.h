@@ -0,0 +1,82 @@
+#pragma once
+
+#include <bitset>
+#include <cstdint>
+#include <initializer_list>
+#include <map>
+#include <string_view>
+#include <vector>
+
+// gitignore-style rules for paths that a watch skips, one per line:
+//  - blank lines and lines starting with '#' are ignored
+//  - a leading '!' re-includes what an earlier rule excluded, the last matching rule wins
+//  - a trailing '/' only matches directories
+//  - a rule with a '/' anywhere else is relative to the root of the watch, otherwise it matches
+//    a name at any depth
+//  - '*' and '?' do not match '/', "**/" matches any number of directories, "/**" everything
+//    below, and "[...]" is a set of characters
+// Like in git, nothing below an excluded directory can be re-included.
+//
+// All rules are compiled into a single automaton, so a path is matched in one pass over its
+// characters however many rules there are. DFA states are built from the NFA on first use.
+class ExcludeRules {
+  public:
+  void compile(std::string_view rules);
+
+  bool empty() const {
+    return rules.empty();
+  }
+
+  // The path is the concatenation of `parts`, relative to the root of the watch.
+  bool is_excluded(std::initializer_list<std::string_view> parts, bool is_dir);
+
+  size_t memory_usage() const;
+
+  private:
+  enum Kind : uint8_t {
+    CHAR,  // `c`
+    ANY,   // any character but '/'
+    SET,   // a character in sets[set]
+    STAR,  // any number of characters but '/'
+    DIRS,  // any number of directories, that is nothing or anything ending with '/'
+    ALL,   // any number of characters
+    END,   // accepts for rules[rule]
+  };
+
+  struct Token {
+    Kind kind;
+    uint8_t c = 0;
+    uint32_t set = 0;
+    uint32_t rule = 0;
+  };
+
+  struct Rule {
+    bool negated;
+    bool dir_only;
+  };
+
+  struct State {
+    std::vector<uint32_t> nfa;  // sorted positions in `tokens`
+    bool excludes_file, excludes_dir;
+  };
+
+  static constexpr int32_t UNKNOWN = -1;
+
+  // The NFA: a state is a position in `tokens`, each rule ends with an END token.
+  std::vector<Token> tokens;
+  std::vector<std::bitset<256>> sets;
+  std::vector<Rule> rules;
+  std::vector<uint32_t> starts;
+
+  // The DFA: state 0 is the start, `next` has 256 transitions per state.
+  std::vector<State> states;
+  std::vector<int32_t> next;
+  std::map<std::vector<uint32_t>, int32_t> ids;
+
+  void add_rule(std::string_view line);
+  void add_closure(std::vector<uint32_t> &nfa, uint32_t pos) const;
+  int32_t add_state(std::vector<uint32_t> nfa);
+  int32_t step(int32_t state, uint8_t c);
+  // Drops all DFA states but the start.
+  void reset_dfa();
+};
@@ -0,0 +1,370 @@
+#include "fanotify-watcher.h"
+
+#include <fcntl.h>
+#include <linux/limits.h>
+#include <sys/stat.h>
+#include <sys/vfs.h>
+#include <unistd.h>
+
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <vector>
+
+#include "mount-table.h"
+
+Fanotify fanotify;
+
+const size_t DIR_CACHE_SIZE = 1 << 16;
+
+namespace {
+  std::string handle_key(uint64_t fsid, const file_handle *handle) {
+    std::string key{(const char *) &fsid, sizeof(fsid)};
+    key.append((const char *) &handle->handle_type, sizeof(handle->handle_type));
+    key.append((const char *) handle->f_handle, handle->handle_bytes);
+    return key;
+  }
+}  // namespace
+
+void Fanotify::init() {
+  fd = fanotify_init(FAN_CLASS_NOTIF | FAN_CLOEXEC | FAN_NONBLOCK | FAN_REPORT_DFID_NAME,
+                     O_RDONLY | O_CLOEXEC | O_LARGEFILE);
+}
+
+bool Fanotify::add(FanotifyWatcher *w, uint64_t fsid) {
+  auto mask = w->kernel_mask;
+  auto it = filesystems.find(fsid);
+  if (it == filesystems.end()) {
+    if (fanotify_mark(fd, FAN_MARK_ADD | FAN_MARK_FILESYSTEM, mask, AT_FDCWD,
+                      w->real_path.data()) == -1) {
+      return false;
+    }
+    int mount_fd = open(w->real_path.data(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (mount_fd == -1) {
+      fanotify_mark(fd, FAN_MARK_REMOVE | FAN_MARK_FILESYSTEM, mask, AT_FDCWD,
+                    w->real_path.data());
+      return false;
+    }
+    it = filesystems.insert({fsid, Filesystem{.mount_fd = mount_fd, .mask = mask, .watchers = {}}})
+             .first;
+  } else if (mask & ~it->second.mask) {
+    if (fanotify_mark(fd, FAN_MARK_ADD | FAN_MARK_FILESYSTEM, mask, it->second.mount_fd,
+                      nullptr) == -1) {
+      return false;
+    }
+    it->second.mask |= mask;
+  }
+  it->second.watchers.insert(w);
+  return true;
+}
+
+void Fanotify::release(FanotifyWatcher *w, uint64_t fsid) {
+  auto it = filesystems.find(fsid);
+  if (it == filesystems.end()) {
+    return;
+  }
+  auto &fs = it->second;
+  fs.watchers.erase(w);
+  if (fs.watchers.empty()) {
+    fanotify_mark(fd, FAN_MARK_REMOVE | FAN_MARK_FILESYSTEM, fs.mask, fs.mount_fd, nullptr);
+    close(fs.mount_fd);
+    filesystems.erase(it);
+    std::erase_if(dir_cache, [&](const auto &entry) {
+      if (memcmp(entry.first.data(), &fsid, sizeof(fsid))) {
+        return false;
+      }
+      dir_keys.erase(entry.second);
+      return true;
+    });
+  }
+}
+
+bool Fanotify::resolve(Filesystem &fs, std::string_view key, file_handle *handle,
+                       std::string &path) {
+  if (auto it = dir_cache.find(std::string{key}); it != dir_cache.end()) {
+    path = it->second;
+    return true;
+  }
+
+  int dir_fd = open_by_handle_at(fs.mount_fd, handle, O_PATH | O_CLOEXEC);
+  if (dir_fd == -1) {
+    return false;
+  }
+  char link[32], target[PATH_MAX];
+  snprintf(link, sizeof(link), "/proc/self/fd/%d", dir_fd);
+  ssize_t len = readlink(link, target, sizeof(target));
+  close(dir_fd);
+  if (len <= 0 || len == sizeof(target)) {
+    return false;
+  }
+  path.assign(target, len);
+  if (path.ends_with(" (deleted)")) {
+    return false;
+  }
+
+  if (dir_cache.size() >= DIR_CACHE_SIZE) {
+    dir_cache.clear();
+    dir_keys.clear();
+  }
+  // A directory that was replaced without an event that told, such as on another mount of the
+  // filesystem.
+  if (auto old = dir_keys.find(path); old != dir_keys.end()) {
+    dir_cache.erase(old->second);
+  }
+  dir_cache[std::string{key}] = path;
+  dir_keys[path] = key;
+  return true;
+}
+
+void Fanotify::forget_dirs(std::string_view path) {
+  auto forget = [&](auto it) {
+    dir_cache.erase(it->second);
+    return dir_keys.erase(it);
+  };
+  if (auto it = dir_keys.find(std::string{path}); it != dir_keys.end()) {
+    forget(it);
+  }
+  // Entries below `path` sort right after `path` + '/'.
+  std::string below{path == "/" ? "" : path};
+  below += '/';
+  auto it = dir_keys.lower_bound(below);
+  while (it != dir_keys.end() && it->first.starts_with(below)) {
+    it = forget(it);
+  }
+}
+
+void Fanotify::fail_all() {
+  for (auto &[fsid, fs] : filesystems) {
+    for (auto w : fs.watchers) {
+      w->fail();
+    }
+  }
+}
+
+void Fanotify::process_events(ev_tstamp deadline) {
+  static char buf[16 * 4096] __attribute__((aligned(alignof(fanotify_event_metadata))));
+
+  std::vector<FanotifyWatcher *> targets;
+  std::string dir, self_path;
+
+  // The client and inotify get their turn before the rest. The kernel queue holds 16K events,
+  // more than a slice leaves behind unless the whole system writes that fast, and overflowing
+  // it fails every fanotify watch.
+  for (auto now = ev_time(); now < deadline; now = ev_time()) {
+    ssize_t len = read(fd, buf, sizeof(buf));
+    if (len <= 0) {
+      if (errno != EAGAIN && errno != EWOULDBLOCK) {
+        fail_all();
+      }
+      break;
+    }
+
+    for (auto meta = (fanotify_event_metadata *) buf; FAN_EVENT_OK(meta, len);
+         meta = FAN_EVENT_NEXT(meta, len)) {
+      if (meta->vers != FANOTIFY_METADATA_VERSION || (meta->mask & FAN_Q_OVERFLOW)) {
+        fail_all();
+        continue;
+      }
+
+      auto info = (fanotify_event_info_fid *) (meta + 1);
+      auto handle = (file_handle *) info->handle;
+      const char *name = "";
+      if (info->hdr.info_type == FAN_EVENT_INFO_TYPE_DFID_NAME) {
+        name = (const char *) handle->f_handle + handle->handle_bytes;
+      } else if (info->hdr.info_type != FAN_EVENT_INFO_TYPE_DFID) {
+        continue;
+      }
+
+      uint64_t fsid;
+      memcpy(&fsid, &info->fsid, sizeof(fsid));
+      auto fs_it = filesystems.find(fsid);
+      if (fs_it == filesystems.end()) {
+        continue;
+      }
+      auto &fs = fs_it->second;
+      auto key = handle_key(fsid, handle);
+      uint64_t mask = meta->mask;
+
+      std::string_view filename = name;
+      if (!*name || !strcmp(name, ".")) {
+        // Reported on the directory itself. Moves and deletions only matter for the roots of the
+        // watchers, their parents report them for everything else.
+        if (mask & (FAN_DELETE_SELF | FAN_MOVE_SELF)) {
+          if (auto it = dir_cache.find(key); it != dir_cache.end()) {
+            forget_dirs(std::string{it->second});
+          }
+          targets.assign(fs.watchers.begin(), fs.watchers.end());
+          for (auto w : targets) {
+            if (w->root_handle == key) {
+              w->fail();
+            }
+          }
+        }
+        mask &= ~(FAN_DELETE_SELF | FAN_MOVE_SELF);
+        if (!(mask & ~FAN_ONDIR) || !resolve(fs, key, handle, self_path)) {
+          continue;
+        }
+        // Other changes are reported like those of any other entry of the parent.
+        auto slash = self_path.rfind('/');
+        if (slash == std::string::npos || slash + 1 == self_path.size()) {
+          continue;
+        }
+        dir.assign(self_path, 0, slash ? slash : 1);
+        filename = std::string_view{self_path}.substr(slash + 1);
+      } else if (!(mask & ~(FAN_DELETE_SELF | FAN_MOVE_SELF | FAN_ONDIR)) ||
+                 !resolve(fs, key, handle, dir)) {
+        continue;
+      } else if ((mask & FAN_ONDIR) && (mask & (FAN_DELETE | FAN_MOVED_FROM))) {
+        std::string gone = dir;
+        if (gone != "/") {
+          gone += '/';
+        }
+        gone += filename;
+        forget_dirs(gone);
+      }
+
+      targets.assign(fs.watchers.begin(), fs.watchers.end());
+      for (auto w : targets) {
+        w->process_event(mask, dir, filename);
+        w->latency.add(ev_time() - now);
+      }
+    }
+  }
+}
+
+FanotifyWatcher::~FanotifyWatcher() {
+  if (is_started) {
+    fanotify.release(this, fsid);
+  }
+}
+
+bool FanotifyWatcher::start() {
+  char *resolved = realpath(path.data(), nullptr);
+  if (resolved == nullptr) {
+    return false;
+  }
+  real_path = resolved;
+  free(resolved);
+
+  struct statfs st;
+  if (statfs(real_path.data(), &st) == -1) {
+    return false;
+  }
+  static_assert(sizeof(st.f_fsid) == sizeof(fsid));
+  memcpy(&fsid, &st.f_fsid, sizeof(fsid));
+
+  // The mark only covers one filesystem. Trees that have to cross into others are left to
+  // inotify.
+  struct stat root_st;
+  if (stat(real_path.data(), &root_st) == -1) {
+    return false;
+  }
+  mount_table.refresh();
+  auto mounts = mount_table.get_other_mounts(real_path, root_st.st_dev);
+  if (cross_mounts && mounts.size()) {
+    return false;
+  }
+
+  char handle_buf[sizeof(file_handle) + MAX_HANDLE_SZ]
+      __attribute__((aligned(alignof(file_handle))));
+  auto handle = (file_handle *) handle_buf;
+  handle->handle_bytes = MAX_HANDLE_SZ;
+  int mount_id;
+  if (name_to_handle_at(AT_FDCWD, real_path.data(), handle, &mount_id, 0) == -1) {
+    return false;
+  }
+  root_handle = handle_key(fsid, handle);
+
+  kernel_mask = get_mask();
+  is_started = fanotify.add(this, fsid);
+  if (is_started) {
+    for (const auto &mount : mounts) {
+      report_skipped_mount({mount});
+    }
+  }
+  return is_started;
+}
+
+uint64_t FanotifyWatcher::get_mask() const {
+  uint64_t res = FANOTIFY_TREE_EVENTS;
+  if (wants(NOTIFY_MODIFY)) {
+    res |= FAN_MODIFY;
+    if (settle_time > 0) {
+      res |= FAN_CLOSE_WRITE;
+    }
+  }
+  if (wants(NOTIFY_ATTRIB)) {
+    res |= FAN_ATTRIB;
+  }
+  return res;
+}
+
+bool FanotifyWatcher::is_root(std::string_view dir, std::string_view name) const {
+  std::string_view root = real_path;
+  if (dir != "/") {
+    if (!root.starts_with(dir)) {
+      return false;
+    }
+    root.remove_prefix(dir.size());
+  }
+  return root.size() == name.size() + 1 && root[0] == '/' && root.ends_with(name);
+}
+
+void FanotifyWatcher::process_event(uint64_t mask, std::string_view dir, std::string_view name) {
+  if ((mask & FAN_ONDIR) && (mask & (FAN_DELETE | FAN_MOVED_FROM)) && is_root(dir, name)) {
+    fail();
+    return;
+  }
+
+  // The filename is sent as rel_dir + separator + name.
+  std::string_view rel_dir, separator;
+  if (dir != real_path) {
+    auto prefix = real_path == "/" ? std::string_view{""} : std::string_view{real_path};
+    if (!dir.starts_with(prefix) || dir.size() <= prefix.size() || dir[prefix.size()] != '/') {
+      return;
+    }
+    rel_dir = dir.substr(prefix.size() + 1);
+    separator = "/";
+  }
+  std::initializer_list<std::string_view> filename = {rel_dir, separator, name};
+
+  // The mark may serve other watchers too, and its mask cannot tell files from directories.
+  bool is_dir = mask & FAN_ONDIR;
+  if (excludes.is_excluded(filename, is_dir)) {
+    return;
+  }
+  bool report_name = wants_name(is_dir);
+  bool added = report_name && (mask & (FAN_CREATE | FAN_MOVED_TO));
+  bool removed = report_name && (mask & (FAN_DELETE | FAN_MOVED_FROM));
+  bool written = (mask & FAN_MODIFY) && wants(NOTIFY_MODIFY);
+  bool modified = (mask & FAN_ATTRIB) && wants(NOTIFY_ATTRIB);
+
+  if (added && removed) {
+    // Merged events lose their order; report them so that the final state is the current one.
+    struct stat st;
+    if (lstat(join({dir, "/", name}).data(), &st) == 0) {
+      send_event(FILE_ACTION_REMOVED, filename);
+      send_event(FILE_ACTION_ADDED, filename);
+    } else {
+      send_event(FILE_ACTION_ADDED, filename);
+      send_event(FILE_ACTION_REMOVED, filename);
+    }
+    return;
+  }
+  if (added) {
+    send_event(FILE_ACTION_ADDED, filename);
+  }
+  // Merged events of a file that was written and closed end up as one MODIFIED in settle mode.
+  if (modified) {
+    send_event(FILE_ACTION_MODIFIED, filename);
+  } else if (written) {
+    report_write(filename);
+  }
+  if (mask & FAN_CLOSE_WRITE) {
+    report_close_write(filename);
+  }
+  if (removed) {
+    send_event(FILE_ACTION_REMOVED, filename);
+  }
+}
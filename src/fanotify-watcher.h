@@ -0,0 +1,88 @@
+#pragma once
+
+#include <ev.h>
+#include <sys/fanotify.h>
+
+#include <map>
+#include <set>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+
+#include "watcher.h"
+
+// Needed to keep paths and roots right, whatever the client asked for.
+const uint64_t FANOTIFY_TREE_EVENTS = FAN_CREATE | FAN_DELETE | FAN_MOVED_FROM | FAN_MOVED_TO |
+                                      FAN_DELETE_SELF | FAN_MOVE_SELF | FAN_ONDIR;
+
+struct FanotifyWatcher;
+
+// Whole-filesystem backend: a single FAN_MARK_FILESYSTEM mark reports every change on a
+// filesystem, so recursive watches need neither a crawl nor per-directory kernel state. Events
+// carry the handle of the parent directory, which is resolved back to a path and matched
+// against the roots of the watchers on that filesystem.
+//
+// Requires CAP_SYS_ADMIN (for the mark) and CAP_DAC_READ_SEARCH (for open_by_handle_at), as
+// well as a filesystem that supports file handles.
+struct Fanotify {
+  struct Filesystem {
+    int mount_fd;
+    // Union of what the watchers asked for. It only grows until the last watcher is gone, every
+    // watcher filters out the events it did not ask for itself.
+    uint64_t mask;
+    std::set<FanotifyWatcher *> watchers;
+  };
+
+  ev_io ev_watcher;
+  int fd = -1;
+  std::map<uint64_t, Filesystem> filesystems;
+  // (fsid, file handle) -> directory path, and back. Entries are dropped along with their
+  // filesystem, or when their directory or one above it moves or disappears.
+  std::unordered_map<std::string, std::string> dir_cache;
+  std::map<std::string, std::string> dir_keys;
+
+  void init();
+
+  bool is_available() const {
+    return fd != -1;
+  }
+
+  bool add(FanotifyWatcher *w, uint64_t fsid);
+  void release(FanotifyWatcher *w, uint64_t fsid);
+
+  // Reads and handles events until the kernel queue is empty or `deadline` passed. The rest
+  // wakes up `ev_watcher` again on the next loop iteration.
+  void process_events(ev_tstamp deadline);
+
+  private:
+  bool resolve(Filesystem &fs, std::string_view key, struct file_handle *handle,
+               std::string &path);
+  // Drops `path` and everything below it from `dir_cache`.
+  void forget_dirs(std::string_view path);
+  void fail_all();
+};
+
+extern Fanotify fanotify;
+
+struct FanotifyWatcher : Watcher {
+  std::string real_path;  // `path` with symlinks resolved, as open_by_handle_at reports it
+  std::string root_handle;
+  uint64_t fsid = 0;
+  uint64_t kernel_mask = 0;  // fanotify events needed to serve `filter`
+  bool is_started = false;
+
+  using Watcher::Watcher;
+
+  ~FanotifyWatcher();
+
+  bool start();
+
+  // The smallest fanotify mask that serves `filter`.
+  uint64_t get_mask() const;
+
+  // Whether `name` in `dir` is the watched directory itself.
+  bool is_root(std::string_view dir, std::string_view name) const;
+
+  // `dir` is the absolute path of the directory containing `name`.
+  void process_event(uint64_t mask, std::string_view dir, std::string_view name);
+};
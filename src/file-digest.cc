@@ -0,0 +1,199 @@
+#include "file-digest.h"
+
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+
+#include "crawler.h"
+
+// Files are read in blocks of this size.
+const size_t READ_BLOCK = 256 * 1024;
+// A watch forgets all digests once it has that many.
+const size_t MAX_DIGESTS = 16 * 1024;
+// Larger files are not digested, reading them would hold up the loop for too long.
+const uint64_t MAX_DIGEST_SIZE = 16 * 1024 * 1024;
+
+namespace {
+  const uint64_t PRIME1 = 0x9e3779b185ebca87;
+  const uint64_t PRIME2 = 0xc2b2ae3d27d4eb4f;
+  const uint64_t PRIME3 = 0x165667b19e3779f9;
+  const uint64_t PRIME4 = 0x85ebca77c2b2ae63;
+  const uint64_t PRIME5 = 0x27d4eb2f165667c5;
+
+  uint64_t rotl(uint64_t x, int r) {
+    return (x << r) | (x >> (64 - r));
+  }
+
+  uint64_t read64(const char *p) {
+    uint64_t res;
+    memcpy(&res, p, sizeof(res));
+    return res;
+  }
+
+  uint32_t read32(const char *p) {
+    uint32_t res;
+    memcpy(&res, p, sizeof(res));
+    return res;
+  }
+
+  uint64_t mix_round(uint64_t acc, uint64_t input) {
+    return rotl(acc + input * PRIME2, 31) * PRIME1;
+  }
+
+  uint64_t merge_round(uint64_t acc, uint64_t lane) {
+    return (acc ^ mix_round(0, lane)) * PRIME1 + PRIME4;
+  }
+}  // namespace
+
+Hasher::Hasher(uint64_t seed)
+    : lanes{seed + PRIME1 + PRIME2, seed + PRIME2, seed, seed - PRIME1} {}
+
+void Hasher::consume(const char *data) {
+  // The lanes do not depend on each other, which lets the CPU work on all four at once.
+  for (int i = 0; i < 4; i++) {
+    lanes[i] = mix_round(lanes[i], read64(data + i * 8));
+  }
+}
+
+void Hasher::update(std::string_view data) {
+  total += data.size();
+  if (stripe_len) {
+    size_t len = std::min(STRIPE - stripe_len, data.size());
+    memcpy(stripe + stripe_len, data.data(), len);
+    stripe_len += len;
+    data.remove_prefix(len);
+    if (stripe_len < STRIPE) {
+      return;
+    }
+    consume(stripe);
+    stripe_len = 0;
+  }
+  for (; data.size() >= STRIPE; data.remove_prefix(STRIPE)) {
+    consume(data.data());
+  }
+  memcpy(stripe, data.data(), data.size());
+  stripe_len = data.size();
+}
+
+uint64_t Hasher::digest() const {
+  uint64_t res;
+  if (total >= STRIPE) {
+    res = rotl(lanes[0], 1) + rotl(lanes[1], 7) + rotl(lanes[2], 12) + rotl(lanes[3], 18);
+    for (auto lane : lanes) {
+      res = merge_round(res, lane);
+    }
+  } else {
+    res = lanes[2] + PRIME5;  // the seed
+  }
+  res += total;
+
+  const char *p = stripe, *end = stripe + stripe_len;
+  for (; p + 8 <= end; p += 8) {
+    res = rotl(res ^ mix_round(0, read64(p)), 27) * PRIME1 + PRIME4;
+  }
+  if (p + 4 <= end) {
+    res = rotl(res ^ (read32(p) * PRIME1), 23) * PRIME2 + PRIME3;
+    p += 4;
+  }
+  for (; p < end; p++) {
+    res = rotl(res ^ ((uint8_t) *p * PRIME5), 11) * PRIME1;
+  }
+
+  res ^= res >> 33;
+  res *= PRIME2;
+  res ^= res >> 29;
+  res *= PRIME3;
+  res ^= res >> 32;
+  return res;
+}
+
+uint32_t DigestCache::get(const char *abs_path, const std::string &rel_path, FileDigest &res,
+                          bool is_cached) {
+  FileStat before;
+  if (!get_file_stat(AT_FDCWD, abs_path, before)) {
+    return errno;
+  }
+  if (!S_ISREG(before.mode)) {
+    return S_ISDIR(before.mode) ? EISDIR : EINVAL;
+  }
+  res.size = before.size;
+  res.mtime = before.mtime;
+  if (before.size > MAX_DIGEST_SIZE) {
+    return EFBIG;
+  }
+
+  auto it = entries.find(rel_path);
+  if (is_cached && it != entries.end() && it->second.ino == before.ino &&
+      it->second.mtime == before.mtime && it->second.size == before.size) {
+    ++hit_cnt;
+    res.digest = it->second.digest;
+    return 0;
+  }
+
+  ++miss_cnt;
+  int fd = open(abs_path, O_RDONLY | O_NOFOLLOW | O_CLOEXEC);
+  if (fd == -1) {
+    return errno;
+  }
+  Hasher hasher;
+  std::string block(READ_BLOCK, '\0');
+  ssize_t len;
+  while ((len = read(fd, block.data(), block.size())) > 0) {
+    hasher.update({block.data(), (size_t) len});
+  }
+  int error = len == -1 ? errno : 0;
+  close(fd);
+  if (error) {
+    return error;
+  }
+  res.digest = hasher.digest();
+
+  // Written to while it was read, the digest is only good for this answer.
+  FileStat after;
+  if (!get_file_stat(AT_FDCWD, abs_path, after) || after.ino != before.ino ||
+      after.mtime != before.mtime || after.size != before.size) {
+    entries.erase(rel_path);
+    return 0;
+  }
+  if (entries.size() >= MAX_DIGESTS) {
+    entries.clear();
+  }
+  entries[rel_path] = {
+      .ino = after.ino,
+      .mtime = after.mtime,
+      .size = after.size,
+      .digest = res.digest,
+  };
+  return 0;
+}
+
+bool DigestCache::has_changed(const char *abs_path, const std::string &rel_path) {
+  auto it = entries.find(rel_path);
+  if (it == entries.end()) {
+    return true;
+  }
+  auto old_digest = it->second.digest;
+  FileDigest res;
+  if (get(abs_path, rel_path, res, false)) {
+    forget(rel_path);
+    return true;
+  }
+  if (res.digest != old_digest) {
+    return true;
+  }
+  ++unchanged_cnt;
+  return false;
+}
+
+size_t DigestCache::memory_usage() const {
+  size_t res = entries.bucket_count() * sizeof(void *) +
+               entries.size() * (sizeof(std::pair<const std::string, Entry>) + sizeof(void *));
+  for (const auto &[path, entry] : entries) {
+    res += path.capacity();
+  }
+  return res;
+}
@@ -0,0 +1,69 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+
+#include "config.h"
+
+// XXH64 of everything passed to update(). Fast and good at telling contents apart, but not meant
+// to stand up to someone crafting collisions.
+class Hasher {
+  private:
+  static constexpr size_t STRIPE = 32;
+
+  uint64_t lanes[4];
+  uint64_t total = 0;
+  char stripe[STRIPE];
+  size_t stripe_len = 0;  // bytes of `stripe` waiting for the rest of it
+
+  void consume(const char *data);
+
+  public:
+  explicit Hasher(uint64_t seed = 0);
+
+  void update(std::string_view data);
+
+  uint64_t digest() const;
+};
+
+// Digests of the files of a watch by path. An entry is only used while the inode, mtime and size
+// of the file stay the ones it was computed for, events just drop it earlier.
+class DigestCache {
+  private:
+  struct Entry {
+    uint64_t ino;
+    int64_t mtime;
+    uint64_t size;
+    uint64_t digest;
+  };
+
+  std::unordered_map<std::string, Entry> entries;  // by path relative to the watch
+
+  public:
+  uint64_t hit_cnt = 0, miss_cnt = 0, unchanged_cnt = 0;
+
+  bool empty() const {
+    return entries.empty();
+  }
+
+  // Fills `res` for `abs_path`, which is `rel_path` in the watch. Returns an errno on failure:
+  // EISDIR for directories, EINVAL for anything else that is not a regular file and EFBIG for
+  // files too large to be read on the loop, which still get their size and mtime. Without
+  // `is_cached` the file is read even if its entry looks current, as two writes within a clock
+  // tick leave the same mtime.
+  uint32_t get(const char *abs_path, const std::string &rel_path, FileDigest &res,
+               bool is_cached = true);
+
+  // For a MODIFIED event of a file that has a digest: whether its contents differ from that.
+  // Files that grew too large to be digested count as changed.
+  bool has_changed(const char *abs_path, const std::string &rel_path);
+
+  void forget(const std::string &rel_path) {
+    entries.erase(rel_path);
+  }
+
+  size_t memory_usage() const;
+};
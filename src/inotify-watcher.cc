@@ -0,0 +1,933 @@
+#include "inotify-watcher.h"
+
+#include <dirent.h>
+#include <fcntl.h>
+#include <linux/limits.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cerrno>
+
+#include "mount-table.h"
+
+Inotify inotify;
+
+// File times come from a coarse clock that can lag the wall clock by a scheduler tick.
+const double MTIME_GRANULARITY = 0.01;
+// How long an IN_MOVED_FROM at the end of a read waits for its IN_MOVED_TO. The kernel queues
+// both during the same rename, so only a read that got between the two has to wait at all.
+const ev_tstamp MOVE_HOLD = 0.005;
+// Events of a watcher that may come between the two halves of a move, from other processes
+// writing at the same time. A move still missing its IN_MOVED_TO after that many left the watch,
+// even if the backlog keeps `move_timer` from ever settling it.
+const uint64_t MOVE_WINDOW = 256;
+// Reads of the kernel queue per read_events.
+const int READ_BATCH = 16;
+// Events that the backlog of a watcher may hold before it drops them, as many as the kernel
+// queues by default.
+const uint64_t MAX_BACKLOG = 16 * 1024;
+// Events of a watcher handled in one turn of process_backlog.
+const uint64_t BACKLOG_QUANTUM = 256;
+
+namespace {
+  int64_t get_since(double time) {
+    return (int64_t) ((time - MTIME_GRANULARITY) * 1e9);
+  }
+
+  void move_cb(EV_P_ ev_timer *w, int) {
+    auto watcher = (InotifyWatcher *) w->data;
+    // The IN_MOVED_TO may be in the backlog, handling it restarts the timer if need be.
+    if (!watcher->backlog_cnt) {
+      watcher->settle_moves();
+    }
+  }
+}  // namespace
+
+InotifyWatcher::InotifyWatcher(std::string_view path_, uint32_t filter_, bool recursive_,
+                               uint32_t capabilities_)
+    : Watcher(path_, filter_, recursive_, capabilities_) {
+  ev_timer_init(&move_timer, move_cb, 0, 0);
+  move_timer.data = this;
+}
+
+InotifyWatcher::~InotifyWatcher() {
+  ev_timer_stop(loop, &move_timer);
+  inotify.backlog_cnt -= backlog_cnt;
+  inotify.backlogged.erase(this);
+  by_wd.for_each([this](uint64_t wd, dir_t) { inotify.release(this, (int) wd); });
+}
+
+void Inotify::init() {
+  fd = inotify_init1(IN_NONBLOCK);
+}
+
+int Inotify::add_watch(InotifyWatcher *w, const char *path) {
+  // The mask only ever grows while a watch is shared: narrowing it again would take the path,
+  // which the other subscribers may know under a different name by now.
+  int wd = inotify_add_watch(fd, path, w->kernel_mask | IN_MASK_ADD | INOTIFY_FLAGS);
+  if (wd == -1) {
+    return -1;
+  }
+  if (!subscribers[wd].insert(w).second) {
+    errno = EEXIST;
+    return -1;
+  }
+  return wd;
+}
+
+void Inotify::release(InotifyWatcher *w, int wd) {
+  auto it = subscribers.find(wd);
+  if (it == subscribers.end()) {
+    return;
+  }
+  it->second.erase(w);
+  if (it->second.empty()) {
+    inotify_rm_watch(fd, wd);
+    subscribers.erase(it);
+  }
+}
+
+bool InotifyWatcher::start() {
+  kernel_mask = get_mask();
+  if (recursive && !cross_mounts) {
+    mount_id = get_mount_id(AT_FDCWD, path.data());
+  }
+  int wd = inotify.add_watch(this, path.data());
+  if (wd == -1) {
+    return false;
+  }
+
+  root = add_dir(wd, NO_DIR, "");
+  add_to_queue(root);
+  return true;
+}
+
+uint32_t InotifyWatcher::get_mask() const {
+  uint32_t res = INOTIFY_SELF_EVENTS;
+  if (recursive || wants(FILE_NOTIFY_CHANGE_FILE_NAME | FILE_NOTIFY_CHANGE_DIR_NAME)) {
+    res |= INOTIFY_TREE_EVENTS;
+  }
+  if (wants(NOTIFY_MODIFY)) {
+    res |= IN_MODIFY;
+    if (settle_time > 0) {
+      res |= IN_CLOSE_WRITE;
+    }
+  }
+  if (wants(NOTIFY_ATTRIB)) {
+    res |= IN_ATTRIB;
+  }
+  return res;
+}
+
+size_t InotifyWatcher::get_memory_usage() {
+  return Watcher::get_memory_usage() - sizeof(Watcher) + sizeof(*this) + tree.memory_usage() +
+         by_wd.memory_usage() + backlog.capacity();
+}
+
+bool InotifyWatcher::get_cached_listing(std::string_view rel_path, CrawlResult &result) {
+  // The kernel or the backlog may hold events that are newer than the tree.
+  if (!is_caught_up()) {
+    return false;
+  }
+  // Without the tree events, entries that come and go after the crawl are never seen.
+  if (is_failed || (!recursive && rel_path.size()) ||
+      (kernel_mask & INOTIFY_TREE_EVENTS) != INOTIFY_TREE_EVENTS) {
+    return false;
+  }
+  auto dir = root;
+  for (size_t pos = 0; pos < rel_path.size() && dir != NO_DIR;) {
+    auto slash = std::min(rel_path.find('/', pos), rel_path.size());
+    dir = tree.find_child(dir, rel_path.substr(pos, slash - pos));
+    pos = slash + 1;
+  }
+  if (dir == NO_DIR || tree.wd[dir] == -1 ||
+      (tree.flags[dir] & (DirectoryTree::IN_QUEUE | DirectoryTree::RESCAN)) ||
+      !(tree.flags[dir] & DirectoryTree::ALREADY_ADDED)) {
+    return false;
+  }
+
+  for (auto child = tree.first_child[dir]; child != NO_DIR; child = tree.next_sibling[child]) {
+    result.subdirs.emplace_back(tree.get_name(child));
+  }
+  for (const auto &file : tree.files[dir]) {
+    auto name = tree.names.get(file.name);
+    if (file.type == DT_DIR) {
+      result.subdirs.emplace_back(name);  // in non-recursive watches
+    } else {
+      result.files.push_back({
+          .name = (uint32_t) result.file_names.size(),
+          .type = file.type,
+          .ctime = 0,
+      });
+      result.file_names += name;
+      result.file_names += '\0';
+    }
+  }
+  // Mount points are directories all the same, the watch just does not descend into them.
+  std::string prefix{rel_path};
+  if (prefix.size()) {
+    prefix += '/';
+  }
+  for (auto it = skipped_mounts.lower_bound(prefix);
+       it != skipped_mounts.end() && it->starts_with(prefix); ++it) {
+    if (it->find('/', prefix.size()) == it->npos) {
+      result.subdirs.push_back(it->substr(prefix.size()));
+    }
+  }
+  return true;
+}
+
+std::string InotifyWatcher::get_path(dir_t dir) {
+  std::string res = path + "/";
+  res += tree.get_rel_path(dir);
+  return res;
+}
+
+dir_t InotifyWatcher::add_dir(int wd, dir_t parent, std::string_view name) {
+  auto dir = tree.add(wd, parent, name);
+  tree.move_cookie[dir] = ++inotify.event_seq;
+  by_wd.set((uint32_t) wd, dir);
+  return dir;
+}
+
+void InotifyWatcher::remove_dir(dir_t dir) {
+  tree.remove(dir, [this](dir_t curr) {
+    auto wd = tree.wd[curr];
+    if (wd != -1) {
+      by_wd.erase((uint32_t) wd, curr);
+      inotify.release(this, wd);
+    }
+  });
+}
+
+void InotifyWatcher::skip_mount(dir_t dir) {
+  if (dir == root) {
+    fail();  // something was mounted over it
+    return;
+  }
+  auto rel_path = tree.get_rel_path(dir);
+  report_skipped_mount({rel_path.substr(0, rel_path.size() - 1)});
+  remove_dir(dir);
+}
+
+void InotifyWatcher::add_to_queue(dir_t dir) {
+  if (!(tree.flags[dir] & DirectoryTree::IN_QUEUE)) {
+    tree.flags[dir] |= DirectoryTree::IN_QUEUE;
+    unprocessed.push_back(tree.ref(dir));
+  }
+}
+
+void InotifyWatcher::process_add(const hl_inotify_event &e) {
+  auto dir = tree.get(e.dir);
+  if (!recursive || !(e.mask & IN_ISDIR) || dir == NO_DIR ||
+      excludes.is_excluded({tree.get_rel_path(dir), e.filename}, true)) {
+    return;
+  }
+  auto abs_path = get_path(dir);
+  abs_path += e.filename;
+  int wd = inotify.add_watch(this, abs_path.data());
+  if (wd == -1) {
+    if (errno == EEXIST || errno == ENOTDIR || errno == ENOENT) {
+      add_to_queue(dir);
+    } else {
+      fail();
+    }
+  } else {
+    // Names are unique within a directory, whatever had this one before is gone.
+    if (auto stale = tree.find_child(dir, e.filename); stale != NO_DIR) {
+      remove_dir(stale);
+    }
+    add_to_queue(add_dir(wd, dir, e.filename));
+  }
+}
+
+void InotifyWatcher::process_delete(const hl_inotify_event &e) {
+  auto dir = tree.get(e.dir);
+  if (!(e.mask & IN_ISDIR) || dir == NO_DIR) {
+    return;
+  }
+  auto child = tree.find_child(dir, e.filename);
+  if (child != NO_DIR) {
+    remove_dir(child);
+  }
+}
+
+void InotifyWatcher::process_move(const hl_inotify_event &from, const hl_inotify_event &to) {
+  if (!(from.mask & IN_ISDIR)) {
+    return;
+  }
+  auto from_dir = tree.get(from.dir), to_dir = tree.get(to.dir);
+  auto child = from_dir == NO_DIR ? NO_DIR : tree.find_child(from_dir, from.filename);
+  if (child == NO_DIR) {
+    process_add(to);
+    return;
+  }
+  if (to_dir == NO_DIR || excludes.is_excluded({tree.get_rel_path(to_dir), to.filename}, true)) {
+    remove_dir(child);
+    return;
+  }
+  // Only possible if the tree went out of sync with the filesystem. Drop the moved directory
+  // rather than create a cycle.
+  for (auto curr = to_dir; curr != NO_DIR; curr = tree.parent[curr]) {
+    if (curr == child) {
+      remove_dir(child);
+      return;
+    }
+  }
+  // A rename over an empty directory replaces it without an IN_DELETE.
+  auto replaced = tree.find_child(to_dir, to.filename);
+  if (replaced != NO_DIR && replaced != child) {
+    remove_dir(replaced);
+  }
+  tree.move_cookie[child] = ++inotify.event_seq;
+  tree.move(child, to_dir, to.filename);
+}
+
+void InotifyWatcher::update_file(dir_t dir, const hl_inotify_event &e) {
+  auto seq = ++inotify.event_seq;
+  auto *file = tree.find_file(dir, e.filename);
+  if (e.mask & (IN_DELETE | IN_MOVED_FROM)) {
+    if (!file) {
+      return;
+    }
+    // A listing made before the event may still show the entry.
+    if (tree.flags[dir] & DirectoryTree::IN_QUEUE) {
+      file->flags |= FileEntry::DELETED;
+      file->seq = seq;
+    } else {
+      tree.erase_file(dir, file - tree.files[dir].data());
+    }
+    return;
+  }
+  if (!file) {
+    file = &tree.add_file(dir, e.filename);
+  }
+  if (e.mask & (IN_CREATE | IN_MOVED_TO)) {
+    file->type = e.mask & IN_ISDIR ? DT_DIR : DT_UNKNOWN;
+  }
+  file->flags &= ~FileEntry::DELETED;
+  file->since = get_since(ev_now(loop));
+  file->seq = seq;
+}
+
+void InotifyWatcher::process_event(const inotify_event &raw) {
+  // Events of other processes may get between the two halves of a move, and go through. Those
+  // about the name that a move left must come after its removal though.
+  if (tinder.size()) {
+    bool is_pair = (raw.mask & IN_MOVED_TO) && tinder.count(raw.cookie);
+    auto oldest = handled_seq > MOVE_WINDOW ? handled_seq - MOVE_WINDOW : 0;
+    for (auto it = tinder.begin(); it != tinder.end();) {
+      auto &moved = it->second;
+      bool is_same_name =
+          !is_pair && raw.len && moved.event.wd == raw.wd && moved.event.filename == raw.name;
+      it = moved.handled_at < oldest || is_same_name ? settle_move(it) : std::next(it);
+    }
+  }
+
+  auto dir = by_wd.find((uint32_t) raw.wd);
+  if (dir == NO_DIR) {
+    return;
+  }
+
+  hl_inotify_event e{
+      .wd = raw.wd,
+      .dir = tree.ref(dir),
+      .mask = raw.mask,
+      .filename = raw.len ? std::string_view{raw.name} : std::string_view{},
+  };
+
+  auto rel_path = tree.get_rel_path(dir);
+
+  if ((e.mask & IN_MOVE_SELF) || (e.mask & IN_DELETE_SELF)) {
+    if (dir == root) {
+      fail();
+    } else {
+      tree.move_cookie[dir] = ++inotify.event_seq;
+    }
+  }
+
+  if ((e.mask & IN_IGNORED) || (e.mask & IN_UNMOUNT)) {
+    if (dir == root) {
+      fail();
+    } else {
+      // The kernel dropped the watch and may hand out its descriptor again. The directory
+      // itself goes away with the IN_DELETE or IN_MOVED_FROM in its parent.
+      by_wd.erase((uint32_t) raw.wd, dir);
+      tree.wd[dir] = -1;
+    }
+    return;
+  }
+  // Events the kernel could not filter out: the shared watch may serve other watchers too, and
+  // the mask cannot tell files from directories. Excluded directories never get a watch, but
+  // excluded names in the watched ones still have to be skipped.
+  bool is_dir = e.mask & IN_ISDIR;
+  bool is_excluded = raw.len && excludes.is_excluded({rel_path, e.filename}, is_dir);
+  bool report_name = !is_excluded && wants_name(is_dir);
+  if (raw.len && !is_excluded && !(is_dir && recursive)) {
+    update_file(dir, e);
+  }
+  if (e.mask & (IN_MODIFY | IN_ATTRIB)) {
+    // Changes to a watched directory itself come without a name, its parent reports them.
+    if (!raw.len || is_excluded) {
+      return;
+    }
+    if ((e.mask & IN_ATTRIB) && wants(NOTIFY_ATTRIB)) {
+      send_event(FILE_ACTION_MODIFIED, {rel_path, e.filename});
+    } else if ((e.mask & IN_MODIFY) && wants(NOTIFY_MODIFY)) {
+      report_write({rel_path, e.filename});
+    }
+  } else if (e.mask & IN_CLOSE_WRITE) {
+    if (raw.len && !is_excluded) {
+      report_close_write({rel_path, e.filename});
+    }
+  } else if (e.mask & IN_MOVED_FROM) {
+    auto &moved = tinder[raw.cookie];
+    moved.handled_at = handled_seq;
+    moved.path = rel_path;
+    moved.path += e.filename;
+    moved.is_reported = report_name;
+    moved.event = e;
+    moved.event.filename = std::string_view{moved.path}.substr(rel_path.size());
+    // Listings made before the move ends must not drop the directory, see add_subdirs.
+    if (auto child = is_dir ? tree.find_child(dir, e.filename) : NO_DIR; child != NO_DIR) {
+      tree.move_cookie[child] = ++inotify.event_seq;
+    }
+  } else if (e.mask & IN_MOVED_TO) {
+    auto match = tinder.find(raw.cookie);
+    if (match == tinder.end()) {
+      if (report_name) {
+        send_event(FILE_ACTION_ADDED, {rel_path, e.filename});
+      }
+      process_add(e);
+    } else {
+      // Either end may be excluded, which leaves half a rename.
+      auto &from = match->second;
+      if (from.is_reported && report_name) {
+        send_event(FILE_ACTION_RENAMED_OLD_NAME, from.path);
+        send_event(FILE_ACTION_RENAMED_NEW_NAME, {rel_path, e.filename});
+      } else if (from.is_reported) {
+        send_event(FILE_ACTION_REMOVED, from.path);
+      } else if (report_name) {
+        send_event(FILE_ACTION_ADDED, {rel_path, e.filename});
+      }
+      process_move(from.event, e);
+      tinder.erase(match);
+      if (tinder.empty()) {
+        ev_timer_stop(loop, &move_timer);
+      }
+    }
+  } else if (e.mask & IN_CREATE) {
+    if (report_name) {
+      send_event(FILE_ACTION_ADDED, {rel_path, e.filename});
+    }
+    process_add(e);
+  } else if (e.mask & IN_DELETE) {
+    if (report_name) {
+      send_event(FILE_ACTION_REMOVED, {rel_path, e.filename});
+    }
+    process_delete(e);
+  }
+}
+
+void InotifyWatcher::finish_events() {
+  if (tinder.size() && !ev_is_active(&move_timer)) {
+    ev_timer_set(&move_timer, MOVE_HOLD, 0);
+    ev_timer_start(loop, &move_timer);
+  }
+}
+
+InotifyWatcher::Tinder::iterator InotifyWatcher::settle_move(Tinder::iterator it) {
+  auto &moved = it->second;
+  if (moved.is_reported) {
+    send_event(FILE_ACTION_REMOVED, moved.path);
+  }
+  process_delete(moved.event);
+  it = tinder.erase(it);
+  if (tinder.empty()) {
+    ev_timer_stop(loop, &move_timer);
+  }
+  return it;
+}
+
+void InotifyWatcher::settle_moves() {
+  for (auto it = tinder.begin(); it != tinder.end();) {
+    it = settle_move(it);
+  }
+}
+
+void Inotify::read_events() {
+  static char buf[sizeof(inotify_event) + PATH_MAX + 1]
+      __attribute__((aligned(alignof(inotify_event))));
+
+  for (int i = 0; i < READ_BATCH; i++) {
+    ssize_t len = read(fd, buf, sizeof(buf));
+    if (len <= 0) {
+      if (errno != EAGAIN && errno != EWOULDBLOCK) {
+        for (auto &[wd, subscribed] : subscribers) {
+          for (auto watcher : subscribed) {
+            watcher->fail();
+          }
+        }
+      }
+      return;
+    }
+
+    auto now = ev_time();
+    const inotify_event *event = nullptr;
+    for (char *ptr = buf; ptr < buf + len; ptr += sizeof(inotify_event) + event->len) {
+      event = (const inotify_event *) ptr;
+
+      // Comes without a descriptor, the lost events could have been for any watch.
+      if (event->mask & IN_Q_OVERFLOW) {
+        std::set<InotifyWatcher *> overflowed;
+        for (auto &[wd, subscribed] : subscribers) {
+          overflowed.insert(subscribed.begin(), subscribed.end());
+        }
+        for (auto watcher : overflowed) {
+          watcher->queue_event(*event, now);
+        }
+        continue;
+      }
+      auto it = subscribers.find(event->wd);
+      if (it == subscribers.end()) {
+        continue;
+      }
+      for (auto watcher : it->second) {
+        watcher->queue_event(*event, now);
+      }
+      // New watches never get the descriptor again, the backlogs may still refer to it.
+      if (event->mask & IN_IGNORED) {
+        subscribers.erase(event->wd);
+      }
+    }
+  }
+}
+
+void Inotify::process_backlog(ev_tstamp deadline) {
+  std::vector<InotifyWatcher *> round;
+  while (backlog_cnt && ev_time() < deadline) {
+    round.assign(backlogged.begin(), backlogged.end());
+    std::sort(round.begin(), round.end(), [](InotifyWatcher *a, InotifyWatcher *b) {
+      return a->backlog_cnt < b->backlog_cnt;
+    });
+    for (auto watcher : round) {
+      // Handling events of one watcher may have failed or caught up another one.
+      if (backlogged.count(watcher)) {
+        watcher->process_backlog(BACKLOG_QUANTUM);
+      }
+    }
+  }
+}
+
+void InotifyWatcher::queue_event(const inotify_event &raw, ev_tstamp read_at) {
+  // IN_IGNORED still has to tell which descriptors are gone, the rescan does not.
+  if (is_failed || (is_overflowing && !(raw.mask & IN_IGNORED))) {
+    return;
+  }
+  // Like the kernel does with its queue: the rest is lost, and the tree is listed again once
+  // the watcher gets to the overflow.
+  inotify_event overflow{.wd = -1, .mask = IN_Q_OVERFLOW, .cookie = 0, .len = 0};
+  auto event = &raw;
+  if (backlog_cnt >= MAX_BACKLOG && !(raw.mask & (IN_IGNORED | IN_Q_OVERFLOW))) {
+    is_overflowing = true;
+    event = &overflow;
+  }
+  if (!backlog_cnt) {
+    inotify.backlogged.insert(this);
+  }
+  ++backlog_cnt;
+  ++inotify.backlog_cnt;
+  ++queued_seq;
+  backlog.append((const char *) &read_at, sizeof(read_at));
+  backlog.append((const char *) event, sizeof(inotify_event) + event->len);
+}
+
+uint64_t InotifyWatcher::process_backlog(uint64_t max_cnt) {
+  static char buf[sizeof(inotify_event) + PATH_MAX + 1]
+      __attribute__((aligned(alignof(inotify_event))));
+
+  uint64_t cnt = 0;
+  for (; cnt < max_cnt && backlog_cnt; ++cnt) {
+    ev_tstamp read_at;
+    memcpy(&read_at, backlog.data() + backlog_head, sizeof(read_at));
+    backlog_head += sizeof(read_at);
+    auto raw = (inotify_event *) buf;
+    memcpy(raw, backlog.data() + backlog_head, sizeof(inotify_event));
+    memcpy(raw->name, backlog.data() + backlog_head + sizeof(inotify_event), raw->len);
+    backlog_head += sizeof(inotify_event) + raw->len;
+    --backlog_cnt;
+    --inotify.backlog_cnt;
+    ++handled_seq;
+
+    if (raw->mask & IN_Q_OVERFLOW) {
+      is_overflowing = false;
+      rescan();
+    } else {
+      process_event(*raw);
+    }
+    latency.add(ev_time() - read_at);
+  }
+
+  if (!backlog_cnt || is_failed) {
+    inotify.backlog_cnt -= backlog_cnt;
+    inotify.backlogged.erase(this);
+    backlog_cnt = 0;
+    backlog = {};
+    backlog_head = 0;
+    handled_seq = queued_seq;
+    is_overflowing = false;
+  } else if (backlog_head >= backlog.size() / 2) {
+    backlog.erase(0, backlog_head);
+    backlog_head = 0;
+  }
+  if (cnt) {
+    finish_events();
+  }
+  return cnt;
+}
+
+bool InotifyWatcher::is_caught_up() {
+  inotify.read_events();
+  return !backlog_cnt;
+}
+
+namespace {
+  struct CrawlTarget {
+    WInotifyWatcher watcher;
+    DirRef dir;
+    uint64_t crawled_at;
+  };
+
+  std::map<uint64_t, CrawlTarget> crawl_targets;
+  uint64_t next_crawl_token = 0;
+
+  // A listing goes in two steps, each of which waits until the watcher handled the events that
+  // were read before it: add_subdirs, and then finish_crawl. The backlog is left to the
+  // scheduler of Inotify::process_backlog meanwhile, however long it is.
+  struct PendingCrawl {
+    CrawlTarget target;
+    CrawlResult result;
+    uint64_t wait_seq;      // InotifyWatcher::handled_seq to wait for
+    bool is_added = false;  // whether add_subdirs is done
+    bool trustworthy = false;
+    bool is_done = false;
+  };
+
+  std::vector<PendingCrawl> pending_crawls;
+}  // namespace
+
+void InotifyWatcher::process_queue() {
+  if (is_failed) {
+    unprocessed.clear();
+    return;
+  }
+  // A listing made in the middle of a move would report the moved directory as removed. Its
+  // IN_MOVED_TO may still be in the backlog, which gets its turn before the next slice.
+  if (tinder.size()) {
+    if (backlog_cnt) {
+      return;
+    }
+    settle_moves();
+  }
+  while (unprocessed.size()) {
+    auto dir = tree.get(unprocessed.front());
+    unprocessed.pop_front();
+    if (dir == NO_DIR) {
+      continue;
+    }
+
+    auto token = next_crawl_token++;
+    crawl_targets[token] = {weak_from_this(), tree.ref(dir), inotify.event_seq};
+    ++crawling;
+    crawler.submit({
+        .token = token,
+        .path = get_path(dir),
+        .mount_id = mount_id,
+        .with_ctime = (tree.flags[dir] & DirectoryTree::RESCAN) && wants(NOTIFY_MODIFY),
+    });
+  }
+}
+
+void InotifyWatcher::rescan() {
+  if (is_failed) {
+    return;
+  }
+  // Their IN_MOVED_TO may be among the lost events.
+  settle_moves();
+  overflowed_at = ++inotify.event_seq;
+  unprocessed.clear();
+  std::vector<dir_t> stack{root};
+  while (stack.size()) {
+    auto dir = stack.back();
+    stack.pop_back();
+    tree.flags[dir] |= DirectoryTree::IN_QUEUE | DirectoryTree::RESCAN;
+    unprocessed.push_back(tree.ref(dir));
+    for (auto child = tree.first_child[dir]; child != NO_DIR; child = tree.next_sibling[child]) {
+      stack.push_back(child);
+    }
+  }
+}
+
+bool InotifyWatcher::is_moved_since(dir_t dir, uint64_t crawled_at) const {
+  for (auto curr = dir; curr != NO_DIR; curr = tree.parent[curr]) {
+    if (tree.move_cookie[curr] > crawled_at) {
+      return true;
+    }
+  }
+  return false;
+}
+
+bool InotifyWatcher::add_subdirs(dir_t dir, const CrawlResult &result, uint64_t crawled_at) {
+  if (result.error == ENOENT || result.error == ENOTDIR) {
+    return false;
+  }
+  // The listing was made under the old path, watching its entries would put other directories
+  // in the wrong place.
+  if (is_moved_since(dir, crawled_at)) {
+    return false;
+  }
+  if (!recursive) {
+    diff_files(dir, result, crawled_at);
+    return true;  // subdirectories are entries like files then
+  }
+
+  // Differences can only come from lost events once the directory was listed before.
+  bool report = tree.flags[dir] & DirectoryTree::ALREADY_ADDED;
+  if (!result.error) {
+    for (const auto &name : result.subdirs) {
+      if (auto child = tree.find_child(dir, name); child != NO_DIR) {
+        tree.flags[child] |= DirectoryTree::SEEN;
+      }
+    }
+    // Gone before the listing, unless added after it. Removing them first frees the watches of
+    // directories that were renamed.
+    for (auto child = tree.first_child[dir]; child != NO_DIR;) {
+      auto next = tree.next_sibling[child];
+      if (tree.flags[child] & DirectoryTree::SEEN) {
+        tree.flags[child] &= ~DirectoryTree::SEEN;
+      } else if (tree.move_cookie[child] <= crawled_at) {
+        if (report && wants_name(true)) {
+          send_event(FILE_ACTION_REMOVED, {tree.get_rel_path(dir), tree.get_name(child)});
+        }
+        remove_dir(child);
+      }
+      child = next;
+    }
+  }
+  // Before adding subdirectories, in case one replaced a file of the same name.
+  diff_files(dir, result, crawled_at);
+
+  auto rel_path = tree.get_rel_path(dir);
+  for (const auto &name : result.subdirs) {
+    // Subdirectories known from an earlier crawl or created while this one was running are kept
+    // as they are.
+    if (tree.find_child(dir, name) != NO_DIR || excludes.is_excluded({rel_path, name}, true)) {
+      continue;
+    }
+    std::string curr_path = result.request.path + name;
+    // Mounts that the mount table does not know about yet are caught by the crawler instead,
+    // see skip_mount.
+    if (mount_id && mount_table.is_mount_point(curr_path)) {
+      report_skipped_mount({rel_path, name});
+      continue;
+    }
+    int wd = inotify.add_watch(this, curr_path.data());
+    if (wd == -1) {
+      if (errno == EEXIST || errno == ENOTDIR || errno == ENOENT) {
+        if (!(tree.flags[dir] & DirectoryTree::ALREADY_ADDED) || errno != EEXIST) {
+          return false;
+        }
+      } else {
+        fail();
+        return false;
+      }
+    } else {
+      add_dir(wd, dir, name);
+      if (report && wants_name(true)) {
+        send_event(FILE_ACTION_ADDED, {rel_path, name});
+      }
+    }
+  }
+  return true;
+}
+
+void InotifyWatcher::diff_files(dir_t dir, const CrawlResult &result, uint64_t crawled_at) {
+  if (result.error || is_failed) {
+    return;
+  }
+  bool report = tree.flags[dir] & DirectoryTree::ALREADY_ADDED;
+  auto rel_path = tree.get_rel_path(dir);
+  auto since = get_since(result.time);
+  // Usually the first listing, where every name is new.
+  bool was_empty = tree.files[dir].empty();
+  if (was_empty) {
+    tree.files[dir].reserve(result.files.size() + (recursive ? 0 : result.subdirs.size()));
+  }
+  auto diff = [&](std::string_view name, uint8_t type, int64_t ctime) {
+    bool is_dir = type == DT_DIR;
+    if (excludes.is_excluded({rel_path, name}, is_dir)) {
+      return;
+    }
+    bool report_name = report && wants_name(is_dir);
+    auto *file = was_empty ? nullptr : tree.find_file(dir, name);
+    if (!file) {
+      if (report_name) {
+        send_event(FILE_ACTION_ADDED, {rel_path, name});
+      }
+      file = &tree.add_file(dir, name);
+    } else if (file->seq > crawled_at) {
+      // Events after the listing know better.
+      file->flags |= FileEntry::SEEN;
+      return;
+    } else if (file->flags & FileEntry::DELETED) {
+      if (report_name) {
+        send_event(FILE_ACTION_ADDED, {rel_path, name});
+      }
+      file->flags &= ~FileEntry::DELETED;
+    } else if (file->type != DT_UNKNOWN && file->type != type) {
+      if (report_name) {
+        send_event(FILE_ACTION_REMOVED, {rel_path, name});
+        send_event(FILE_ACTION_ADDED, {rel_path, name});
+      }
+    } else if (report && result.request.with_ctime && ctime >= file->since && !is_dir) {
+      send_event(FILE_ACTION_MODIFIED, {rel_path, name});
+    }
+    file->type = type;
+    file->flags |= FileEntry::SEEN;
+    file->since = since;
+    file->seq = 0;
+  };
+  for (const auto &file : result.files) {
+    diff(result.get_name(file), file.type, file.ctime);
+  }
+  if (!recursive) {
+    for (const auto &name : result.subdirs) {
+      diff(name, DT_DIR, 0);
+    }
+  }
+
+  // Erasing moves the last entry into the hole, which was already looked at.
+  auto &entries = tree.files[dir];
+  for (size_t pos = entries.size(); pos--;) {
+    auto &file = entries[pos];
+    if (file.flags & FileEntry::SEEN) {
+      file.flags &= ~FileEntry::SEEN;
+    } else if (file.seq <= crawled_at) {
+      if (!(file.flags & FileEntry::DELETED) && report && wants_name(file.type == DT_DIR)) {
+        send_event(FILE_ACTION_REMOVED, {rel_path, tree.names.get(file.name)});
+      }
+      tree.erase_file(dir, pos);
+    }
+  }
+}
+
+void InotifyWatcher::finish_crawl(dir_t dir, bool trustworthy, uint64_t crawled_at) {
+  if (is_failed) {
+    return;
+  }
+
+  if (trustworthy && !is_moved_since(dir, crawled_at)) {
+    tree.flags[dir] &= ~(DirectoryTree::IN_QUEUE | DirectoryTree::RESCAN);
+    tree.flags[dir] |= DirectoryTree::ALREADY_ADDED;
+    // No listing is left that could still show deleted entries.
+    auto &entries = tree.files[dir];
+    for (size_t pos = entries.size(); pos--;) {
+      if (entries[pos].flags & FileEntry::DELETED) {
+        tree.erase_file(dir, pos);
+      }
+    }
+    for (auto child = tree.first_child[dir]; child != NO_DIR; child = tree.next_sibling[child]) {
+      if (!(tree.flags[child] & DirectoryTree::ALREADY_ADDED)) {
+        add_to_queue(child);
+      }
+    }
+  } else {
+    if (++tree.fail_cnt[dir] == DIR_FAIL_CNT) {
+      fail();
+      return;
+    }
+    unprocessed.push_back(tree.ref(dir));
+  }
+}
+
+void process_crawl_results(std::vector<CrawlResult> &results) {
+  // Learn about directories moved while they were listed before adding anything below them.
+  inotify.read_events();
+  mount_table.refresh();
+
+  for (auto &result : results) {
+    auto node = crawl_targets.extract(result.request.token);
+    if (node.empty()) {
+      continue;
+    }
+    auto watcher = node.mapped().watcher.lock();
+    if (!watcher) {
+      continue;
+    }
+    auto wait_seq = watcher->queued_seq;
+    pending_crawls.push_back({std::move(node.mapped()), std::move(result), wait_seq});
+  }
+
+  bool is_added = false;
+  for (auto &crawl : pending_crawls) {
+    auto watcher = crawl.target.watcher.lock();
+    if (!watcher) {
+      crawl.is_done = true;
+      continue;
+    }
+    if (crawl.is_added || watcher->handled_seq < crawl.wait_seq) {
+      continue;
+    }
+    crawl.is_added = true;
+    // The directory was queued again by rescan.
+    auto dir = watcher->tree.get(crawl.target.dir);
+    if (crawl.target.crawled_at < watcher->overflowed_at || dir == NO_DIR ||
+        watcher->is_failed) {
+      crawl.is_done = true;
+      continue;
+    }
+    if (crawl.result.error == EXDEV) {
+      watcher->skip_mount(dir);
+      crawl.is_done = true;
+      continue;
+    }
+    crawl.trustworthy = watcher->add_subdirs(dir, crawl.result, crawl.target.crawled_at);
+    crawl.wait_seq = UINT64_MAX;
+    is_added = true;
+  }
+
+  // Catch moves that raced with add_subdirs too.
+  if (is_added) {
+    inotify.read_events();
+  }
+  for (auto &crawl : pending_crawls) {
+    auto watcher = crawl.target.watcher.lock();
+    if (crawl.is_done || !crawl.is_added || !watcher) {
+      continue;
+    }
+    if (crawl.wait_seq == UINT64_MAX) {
+      crawl.wait_seq = watcher->queued_seq;
+    }
+    if (watcher->handled_seq < crawl.wait_seq) {
+      continue;
+    }
+    crawl.is_done = true;
+    // Directories removed in the meantime do not resolve any more.
+    auto dir = watcher->tree.get(crawl.target.dir);
+    if (crawl.target.crawled_at >= watcher->overflowed_at && dir != NO_DIR &&
+        !watcher->is_failed) {
+      watcher->finish_crawl(dir, crawl.trustworthy, crawl.target.crawled_at);
+    }
+  }
+
+  // Watchers count their listings as crawling until they are done.
+  std::erase_if(pending_crawls, [](const PendingCrawl &crawl) {
+    if (!crawl.is_done) {
+      return false;
+    }
+    if (auto watcher = crawl.target.watcher.lock()) {
+      --watcher->crawling;
+    }
+    return true;
+  });
+}
@@ -0,0 +1,186 @@
+#pragma once
+
+#include <ev.h>
+#include <sys/inotify.h>
+
+#include <deque>
+#include <map>
+#include <memory>
+#include <set>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "crawler.h"
+#include "directory-tree.h"
+#include "watcher.h"
+
+// Needed to keep the tree of a recursive watch in sync, whatever the client asked for.
+const uint32_t INOTIFY_TREE_EVENTS = IN_CREATE | IN_DELETE | IN_MOVE;
+// Needed to notice that the watched directory itself is gone.
+const uint32_t INOTIFY_SELF_EVENTS = IN_DELETE_SELF | IN_MOVE_SELF;
+const uint32_t INOTIFY_FLAGS = IN_DONT_FOLLOW | IN_ONLYDIR | IN_EXCL_UNLINK;
+
+struct InotifyWatcher;
+using WInotifyWatcher = std::weak_ptr<InotifyWatcher>;
+
+// The only inotify instance of the process. Kernel watches are shared between Watchers: every
+// Watcher holding a descriptor is recorded in `subscribers`, and the watch is removed once the
+// last of them releases it.
+//
+// Events are read in bounded batches into the backlog of every subscriber, and handled from
+// there a few at a time per watcher, so that a watch under a storm does not hold up the others.
+struct Inotify {
+  ev_io ev_watcher;
+  int fd = -1;
+  std::map<int, std::set<InotifyWatcher *>> subscribers;
+  std::set<InotifyWatcher *> backlogged;  // watchers with events in their backlog
+  uint64_t backlog_cnt = 0;               // events in all backlogs
+  // Bumped by every event that a listing made before it could contradict, see
+  // DirectoryTree::move_cookie and FileEntry::seq.
+  uint64_t event_seq = 0;
+
+  void init();
+
+  // Behaves like inotify_add_watch with IN_MASK_CREATE, but only reports EEXIST if `w` already
+  // holds the watch. The mask of a shared watch is the union of what its subscribers asked for,
+  // so every watcher filters out the events it did not ask for itself.
+  int add_watch(InotifyWatcher *w, const char *path);
+  void release(InotifyWatcher *w, int wd);
+
+  // Reads what the kernel has, up to a batch, into the backlogs. A watcher whose backlog is
+  // full drops its events and lists its tree again, the others are not affected.
+  void read_events();
+
+  bool has_backlog() const {
+    return backlog_cnt;
+  }
+
+  // Handles backlogged events in rounds until `deadline`: each round gives every watcher a
+  // quantum, smallest backlogs first.
+  void process_backlog(ev_tstamp deadline);
+};
+
+extern Inotify inotify;
+
+// Feeds directory listings made by the crawler back to their watchers, along with the earlier
+// ones that waited for the backlog of their watcher. Can be called with no results for those.
+void process_crawl_results(std::vector<CrawlResult> &results);
+
+// Mirrors the directory tree below `path` with one inotify watch per directory. The files in it
+// are remembered as well, to find out what changed when events were lost.
+struct InotifyWatcher : Watcher, std::enable_shared_from_this<InotifyWatcher> {
+  struct hl_inotify_event {
+    int wd;
+    DirRef dir;
+    uint32_t mask;
+    std::string_view filename;
+  };
+
+  // An IN_MOVED_FROM waiting for its IN_MOVED_TO. `event.filename` points into the end of `path`.
+  struct moved_from_event {
+    hl_inotify_event event;
+    std::string path;  // relative to `path` of the watcher, before the move
+    bool is_reported;  // whether the client asked for the name
+    uint64_t handled_at;  // `handled_seq` as of the IN_MOVED_FROM
+  };
+  using Tinder = std::map<uint32_t, moved_from_event>;
+
+  uint32_t kernel_mask = 0;  // inotify events needed to serve `filter`
+  uint64_t mount_id = 0;     // of `path`, unless the watch crosses mounts
+  // Inotify::event_seq as of the last time events were lost. Listings made before are dropped.
+  uint64_t overflowed_at = 0;
+  DirectoryTree tree;
+  dir_t root = NO_DIR;
+  DirMap by_wd;
+  std::deque<DirRef> unprocessed;
+  // Moves by cookie. Events of other processes may come before their IN_MOVED_TO, those of the
+  // same rename do not.
+  Tinder tinder;
+  ev_timer move_timer;  // runs while `tinder` waits for the rest of a move
+  // Events read from the kernel but not handled yet: each one is the ev_tstamp of the read,
+  // followed by the inotify_event and its name.
+  std::string backlog;
+  size_t backlog_head = 0;  // bytes of `backlog` that are handled already
+  uint64_t backlog_cnt = 0;
+  // Events ever added to and handled from `backlog`. Crawl results wait until the events read
+  // before them are handled.
+  uint64_t queued_seq = 0;
+  uint64_t handled_seq = 0;
+  bool is_overflowing = false;  // whether events are dropped until the overflow in `backlog`
+  uint64_t crawling = 0;
+
+  InotifyWatcher(std::string_view path_, uint32_t filter_, bool recursive_,
+                 uint32_t capabilities_);
+
+  ~InotifyWatcher();
+
+  bool start();
+
+  // The smallest inotify mask that serves `filter`.
+  uint32_t get_mask() const;
+
+  bool has_work() override {
+    return unprocessed.size();
+  }
+
+  uint64_t get_watched_cnt() override {
+    return tree.live_cnt;
+  }
+
+  uint64_t get_queued_cnt() override {
+    return unprocessed.size() + crawling;
+  }
+
+  // Answers from the tree and its files once the directory is listed and watched, and no events
+  // were lost since.
+  bool get_cached_listing(std::string_view rel_path, CrawlResult &result) override;
+
+  size_t get_memory_usage() override;
+
+  std::string get_path(dir_t dir);
+
+  dir_t add_dir(int wd, dir_t parent, std::string_view name);
+  void remove_dir(dir_t dir);
+
+  // Drops a directory that turned out to be on another mount.
+  void skip_mount(dir_t dir);
+
+  void add_to_queue(dir_t dir);
+  // Hands queued directories to the crawler.
+  void process_queue() override;
+
+  // Lists every directory again after the kernel dropped events. The listings are compared with
+  // the tree and its files, and the differences are reported as events.
+  void rescan();
+
+  // Whether `dir` or one of its parents was moved after Inotify::event_seq was `crawled_at`.
+  bool is_moved_since(dir_t dir, uint64_t crawled_at) const;
+  // Watches new subdirectories, drops the ones that are gone and diffs the files. Returns false
+  // if the listing has to be made again.
+  bool add_subdirs(dir_t dir, const CrawlResult &result, uint64_t crawled_at);
+  // Brings tree.files[dir] in line with the listing.
+  void diff_files(dir_t dir, const CrawlResult &result, uint64_t crawled_at);
+  void finish_crawl(dir_t dir, bool trustworthy, uint64_t crawled_at);
+
+  void process_add(const hl_inotify_event &e);
+  void process_delete(const hl_inotify_event &e);
+  void process_move(const hl_inotify_event &from, const hl_inotify_event &to);
+  // Records an event about an entry that is not in the tree.
+  void update_file(dir_t dir, const hl_inotify_event &e);
+  void process_event(const inotify_event &raw);
+  // Adds an event to `backlog`. IN_Q_OVERFLOW stands for events that were lost at that point,
+  // which is also what a full backlog turns into.
+  void queue_event(const inotify_event &raw, ev_tstamp read_at);
+  // Handles up to `max_cnt` events of `backlog`, returns how many.
+  uint64_t process_backlog(uint64_t max_cnt);
+  // Reads the kernel queue. Returns whether the tree is current, which it is not while events
+  // wait in `backlog`.
+  bool is_caught_up();
+  // Waits a little for the IN_MOVED_TO of moves split across reads.
+  void finish_events();
+  // Gives up on a move in `tinder`: it left the watch, and is reported as a removal. Returns
+  // the next one.
+  Tinder::iterator settle_move(Tinder::iterator it);
+  void settle_moves();
+};
@@ -0,0 +1,24 @@
+#include "latency-stats.h"
+
+#include <algorithm>
+#include <bit>
+
+void LatencyStats::add(ev_tstamp latency) {
+  ++cnt;
+  sum += latency;
+  max = std::max(max, latency);
+  // Bucket i holds latencies below 2^i us.
+  auto us = (uint64_t) std::max(latency * 1e6, 0.0);
+  ++buckets[std::min(BUCKETS - 1, (int) std::bit_width(us))];
+}
+
+ev_tstamp LatencyStats::get_percentile(double fraction) const {
+  uint64_t seen = 0;
+  for (int i = 0; i < BUCKETS; i++) {
+    seen += buckets[i];
+    if ((double) seen >= fraction * (double) cnt) {
+      return std::min(max, (double) (1ull << i) / 1e6);
+    }
+  }
+  return max;
+}
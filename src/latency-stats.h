@@ -0,0 +1,23 @@
+#pragma once
+
+#include <ev.h>
+
+#include <cstdint>
+
+// How long events of a watch waited between being read from the kernel and being handled.
+// Latencies are counted in buckets of powers of two microseconds.
+class LatencyStats {
+  private:
+  static constexpr int BUCKETS = 32;
+
+  uint64_t buckets[BUCKETS] = {};
+
+  public:
+  uint64_t cnt = 0;
+  ev_tstamp sum = 0, max = 0;
+
+  void add(ev_tstamp latency);
+
+  // The latency that `fraction` of the events did not exceed, rounded up to a bucket boundary.
+  ev_tstamp get_percentile(double fraction) const;
+};
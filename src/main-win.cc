@@ -6,12 +6,14 @@
 #include <psapi.h>
 #include <wslapi.h>
 
+#include <algorithm>
 #include <atomic>
 #include <cassert>
+#include <cerrno>
 #include <codecvt>
+#include <cstddef>
 #include <cstdint>
 #include <cstdio>
-#include <deque>
 #include <iostream>
 #include <locale>
 #include <map>
@@ -75,7 +77,18 @@ void ensure_console() {
     }                     \
   } while (0)
 
-const int STDOUT_BUFF = 1024;
+const size_t STDOUT_BUFF = 64 * 1024;
+
+// Exclude rules applied to every watch, separated by ';', e.g. "node_modules/;.git/objects/".
+const char EXCLUDE_RULES_ENV[] = "WSL_FS_NOTIFY_EXCLUDE";
+// Milliseconds for the daemon to hold events back and merge repeated changes, see --coalesce-ms.
+const char COALESCE_MS_ENV[] = "WSL_FS_NOTIFY_COALESCE_MS";
+// Set to 1 to drop modifications that left the digest of a file as it was, see --skip-unchanged.
+const char SKIP_UNCHANGED_ENV[] = "WSL_FS_NOTIFY_SKIP_UNCHANGED";
+// Milliseconds that writes to a file that stays open are held back, see --settle-ms.
+const char SETTLE_MS_ENV[] = "WSL_FS_NOTIFY_SETTLE_MS";
+// Set to 1 to share one daemon per distro with other processes, see --shared.
+const char SHARED_ENV[] = "WSL_FS_NOTIFY_SHARED";
 
 struct ForeignNotifier {
   std::atomic<HANDLE> in_read, in_write, out_read, out_write, process;
@@ -83,23 +96,142 @@ struct ForeignNotifier {
 
   std::atomic_flag failed = ATOMIC_FLAG_INIT;
 
-  char input[STDOUT_BUFF];
   PullableMessageStream in_stream;
   OVERLAPPED out_ov{};
+  uint32_t capabilities = 0;
 };
 
 std::wstring_convert<std::codecvt_utf8_utf16<wchar_t>> converter;
 
+// Returned by WslFsNotifyGetWatchStatus.
+struct WatchStatus {
+  BOOL is_supported;  // whether the daemon reports progress at all
+  BOOL is_ready;      // whether the whole tree is being watched
+  uint64_t watched;   // directories watched so far
+  uint64_t queued;    // directories still to be crawled
+  uint64_t ready_ms;  // time from the request to WatchReady
+};
+
+// Returned by WslFsNotifyGetFileInfo. Times are FILETIMEs, 0 if unknown.
+struct FileInfo {
+  uint64_t creation_time;
+  uint64_t last_write_time;
+  uint64_t change_time;
+  uint64_t last_access_time;
+  uint64_t allocated;
+  uint64_t size;
+  uint64_t file_id;  // the inode number
+  DWORD attributes;
+};
+
+// FILE_NOTIFY_EXTENDED_INFORMATION, which not every MinGW has.
+struct NotifyExtendedInformation {
+  DWORD NextEntryOffset;
+  DWORD Action;
+  LARGE_INTEGER CreationTime;
+  LARGE_INTEGER LastModificationTime;
+  LARGE_INTEGER LastChangeTime;
+  LARGE_INTEGER LastAccessTime;
+  LARGE_INTEGER AllocatedLength;
+  LARGE_INTEGER FileSize;
+  DWORD FileAttributes;
+  DWORD ReparsePointTag;
+  LARGE_INTEGER FileId;
+  LARGE_INTEGER ParentFileId;
+  DWORD FileNameLength;
+  WCHAR FileName[1];
+};
+static_assert(offsetof(NotifyExtendedInformation, FileId) == 64);
+static_assert(offsetof(NotifyExtendedInformation, FileName) == 84);
+
+// ReadDirectoryNotifyExtendedInformation of READ_DIRECTORY_NOTIFY_INFORMATION_CLASS.
+const int NOTIFY_EXTENDED_INFORMATION = 2;
+// Entries of files that were not heard of for a while are dropped once there are that many.
+const size_t FILE_INFO_CACHE = 64 * 1024;
+
+// The attributes that follow from the file type in `mode`.
+DWORD get_type_attributes(uint32_t mode) {
+  if ((mode & 0170000) == 0040000) {
+    return FILE_ATTRIBUTE_DIRECTORY;
+  }
+  if ((mode & 0170000) == 0120000) {
+    return FILE_ATTRIBUTE_REPARSE_POINT;  // a symlink
+  }
+  return 0;
+}
+
+// From nanoseconds since the Unix epoch, 0 stays 0.
+uint64_t to_filetime(int64_t ns) {
+  const uint64_t UNIX_EPOCH = 116444736000000000;  // as a FILETIME
+  return ns ? (uint64_t) (ns / 100) + UNIX_EPOCH : 0;
+}
+
+FileInfo to_file_info(const FileStat &stat) {
+  DWORD attributes = get_type_attributes(stat.mode);
+  if (!(stat.mode & 0200)) {
+    attributes |= FILE_ATTRIBUTE_READONLY;
+  }
+  return {
+      .creation_time = to_filetime(stat.btime),
+      .last_write_time = to_filetime(stat.mtime),
+      .change_time = to_filetime(stat.ctime),
+      .last_access_time = to_filetime(stat.atime),
+      .allocated = stat.allocated,
+      .size = stat.size,
+      .file_id = stat.ino,
+      .attributes = attributes ? attributes : FILE_ATTRIBUTE_NORMAL,
+  };
+}
+
 struct IOOperation {
+  HANDLE directory;
   HANDLE notify_in;
-  std::deque<PMessage> events;
+  MessageStream events;  // 'U' and 'E' messages waiting for a buffer
+  // Messages in `events` that hold one of the daemon's EventCredits, which failures do not.
+  uint32_t queued = 0;
   void *buffer = nullptr;
   DWORD buffer_length;
   LPOVERLAPPED overlapped;
   LPOVERLAPPED_COMPLETION_ROUTINE overlapped_completion;
+  bool is_extended = false;  // the buffer takes NotifyExtendedInformation
+  WatchStatus status{};
+  ULONGLONG started_at = 0;
+  uint32_t capabilities = 0;  // of the daemon serving the watch
+  std::vector<std::wstring> skipped_mounts;  // from MountSkipped, with backslashes
+  bool is_dirty = false;                      // a SubtreeDirty is waiting for a buffer
+  std::map<std::wstring, FileInfo> file_info;  // from EventStat, by path with backslashes
+
+  // Gives the credits of `cnt` messages that left `events` back to the daemon.
+  void return_credits(uint32_t cnt) {
+    queued -= cnt;
+    if (cnt && (capabilities & CAP_EVENT_CREDITS)) {
+      EventCredits req = {
+          .msg_type = 'C',
+          .directory = directory,
+          .credits = cnt,
+      };
+      write_message(notify_in, req);
+    }
+  }
+
+  // Forgets the events that wait for a buffer, as a rescan covers them.
+  void drop_events() {
+    events = {};
+    return_credits(queued);
+  }
 
   void flush() {
-    if (!events.size() || buffer == nullptr) {
+    if (buffer == nullptr) {
+      return;
+    }
+    // Like an overflowing buffer, which clients answer by listing the directory again.
+    if (is_dirty) {
+      is_dirty = false;
+      buffer = nullptr;
+      overlapped_completion(ERROR_SUCCESS, 0, overlapped);
+      return;
+    }
+    if (!events.has_message()) {
       return;
     }
 
@@ -107,41 +239,77 @@ struct IOOperation {
     DWORD offset = 0;
     DWORD *next_offset = nullptr;
     bool has_failure = false;
+    uint32_t delivered = 0;
 
-    while (events.size()) {
-      auto ev = events.front()->as<Event>();
+    while (auto msg = events.peek_message()) {
+      // EventStat starts like Event.
+      auto ev = msg->as<Event>();
+      bool has_stat = msg->data[0] == 'E';
       if (ev->action == uint32_t(-1)) {
         has_failure = true;
-        events.pop_front();
+        events.skip_message();
         break;
       }
-      auto path = events.front()->get_trailer<Event>();
-      std::wstring filename = converter.from_bytes(path.data(), path.data() + path.size());
-      for (wchar_t &c : filename) {
-        if (c == L'/') {
-          c = L'\\';
-        }
-      }
-      size_t clen = 2 * filename.size() + 3 * sizeof(DWORD);
+      auto path = has_stat ? msg->get_trailer<EventStat>() : msg->get_trailer<Event>();
+      int wlen = path.empty() ? 0
+                              : MultiByteToWideChar(CP_UTF8, 0, path.data(), (int) path.size(),
+                                                    nullptr, 0);
+      // Entries have to be aligned like their largest field.
+      DWORD header = is_extended ? offsetof(NotifyExtendedInformation, FileName)
+                                 : offsetof(FILE_NOTIFY_INFORMATION, FileName);
+      DWORD align = is_extended ? sizeof(LARGE_INTEGER) : sizeof(DWORD);
+      DWORD clen = (DWORD) ((header + 2 * wlen + align - 1) & ~(align - 1));
 
       if (buffer_length - offset < clen) {
         break;
       }
 
-      auto info = (FILE_NOTIFY_INFORMATION *) (buff + offset);
-      info->NextEntryOffset = (DWORD) clen;
-      info->Action = ev->action;
-      info->FileNameLength = (DWORD) (2 * filename.size());
-      memcpy(info->FileName, filename.data(), 2 * filename.size());
+      WCHAR *filename;
+      if (is_extended) {
+        auto info = (NotifyExtendedInformation *) (buff + offset);
+        *info = {};
+        info->NextEntryOffset = clen;
+        info->Action = ev->action;
+        info->FileNameLength = (DWORD) (2 * wlen);
+        if (has_stat) {
+          auto stat = to_file_info(msg->as<EventStat>()->stat);
+          info->CreationTime.QuadPart = (LONGLONG) stat.creation_time;
+          info->LastModificationTime.QuadPart = (LONGLONG) stat.last_write_time;
+          info->LastChangeTime.QuadPart = (LONGLONG) stat.change_time;
+          info->LastAccessTime.QuadPart = (LONGLONG) stat.last_access_time;
+          info->AllocatedLength.QuadPart = (LONGLONG) stat.allocated;
+          info->FileSize.QuadPart = (LONGLONG) stat.size;
+          info->FileAttributes = stat.attributes;
+          info->FileId.QuadPart = (LONGLONG) stat.file_id;
+        }
+        filename = info->FileName;
+        next_offset = &info->NextEntryOffset;
+      } else {
+        auto info = (FILE_NOTIFY_INFORMATION *) (buff + offset);
+        info->NextEntryOffset = clen;
+        info->Action = ev->action;
+        info->FileNameLength = (DWORD) (2 * wlen);
+        filename = info->FileName;
+        next_offset = &info->NextEntryOffset;
+      }
+      if (wlen) {
+        MultiByteToWideChar(CP_UTF8, 0, path.data(), (int) path.size(), filename, wlen);
+      }
+      for (int i = 0; i < wlen; i++) {
+        if (filename[i] == L'/') {
+          filename[i] = L'\\';
+        }
+      }
 
-      next_offset = &info->NextEntryOffset;
-      offset += (int) clen;
-      events.pop_front();
+      offset += clen;
+      events.skip_message();
+      ++delivered;
     }
 
     if (next_offset != nullptr) {
       *next_offset = 0;
     }
+    return_credits(delivered);
     buffer = nullptr;
     overlapped_completion(has_failure ? ERROR_INOTIFY_FAILED : ERROR_SUCCESS, offset, overlapped);
   }
@@ -150,6 +318,162 @@ struct IOOperation {
 std::map<std::wstring, std::shared_ptr<ForeignNotifier>> notifiers;
 std::map<HANDLE, IOOperation> io_ops;
 
+// Passed to the callback of WslFsNotifyListDirectory. Without bWithInfo, `info` only has the
+// attributes that follow from the file type.
+struct DirectoryEntry {
+  LPCWSTR name;
+  FileInfo info;
+};
+
+// Gets the entries of a directory a chunk at a time, `is_last` is set on the last call. It is
+// called like a completion routine, so the thread has to wait alertably.
+using ListDirectoryCallback = void(WINAPI *)(void *context, DWORD error,
+                                             const DirectoryEntry *entries, DWORD count,
+                                             BOOL is_last);
+
+struct PendingListing {
+  HANDLE directory;
+  bool with_info;
+  ListDirectoryCallback callback;
+  void *context;
+};
+
+std::map<uint64_t, PendingListing> listings;  // by DirectoryListRequest::id
+
+// Passed to the callback of WslFsNotifyGetFileDigests, one for each requested path.
+struct FileDigestInfo {
+  uint64_t digest;           // XXH64 of the contents
+  uint64_t size;             // of what was digested
+  uint64_t last_write_time;  // as a FILETIME
+  DWORD error;
+};
+
+// Gets the digests in the order of the paths. Called like a completion routine, with
+// ERROR_OPERATION_ABORTED and no digests if the request was cancelled.
+using FileDigestCallback = void(WINAPI *)(void *context, DWORD error,
+                                          const FileDigestInfo *digests, DWORD count);
+
+struct PendingDigests {
+  HANDLE directory;
+  FileDigestCallback callback;
+  void *context;
+};
+
+std::map<uint64_t, PendingDigests> digest_requests;  // by FileDigestRequest::id
+// From WslFsNotifySetSettleTime, for watches that are yet to start.
+std::map<HANDLE, DWORD> settle_times;
+uint64_t next_request_id = 0;
+
+DWORD to_win32_error(uint32_t error) {
+  switch (error) {
+    case 0:
+      return ERROR_SUCCESS;
+    case ENOENT:
+      return ERROR_PATH_NOT_FOUND;
+    case ENOTDIR:
+      return ERROR_DIRECTORY;
+    case EACCES:
+      return ERROR_ACCESS_DENIED;
+    case EISDIR:
+    case EINVAL:
+      return ERROR_INVALID_FUNCTION;  // what reading a directory fails with
+    case EFBIG:
+      return ERROR_FILE_TOO_LARGE;
+    default:
+      return ERROR_GEN_FAILURE;
+  }
+}
+
+void deliver_listing(const MessageView &msg) {
+  auto chunk = msg.read<DirectoryListChunk>();
+  auto it = listings.find(chunk.id);
+  if (it == listings.end()) {
+    return;
+  }
+  auto listing = it->second;
+  if (chunk.is_last) {
+    listings.erase(it);
+  }
+
+  auto data = msg.get_trailer<DirectoryListChunk>();
+  std::vector<std::wstring> names;
+  std::vector<DirectoryEntry> entries;
+  for (size_t pos = 0; pos + sizeof(DirectoryListEntry) <= data.size();) {
+    DirectoryListEntry entry;
+    memcpy(&entry, data.data() + pos, sizeof(entry));
+    pos += sizeof(entry);
+    auto name = data.substr(pos, entry.name_length);
+    pos += name.size();
+    names.push_back(converter.from_bytes(name.data(), name.data() + name.size()));
+    FileInfo info{};
+    info.attributes = get_type_attributes(entry.type);
+    if (listing.with_info && pos + sizeof(FileStat) <= data.size()) {
+      FileStat stat;
+      memcpy(&stat, data.data() + pos, sizeof(stat));
+      pos += sizeof(stat);
+      info = to_file_info(stat);
+    }
+    if (!info.attributes) {
+      info.attributes = FILE_ATTRIBUTE_NORMAL;
+    }
+    entries.push_back({.name = nullptr, .info = info});
+  }
+  // Only now that `names` stopped growing.
+  for (size_t i = 0; i < entries.size(); i++) {
+    entries[i].name = names[i].c_str();
+  }
+  listing.callback(listing.context, to_win32_error(chunk.error), entries.data(),
+                   (DWORD) entries.size(), chunk.is_last);
+}
+
+void deliver_digests(const MessageView &msg) {
+  auto reply = msg.read<FileDigestReply>();
+  auto it = digest_requests.find(reply.id);
+  if (it == digest_requests.end()) {
+    return;
+  }
+  auto request = it->second;
+  digest_requests.erase(it);
+
+  auto data = msg.get_trailer<FileDigestReply>();
+  std::vector<FileDigestInfo> digests;
+  for (size_t pos = 0; pos + sizeof(FileDigest) <= data.size(); pos += sizeof(FileDigest)) {
+    FileDigest digest;
+    memcpy(&digest, data.data() + pos, sizeof(digest));
+    digests.push_back({
+        .digest = digest.digest,
+        .size = digest.size,
+        .last_write_time = to_filetime(digest.mtime),
+        .error = to_win32_error(digest.error),
+    });
+  }
+  request.callback(request.context, ERROR_SUCCESS, digests.data(), (DWORD) digests.size());
+}
+
+void stdout_cb(DWORD dwErrorCode, DWORD dwNumberOfBytesTransfered, LPOVERLAPPED lpOverlapped);
+
+// Reads straight into the free space of the stream. Nothing else touches the stream until the
+// read completes.
+void read_output(ForeignNotifier *notifier) {
+  auto space = notifier->in_stream.prepare(STDOUT_BUFF);
+  ReadFileEx(notifier->out_read, space.data(), (DWORD) space.size(), &notifier->out_ov,
+             stdout_cb);
+}
+
+void remember_file_info(IOOperation &op, const FileStat &stat, std::string_view path) {
+  auto name = converter.from_bytes(path.data(), path.data() + path.size());
+  std::replace(name.begin(), name.end(), L'/', L'\\');
+  // Removals come without metadata, and so do files that were gone before the daemon got to them.
+  if (!stat.mode) {
+    op.file_info.erase(name);
+    return;
+  }
+  if (op.file_info.size() >= FILE_INFO_CACHE && !op.file_info.count(name)) {
+    op.file_info.clear();
+  }
+  op.file_info[name] = to_file_info(stat);
+}
+
 void stdout_cb(DWORD dwErrorCode, DWORD dwNumberOfBytesTransfered, LPOVERLAPPED lpOverlapped) {
   if (dwErrorCode == ERROR_OPERATION_ABORTED) {
     return;
@@ -157,14 +481,51 @@ void stdout_cb(DWORD dwErrorCode, DWORD dwNumberOfBytesTransfered, LPOVERLAPPED
 
   auto notifier = (ForeignNotifier *) lpOverlapped->hEvent;
   auto &stream = notifier->in_stream;
-  stream.feed(notifier->input, dwNumberOfBytesTransfered);
+  stream.commit(dwNumberOfBytesTransfered);
 
   std::vector<decltype(io_ops)::iterator> affected;
-  while (stream.has_message()) {
-    auto msg = *stream.get_message();
-    if (msg->data[0] == 'U') {
+  while (auto msg = stream.get_message()) {
+    if (msg->data[0] == 'U' || msg->data[0] == 'E') {
       if (auto it = io_ops.find(msg->as<Event>()->directory); it != io_ops.end()) {
-        it->second.events.push_back(std::move(msg));
+        if (msg->data[0] == 'E') {
+          remember_file_info(it->second, msg->as<EventStat>()->stat,
+                             msg->get_trailer<EventStat>());
+        }
+        it->second.events.feed_message(*msg);
+        if (msg->as<Event>()->action != uint32_t(-1)) {
+          ++it->second.queued;
+        }
+        affected.push_back(it);
+      }
+    } else if (msg->data[0] == 'P') {
+      auto progress = msg->as<WatchProgress>();
+      if (auto it = io_ops.find(progress->directory); it != io_ops.end()) {
+        it->second.status.watched = progress->watched;
+        it->second.status.queued = progress->queued;
+      }
+    } else if (msg->data[0] == 'R') {
+      if (auto it = io_ops.find(msg->as<WatchReady>()->directory); it != io_ops.end()) {
+        auto &status = it->second.status;
+        status.is_ready = true;
+        status.queued = 0;
+        status.ready_ms = GetTickCount64() - it->second.started_at;
+      }
+    } else if (msg->data[0] == 'M') {
+      if (auto it = io_ops.find(msg->as<MountSkipped>()->directory); it != io_ops.end()) {
+        auto path = msg->get_trailer<MountSkipped>();
+        auto mount = converter.from_bytes(path.data(), path.data() + path.size());
+        std::replace(mount.begin(), mount.end(), L'/', L'\\');
+        it->second.skipped_mounts.push_back(std::move(mount));
+      }
+    } else if (msg->data[0] == 'l') {
+      deliver_listing(*msg);
+    } else if (msg->data[0] == 'h') {
+      deliver_digests(*msg);
+    } else if (msg->data[0] == 'O') {
+      if (auto it = io_ops.find(msg->as<SubtreeDirty>()->directory); it != io_ops.end()) {
+        // The rescan covers whatever was still waiting for a buffer.
+        it->second.drop_events();
+        it->second.is_dirty = true;
         affected.push_back(it);
       }
     }
@@ -173,7 +534,7 @@ void stdout_cb(DWORD dwErrorCode, DWORD dwNumberOfBytesTransfered, LPOVERLAPPED
     op->second.flush();
   }
 
-  ReadFileEx(notifier->out_read, &notifier->input, STDOUT_BUFF, &notifier->out_ov, stdout_cb);
+  read_output(notifier);
 }
 
 void check_process(ForeignNotifier &notifier) {
@@ -193,20 +554,64 @@ void process_cb(void *raw_notifier, unsigned char) {
   check_process(*(ForeignNotifier *) raw_notifier);
 }
 
+// Rules in the format of DirectoryExcludeRequest, empty if there are none.
+std::string get_exclude_rules() {
+  DWORD len = GetEnvironmentVariableA(EXCLUDE_RULES_ENV, nullptr, 0);
+  if (len == 0) {
+    return {};
+  }
+  std::string rules(len, '\0');
+  len = GetEnvironmentVariableA(EXCLUDE_RULES_ENV, rules.data(), len);
+  rules.resize(len);
+  std::replace(rules.begin(), rules.end(), ';', '\n');
+  return rules;
+}
+
+// Appends `option` with the value of `env`, if that is a number.
+void append_ms_option(std::wstring &command, const char *env, const wchar_t *option) {
+  char ms[16];
+  DWORD len = GetEnvironmentVariableA(env, ms, sizeof(ms));
+  bool is_number = len && len < sizeof(ms) &&
+                   std::all_of(ms, ms + len, [](char c) { return c >= '0' && c <= '9'; });
+  if (is_number) {
+    command += option;
+    command.append(ms, ms + len);
+  }
+}
+
+// The daemon's command line, with options taken from the environment.
+std::wstring get_wsl_command() {
+  std::wstring command = WSL_COMMAND;
+  append_ms_option(command, COALESCE_MS_ENV, L" --coalesce-ms=");
+  append_ms_option(command, SETTLE_MS_ENV, L" --settle-ms=");
+  char flag[2];
+  if (GetEnvironmentVariableA(SKIP_UNCHANGED_ENV, flag, sizeof(flag)) == 1 && flag[0] == '1') {
+    command += L" --skip-unchanged";
+  }
+  if (GetEnvironmentVariableA(SHARED_ENV, flag, sizeof(flag)) == 1 && flag[0] == '1') {
+    command += L" --shared";
+  }
+  return command;
+}
+
+using ReadDirectoryChangesExW_t = BOOL(WINAPI *)(HANDLE, LPVOID, DWORD, BOOL, DWORD, LPDWORD,
+                                                 LPOVERLAPPED, LPOVERLAPPED_COMPLETION_ROUTINE,
+                                                 int);
+
 auto ReadDirectoryChangesW_true = ReadDirectoryChangesW;
+// Only there since Windows 10 1709.
+auto ReadDirectoryChangesExW_true = (ReadDirectoryChangesExW_t) (void *) GetProcAddress(
+    GetModuleHandleW(L"kernel32.dll"), "ReadDirectoryChangesExW");
 auto CancelIo_true = CancelIo;
 
-BOOL WINAPI ReadDirectoryChangesW_detour(HANDLE hDirectory, LPVOID lpBuffer, DWORD nBufferLength,
-                                         BOOL bWatchSubtree, DWORD dwNotifyFilter,
-                                         LPDWORD lpBytesReturned, LPOVERLAPPED lpOverlapped,
-                                         LPOVERLAPPED_COMPLETION_ROUTINE lpCompletionRoutine) {
-  std::wstring path = get_path_by_handle(hDirectory);
-  if (!path.starts_with(LR"(\\?\UNC\wsl$\)")) {
-    return ReadDirectoryChangesW_true(hDirectory, lpBuffer, nBufferLength, bWatchSubtree,
-                                      dwNotifyFilter, lpBytesReturned, lpOverlapped,
-                                      lpCompletionRoutine);
-  }
+bool is_wsl_path(const std::wstring &path) {
+  return path.starts_with(LR"(\\?\UNC\wsl$\)");
+}
 
+// The part of ReadDirectoryChangesW and ReadDirectoryChangesExW for `path` on \\wsl$.
+BOOL watch_directory(HANDLE hDirectory, std::wstring path, LPVOID lpBuffer, DWORD nBufferLength,
+                     BOOL bWatchSubtree, DWORD dwNotifyFilter, LPOVERLAPPED lpOverlapped,
+                     LPOVERLAPPED_COMPLETION_ROUTINE lpCompletionRoutine, bool is_extended) {
   ERR_IF(lpCompletionRoutine == nullptr, ERROR_INVALID_FUNCTION);
 
   auto sep = path.find(L'\\', 13);
@@ -233,8 +638,8 @@ BOOL WINAPI ReadDirectoryChangesW_detour(HANDLE hDirectory, LPVOID lpBuffer, DWO
     ERR_IF(!MyCreatePipeEx(&stdin_read.h, &stdin_write.h, &sa_attrs, 0, 0, 0) ||
                !MyCreatePipeEx(&stdout_read.h, &stdout_write.h, &sa_attrs, 0, FILE_FLAG_OVERLAPPED,
                                0) ||
-               WslLaunch(distro.c_str(), WSL_COMMAND, false, stdin_read, stdout_write,
-                         GetStdHandle(STD_OUTPUT_HANDLE), &process.h) != S_OK,
+               WslLaunch(distro.c_str(), get_wsl_command().c_str(), false, stdin_read,
+                         stdout_write, GetStdHandle(STD_OUTPUT_HANDLE), &process.h) != S_OK,
            ERROR_WSL_START_FAILED);
 
     auto notifier = std::make_shared<ForeignNotifier>(stdin_read, stdin_write, stdout_read,
@@ -247,14 +652,20 @@ BOOL WINAPI ReadDirectoryChangesW_detour(HANDLE hDirectory, LPVOID lpBuffer, DWO
 
     HelloRequest client_hello;
     memcpy(client_hello.data, CLIENT_HELLO, HELLO_LENGTH);
-    ERR_IF(!Message::from(client_hello)->write_to(notifier->in_write), ERROR_HANDSHAKE_FAILED);
+    client_hello.capabilities =
+        CAP_WATCH_PROGRESS | CAP_EXCLUDE_RULES | CAP_MOUNT_SKIPPED | CAP_SUBTREE_DIRTY |
+        CAP_EVENT_STAT | CAP_DIRECTORY_LIST | CAP_FILE_DIGEST | CAP_SETTLE_WRITES |
+        CAP_EVENT_CREDITS;
+    ERR_IF(!write_message(notifier->in_write, client_hello), ERROR_HANDSHAKE_FAILED);
 
     auto server_hello = notifier->in_stream.pull_message();
-    ERR_IF(!server_hello || !(*server_hello)->as<HelloRequest>()->is_eq(SERVER_HELLO),
-           ERROR_HANDSHAKE_FAILED);
+    ERR_IF(!server_hello, ERROR_HANDSHAKE_FAILED);
+    auto hello = server_hello->read<HelloRequest>();
+    ERR_IF(!hello.is_eq(SERVER_HELLO), ERROR_HANDSHAKE_FAILED);
+    notifier->capabilities = hello.capabilities & client_hello.capabilities;
 
     notifier->out_ov.hEvent = notifier.get();
-    ReadFileEx(notifier->out_read, &notifier->input, STDOUT_BUFF, &notifier->out_ov, stdout_cb);
+    read_output(notifier.get());
     it = notifiers.insert({distro.c_str(), notifier}).first;
   }
 
@@ -265,17 +676,47 @@ BOOL WINAPI ReadDirectoryChangesW_detour(HANDLE hDirectory, LPVOID lpBuffer, DWO
     op.buffer_length = nBufferLength;
     op.overlapped = lpOverlapped;
     op.overlapped_completion = lpCompletionRoutine;
+    op.is_extended = is_extended;
     return true;
   }
 
   io_ops[hDirectory] = {
+      .directory = hDirectory,
       .notify_in = it->second->in_write,
       .events = {},
       .buffer = lpBuffer,
       .buffer_length = nBufferLength,
       .overlapped = lpOverlapped,
       .overlapped_completion = lpCompletionRoutine,
+      .is_extended = is_extended,
+      .status = {.is_supported = (it->second->capabilities & CAP_WATCH_PROGRESS) != 0},
+      .started_at = GetTickCount64(),
+      .capabilities = it->second->capabilities,
   };
+
+  if (it->second->capabilities & CAP_EXCLUDE_RULES) {
+    auto rules = get_exclude_rules();
+    DirectoryExcludeRequest exclude_req = {
+        .msg_type = 'X',
+        .directory = hDirectory,
+    };
+    if (rules.size() && !write_message(it->second->in_write, exclude_req, rules)) {
+      return false;
+    }
+  }
+
+  if (auto node = settle_times.extract(hDirectory);
+      node && (it->second->capabilities & CAP_SETTLE_WRITES)) {
+    DirectorySettleRequest settle_req = {
+        .msg_type = 'W',
+        .directory = hDirectory,
+        .settle_ms = node.mapped(),
+    };
+    if (!write_message(it->second->in_write, settle_req)) {
+      return false;
+    }
+  }
+
   DirectoryWatchRequest req = {
       .msg_type = 'D',
       .directory = hDirectory,
@@ -283,7 +724,38 @@ BOOL WINAPI ReadDirectoryChangesW_detour(HANDLE hDirectory, LPVOID lpBuffer, DWO
       .recursive = (bool) bWatchSubtree,
   };
   auto mbpath = converter.to_bytes(path);
-  return Message::from(req, mbpath.data(), mbpath.size())->write_to(it->second->in_write);
+  return write_message(it->second->in_write, req, mbpath);
+}
+
+BOOL WINAPI ReadDirectoryChangesW_detour(HANDLE hDirectory, LPVOID lpBuffer, DWORD nBufferLength,
+                                         BOOL bWatchSubtree, DWORD dwNotifyFilter,
+                                         LPDWORD lpBytesReturned, LPOVERLAPPED lpOverlapped,
+                                         LPOVERLAPPED_COMPLETION_ROUTINE lpCompletionRoutine) {
+  std::wstring path = get_path_by_handle(hDirectory);
+  if (!is_wsl_path(path)) {
+    return ReadDirectoryChangesW_true(hDirectory, lpBuffer, nBufferLength, bWatchSubtree,
+                                      dwNotifyFilter, lpBytesReturned, lpOverlapped,
+                                      lpCompletionRoutine);
+  }
+  return watch_directory(hDirectory, std::move(path), lpBuffer, nBufferLength, bWatchSubtree,
+                         dwNotifyFilter, lpOverlapped, lpCompletionRoutine, false);
+}
+
+BOOL WINAPI ReadDirectoryChangesExW_detour(HANDLE hDirectory, LPVOID lpBuffer,
+                                           DWORD nBufferLength, BOOL bWatchSubtree,
+                                           DWORD dwNotifyFilter, LPDWORD lpBytesReturned,
+                                           LPOVERLAPPED lpOverlapped,
+                                           LPOVERLAPPED_COMPLETION_ROUTINE lpCompletionRoutine,
+                                           int ReadDirectoryNotifyInformationClass) {
+  std::wstring path = get_path_by_handle(hDirectory);
+  if (!is_wsl_path(path)) {
+    return ReadDirectoryChangesExW_true(hDirectory, lpBuffer, nBufferLength, bWatchSubtree,
+                                        dwNotifyFilter, lpBytesReturned, lpOverlapped,
+                                        lpCompletionRoutine, ReadDirectoryNotifyInformationClass);
+  }
+  return watch_directory(hDirectory, std::move(path), lpBuffer, nBufferLength, bWatchSubtree,
+                         dwNotifyFilter, lpOverlapped, lpCompletionRoutine,
+                         ReadDirectoryNotifyInformationClass == NOTIFY_EXTENDED_INFORMATION);
 }
 
 BOOL WINAPI CancelIo_detour(HANDLE hFile) {
@@ -298,12 +770,150 @@ BOOL WINAPI CancelIo_detour(HANDLE hFile) {
         .msg_type = 'S',
         .directory = hFile,
     };
-    Message::from(req)->write_to(op.notify_in);
+    write_message(op.notify_in, req);
     io_ops.erase(it);
+
+    for (auto listing = listings.begin(); listing != listings.end();) {
+      if (listing->second.directory == hFile) {
+        auto [directory, with_info, callback, context] = listing->second;
+        listing = listings.erase(listing);
+        callback(context, ERROR_OPERATION_ABORTED, nullptr, 0, true);
+      } else {
+        ++listing;
+      }
+    }
+    for (auto request = digest_requests.begin(); request != digest_requests.end();) {
+      if (request->second.directory == hFile) {
+        auto [directory, callback, context] = request->second;
+        request = digest_requests.erase(request);
+        callback(context, ERROR_OPERATION_ABORTED, nullptr, 0);
+      } else {
+        ++request;
+      }
+    }
   }
   return CancelIo_true(hFile);
 }
 
+// Lets tooling find out when a watch started with ReadDirectoryChangesW covers the whole tree.
+extern "C" __declspec(dllexport) BOOL WINAPI WslFsNotifyGetWatchStatus(HANDLE hDirectory,
+                                                                      WatchStatus *status) {
+  auto it = io_ops.find(hDirectory);
+  ERR_IF(it == io_ops.end(), ERROR_INVALID_HANDLE);
+  *status = it->second.status;
+  return true;
+}
+
+// Looks up the metadata that came with the last event for `lpFileName`, relative to the watched
+// directory, to spare a round trip to the file. Fails with ERROR_FILE_NOT_FOUND if there is none.
+extern "C" __declspec(dllexport) BOOL WINAPI WslFsNotifyGetFileInfo(HANDLE hDirectory,
+                                                                  LPCWSTR lpFileName,
+                                                                  FileInfo *info) {
+  auto it = io_ops.find(hDirectory);
+  ERR_IF(it == io_ops.end(), ERROR_INVALID_HANDLE);
+  auto file = it->second.file_info.find(lpFileName);
+  ERR_IF(file == it->second.file_info.end(), ERROR_FILE_NOT_FOUND);
+  *info = file->second;
+  return true;
+}
+
+// Lists `lpPath`, relative to the directory watched through `hDirectory`, from what the daemon
+// knows about it where possible. The entries are passed to `callback`, with their size, times
+// and the like if `bWithInfo` is set.
+extern "C" __declspec(dllexport) BOOL WINAPI
+WslFsNotifyListDirectory(HANDLE hDirectory, LPCWSTR lpPath, BOOL bWithInfo,
+                         ListDirectoryCallback callback, void *context) {
+  auto it = io_ops.find(hDirectory);
+  ERR_IF(it == io_ops.end(), ERROR_INVALID_HANDLE);
+  ERR_IF(!(it->second.capabilities & CAP_DIRECTORY_LIST), ERROR_NOT_SUPPORTED);
+
+  auto path = converter.to_bytes(lpPath);
+  std::replace(path.begin(), path.end(), '\\', '/');
+  while (path.ends_with('/')) {
+    path.pop_back();
+  }
+  DirectoryListRequest req = {
+      .msg_type = 'L',
+      .directory = hDirectory,
+      .id = next_request_id++,
+      .with_stat = (bool) bWithInfo,
+  };
+  if (!write_message(it->second.notify_in, req, path)) {
+    return false;
+  }
+  listings[req.id] = {
+      .directory = hDirectory,
+      .with_info = (bool) bWithInfo,
+      .callback = callback,
+      .context = context,
+  };
+  return true;
+}
+
+// Makes the watch of `hDirectory` report a file that is written to once it is closed, or
+// `dwMilliseconds` after the first write if it stays open, rather than every write. 0 reports
+// every write. Has to be called before the first ReadDirectoryChangesW on the handle.
+extern "C" __declspec(dllexport) BOOL WINAPI WslFsNotifySetSettleTime(HANDLE hDirectory,
+                                                                     DWORD dwMilliseconds) {
+  ERR_IF(io_ops.count(hDirectory), ERROR_INVALID_STATE);
+  settle_times[hDirectory] = dwMilliseconds;
+  return true;
+}
+
+// Gets digests of the contents of `nCount` files at `lpPaths`, relative to the directory watched
+// through `hDirectory`, to tell whether they changed without reading them. They are passed to
+// `callback` all at once.
+extern "C" __declspec(dllexport) BOOL WINAPI
+WslFsNotifyGetFileDigests(HANDLE hDirectory, const LPCWSTR *lpPaths, DWORD nCount,
+                          FileDigestCallback callback, void *context) {
+  auto it = io_ops.find(hDirectory);
+  ERR_IF(it == io_ops.end(), ERROR_INVALID_HANDLE);
+  ERR_IF(!(it->second.capabilities & CAP_FILE_DIGEST), ERROR_NOT_SUPPORTED);
+
+  std::string paths;
+  for (DWORD i = 0; i < nCount; i++) {
+    auto path = converter.to_bytes(lpPaths[i]);
+    std::replace(path.begin(), path.end(), '\\', '/');
+    paths += path;
+    paths += '\0';
+  }
+  FileDigestRequest req = {
+      .msg_type = 'H',
+      .directory = hDirectory,
+      .id = next_request_id++,
+  };
+  if (!write_message(it->second.notify_in, req, paths)) {
+    return false;
+  }
+  digest_requests[req.id] = {
+      .directory = hDirectory,
+      .callback = callback,
+      .context = context,
+  };
+  return true;
+}
+
+// Lists the mounts that the watch of `hDirectory` does not descend into, relative to the
+// directory. Each one is terminated by '\0' and the list by another '\0', `*lpLength` is set to
+// the number of characters that takes.
+extern "C" __declspec(dllexport) BOOL WINAPI WslFsNotifyGetSkippedMounts(HANDLE hDirectory,
+                                                                       LPWSTR lpBuffer,
+                                                                       DWORD nBufferLength,
+                                                                       LPDWORD lpLength) {
+  auto it = io_ops.find(hDirectory);
+  ERR_IF(it == io_ops.end(), ERROR_INVALID_HANDLE);
+  std::wstring list;
+  for (const auto &mount : it->second.skipped_mounts) {
+    list += mount;
+    list += L'\0';
+  }
+  list += L'\0';
+  *lpLength = (DWORD) list.size();
+  ERR_IF(list.size() > nBufferLength, ERROR_INSUFFICIENT_BUFFER);
+  std::copy(list.begin(), list.end(), lpBuffer);
+  return true;
+}
+
 BOOL WINAPI DllMain([[maybe_unused]] HINSTANCE hinst, [[maybe_unused]] DWORD dwReason,
                     [[maybe_unused]] LPVOID reserved) {
   if (DetourIsHelperProcess()) {
@@ -316,6 +926,10 @@ BOOL WINAPI DllMain([[maybe_unused]] HINSTANCE hinst, [[maybe_unused]] DWORD dwR
     DetourUpdateThread(GetCurrentThread());
 
     DetourAttach(&(void *&) ReadDirectoryChangesW_true, (void *) ReadDirectoryChangesW_detour);
+    if (ReadDirectoryChangesExW_true) {
+      DetourAttach(&(void *&) ReadDirectoryChangesExW_true,
+                   (void *) ReadDirectoryChangesExW_detour);
+    }
     DetourAttach(&(void *&) CancelIo_true, (void *) CancelIo_detour);
 
     DetourTransactionCommit();
@@ -330,6 +944,10 @@ BOOL WINAPI DllMain([[maybe_unused]] HINSTANCE hinst, [[maybe_unused]] DWORD dwR
     DetourUpdateThread(GetCurrentThread());
 
     DetourDetach(&(void *&) ReadDirectoryChangesW_true, (void *) ReadDirectoryChangesW_detour);
+    if (ReadDirectoryChangesExW_true) {
+      DetourDetach(&(void *&) ReadDirectoryChangesExW_true,
+                   (void *) ReadDirectoryChangesExW_detour);
+    }
     DetourDetach(&(void *&) CancelIo_true, (void *) CancelIo_detour);
 
     DetourTransactionCommit();
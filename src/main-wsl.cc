@@ -1,445 +1,306 @@
-#include <dirent.h>
 #include <ev.h>
-#include <linux/limits.h>
-#include <sys/inotify.h>
+#include <getopt.h>
+#include <signal.h>
 #include <unistd.h>
 
-#include <cassert>
+#include <algorithm>
+#include <cerrno>
 #include <cstdio>
+#include <cstdlib>
 #include <cstring>
-#include <deque>
-#include <filesystem>
-#include <iostream>
-#include <map>
-#include <ranges>
-#include <set>
 #include <string>
 #include <string_view>
-#include <vector>
+#include <thread>
 
+#include "client.h"
 #include "config.h"
-#include "message.h"
-
-const uint32_t INOTIFY_EVENTS =
-    IN_CREATE | IN_DELETE | IN_DELETE_SELF | IN_MODIFY | IN_MOVE | IN_MOVE_SELF;
-const uint32_t INOTIFY_FLAGS = IN_DONT_FOLLOW | IN_ONLYDIR | IN_MASK_CREATE | IN_EXCL_UNLINK;
+#include "crawler.h"
+#include "fanotify-watcher.h"
+#include "inotify-watcher.h"
+#include "shared-daemon.h"
+#include "watcher.h"
 
 struct ev_loop *loop = EV_DEFAULT;
 
-PullableMessageStream in_stream;
-
-struct Directory;
-using PDirectory = std::shared_ptr<Directory>;
-using WDirectory = std::weak_ptr<Directory>;
-
-struct Watcher;
-using PWatcher = std::shared_ptr<Watcher>;
-using WWatcher = std::weak_ptr<Watcher>;
-
-struct Watcher {
-  ev_io ev_watcher;
-  int fd;
-  std::string path;
-  void *directory;
-  uint32_t filter;
-  bool recursive;
-  bool is_failed = false;
-
-  std::map<int, WDirectory> by_wd;
-  std::deque<WDirectory> unprocessed;
-  PDirectory root;
-
-  Watcher(int fd_, std::string_view path_, void *directory_, uint32_t filter_, bool recursive_)
-      : fd(fd_), path(path_), directory(directory_), filter(filter_), recursive(recursive_) {}
-
-  ~Watcher() {
-    root.reset();
-    if (fd != -1) {
-      close(fd);
-      ev_io_stop(loop, &ev_watcher);
+bool cross_mounts = false;
+ev_tstamp coalesce_window = 0;
+uint32_t storm_dir_events = 1000;
+uint32_t storm_watch_events = 10000;
+ev_tstamp storm_window = 1;
+bool skip_unchanged = false;
+ev_tstamp settle_window = 0;
+
+// Crawling is split into slices so that a huge tree does not hold up events of other watchers
+// or requests from the client.
+const ev_tstamp CRAWL_SLICE = 0.005;
+// Directory listings handled between two checks of the slice deadline.
+const size_t CRAWL_BATCH = 64;
+// Backlogged inotify events are handled in slices of their own before each crawl slice, fanotify
+// events in one slice per wakeup.
+const ev_tstamp EVENT_SLICE = 0.005;
+
+ev_idle crawl_idle;
+ev_check crawl_check;
+
+bool has_crawl_work() {
+  for (auto watcher : watchers) {
+    if (watcher->has_work()) {
+      return true;
     }
   }
+  return crawler.has_results() || inotify.has_backlog();
+}
 
-  void send_event(FileAction action, std::string_view filename = "") {
-    if (is_failed) {
-      return;
-    }
-    if (action == FILE_ACTION_FAILED) {
-      is_failed = true;
-    }
-    Message::from(
-        Event{
-            .directory = directory,
-            .action = action,
-        },
-        filename.data(), filename.size())
-        ->write_to(STDOUT_FILENO);
-  }
-
-  void fail() {
-    send_event(FILE_ACTION_FAILED);
-  }
-
-  void add_to_queue(PDirectory dir);
-  void process_queue();
-  void process_events(int move_cookie);
-};
-
-struct Directory {
-  int wd;
-  std::string name;
-  WDirectory parent;
-  WWatcher watcher;
-  std::vector<PDirectory> subdirs;
-  int fail_cnt = 0, move_cookie = 0;
-  bool tree_deleted = false, already_added = false, in_queue = false;
-
-  ~Directory() {
-    if (!watcher.expired()) {
-      destruct_tree(watcher.lock().get());
-    }
-  }
-
-  void destruct_tree(Watcher *w) {
-    if (wd == -1) {
-      return;
-    }
-    mark_as_deleted();
-    w->by_wd.erase(wd);
-    inotify_rm_watch(w->fd, wd);
-    for (auto subdir : subdirs) {
-      subdir->destruct_tree(w);
-    }
-    wd = -1;
+void crawl_check_cb(EV_P_ ev_check *, int) {
+  if (inotify.has_backlog()) {
+    inotify.process_backlog(ev_time() + EVENT_SLICE);
   }
-
-  void mark_as_deleted() {
-    if (!tree_deleted) {
-      tree_deleted = true;
-      for (auto subdir : subdirs) {
-        subdir->mark_as_deleted();
+  auto deadline = ev_time() + CRAWL_SLICE;
+  do {
+    for (auto watcher : watchers) {
+      if (watcher->has_work()) {
+        watcher->process_queue();
       }
     }
-  }
-
-  std::string get_path() {
-    if (parent.expired()) {
-      return watcher.lock()->path + "/";
-    } else {
-      return parent.lock()->get_path() + name + "/";
+    auto results = crawler.take_results(CRAWL_BATCH);
+    bool is_drained = results.empty();
+    send_listings(results);
+    // Listings that waited for the backlog may go on now.
+    process_crawl_results(results);
+    if (is_drained) {
+      break;
     }
-  }
+  } while (ev_time() < deadline);
 
-  std::string get_rel_path() {
-    if (parent.expired()) {
-      return "";
-    } else {
-      return parent.lock()->get_rel_path() + name + "/";
-    }
+  for (auto watcher : watchers) {
+    watcher->report_progress();
   }
-};
+  schedule_crawl();
+}
 
-void Watcher::add_to_queue(PDirectory dir) {
-  if (!dir->in_queue) {
-    dir->in_queue = true;
-    unprocessed.push_back(dir);
+// Check watchers run before the I/O callbacks of the same loop iteration, so whoever creates
+// crawl work has to call this to keep the loop from blocking before the next slice.
+void schedule_crawl() {
+  if (has_crawl_work()) {
+    ev_idle_start(loop, &crawl_idle);
+  } else {
+    ev_idle_stop(loop, &crawl_idle);
   }
 }
 
-void Watcher::process_events(int move_cookie) {
-  struct hl_inotify_event {
-    int wd;
-    decltype(by_wd)::iterator dir_it;
-    PDirectory dir;
-    uint32_t mask;
-    std::string path, filename;
-  };
+void crawl_idle_cb(EV_P_ ev_idle *, int) {}
 
-  std::map<uint32_t, hl_inotify_event> tinder;
+void crawler_cb(EV_P_ ev_async *, int) {
+  schedule_crawl();
+}
 
-  auto process_add = [&](const hl_inotify_event &e) {
-    if (!(e.mask & IN_ISDIR)) {
-      return;
-    }
-    std::string abs_path = e.path + e.filename;
-    int wd = inotify_add_watch(fd, abs_path.data(), INOTIFY_EVENTS | INOTIFY_FLAGS);
-    if (wd == -1) {
-      if (errno == EEXIST || errno == ENOTDIR || errno == ENOENT) {
-        add_to_queue(e.dir);
-      } else {
-        fail();
-      }
-    } else {
-      auto curr = std::make_shared<Directory>(wd, e.filename, e.dir, e.dir->watcher);
-      e.dir->subdirs.push_back(curr);
-      add_to_queue(curr);
-    }
-  };
+void notify_cb(EV_P_ ev_io *, int) {
+  inotify.read_events();
+  schedule_crawl();
+}
 
-  auto process_delete = [&](const hl_inotify_event &e) {
-    if (!(e.mask & IN_ISDIR)) {
-      return;
-    }
-    auto curr =
-        std::ranges::find(e.dir->subdirs, e.filename, [](const auto &x) { return x->name; });
-    if (curr != e.dir->subdirs.end()) {
-      (*curr)->mark_as_deleted();
-      e.dir->subdirs.erase(curr);
-    }
-  };
+void fanotify_cb(EV_P_ ev_io *, int) {
+  fanotify.process_events(ev_time() + EVENT_SLICE);
+}
 
-  auto process_move = [&](const hl_inotify_event &from, const hl_inotify_event &to) {
-    if (!(from.mask & IN_ISDIR)) {
-      return;
+// `kill -USR1` dumps what every watch costs to stderr.
+void stats_cb(EV_P_ ev_signal *, int) {
+  if (shared_daemon.is_listening()) {
+    fprintf(stderr, "%zu clients\n", clients.size());
+  }
+  for (auto watcher : watchers) {
+    auto dirs = watcher->get_watched_cnt();
+    auto bytes = watcher->get_memory_usage();
+    fprintf(stderr, "%s: %llu directories, %zu bytes, %.1f bytes per directory, %zu subscribers\n",
+            watcher->path.c_str(), (unsigned long long) dirs, bytes,
+            dirs ? (double) bytes / (double) dirs : 0.0, watcher->subscribers.size());
+    if (coalesce_window > 0) {
+      fprintf(stderr, "%s: %llu of %llu events coalesced away\n", watcher->path.c_str(),
+              (unsigned long long) watcher->coalescer.dropped_cnt,
+              (unsigned long long) watcher->coalescer.added_cnt);
     }
-    auto curr =
-        std::ranges::find(from.dir->subdirs, from.filename, [](const auto &x) { return x->name; });
-    if (curr != from.dir->subdirs.end()) {
-      auto moved_dir = *curr;
-      from.dir->subdirs.erase(curr);
-
-      to.dir->subdirs.push_back(moved_dir);
-      moved_dir->parent = to.dir;
-      moved_dir->name = to.filename;
+    if (watcher->storms.is_enabled()) {
+      fprintf(stderr,
+              "%s: %llu storms (over %u events per directory or %u per watch in %.0f ms), "
+              "%llu events suppressed\n",
+              watcher->path.c_str(), (unsigned long long) watcher->storms.storm_cnt,
+              watcher->storms.dir_limit, watcher->storms.watch_limit, storm_window * 1000,
+              (unsigned long long) watcher->storms.suppressed_cnt);
     }
-  };
-
-  auto process_event = [&](const inotify_event &raw) {
-    auto dir_it = by_wd.find(raw.wd);
-    if (dir_it == by_wd.end()) {
-      return;
+    uint64_t overdrawn_cnt = 0;
+    for (const auto &subscriber : watcher->subscribers) {
+      overdrawn_cnt += subscriber.overdrawn_cnt;
     }
-    if (dir_it->second.expired()) {
-      by_wd.erase(dir_it);
-      return;
+    if (overdrawn_cnt) {
+      fprintf(stderr, "%s: %llu events dropped for lack of credits\n", watcher->path.c_str(),
+              (unsigned long long) overdrawn_cnt);
     }
-    auto dir = dir_it->second.lock();
-
-    hl_inotify_event e{
-        .wd = raw.wd,
-        .dir_it = dir_it,
-        .dir = dir,
-        .mask = raw.mask,
-        .path = dir->get_path(),
-        .filename = std::string{raw.name},
-    };
-
-    auto rel_path = dir->get_rel_path();
-
-    if ((e.mask & IN_MOVE_SELF) || (e.mask & IN_DELETE_SELF)) {
-      if (e.wd == root->wd) {
-        fail();
-      } else {
-        e.dir->move_cookie = move_cookie;
-      }
+    if (watcher->writes.write_cnt) {
+      fprintf(stderr, "%s: %llu writes reported as %llu modifications\n", watcher->path.c_str(),
+              (unsigned long long) watcher->writes.write_cnt,
+              (unsigned long long) watcher->writes.reported_cnt);
     }
-
-    if ((e.mask & IN_IGNORED) || (e.mask & IN_UNMOUNT)) {
-      if (e.wd == root->wd) {
-        fail();
-      } else {
-        process_delete(e);
-      }
-      return;
+    auto &latency = watcher->latency;
+    if (latency.cnt) {
+      fprintf(stderr, "%s: %llu events, latency %.2f ms average, %.2f ms p99, %.2f ms max\n",
+              watcher->path.c_str(), (unsigned long long) latency.cnt,
+              latency.sum / (double) latency.cnt * 1000, latency.get_percentile(0.99) * 1000,
+              latency.max * 1000);
     }
-    if ((e.mask & IN_MODIFY) || (e.mask & IN_ATTRIB)) {
-      send_event(FILE_ACTION_MODIFIED, rel_path + e.filename);
-    } else if (e.mask & IN_MOVED_FROM) {
-      send_event(FILE_ACTION_REMOVED, rel_path + e.filename);
-      tinder[raw.cookie] = e;
-    } else if (e.mask & IN_MOVED_TO) {
-      send_event(FILE_ACTION_ADDED, rel_path + e.filename);
-      auto match = tinder.find(raw.cookie);
-      if (match == tinder.end()) {
-        process_add(e);
-      } else {
-        process_move(match->second, e);
-        tinder.erase(match);
-      }
-    } else if (e.mask & IN_CREATE) {
-      send_event(FILE_ACTION_ADDED, rel_path + e.filename);
-      process_add(e);
-    } else if (e.mask & IN_DELETE) {
-      send_event(FILE_ACTION_REMOVED, rel_path + e.filename);
-      process_delete(e);
-    }
-  };
-
-  static char buf[sizeof(inotify_event) + PATH_MAX + 1]
-      __attribute__((aligned(alignof(inotify_event))));
-
-  while (true) {
-    ssize_t len = read(fd, buf, sizeof(buf));
-    if (len <= 0) {
-      if (errno != EAGAIN && errno != EWOULDBLOCK) {
-        fail();
-      }
-      break;
-    }
-
-    const inotify_event *event = nullptr;
-
-    for (char *ptr = buf; ptr < buf + len; ptr += sizeof(inotify_event) + event->len) {
-      event = (const inotify_event *) ptr;
-      process_event(*event);
+    auto &digests = watcher->digests;
+    if (digests.hit_cnt || digests.miss_cnt) {
+      fprintf(stderr, "%s: %llu of %llu digests cached, %llu unchanged modifications\n",
+              watcher->path.c_str(), (unsigned long long) digests.hit_cnt,
+              (unsigned long long) (digests.hit_cnt + digests.miss_cnt),
+              (unsigned long long) digests.unchanged_cnt);
     }
   }
-
-  for (auto [cookie, event] : tinder) {
-    process_delete(event);
+  if (inotify.has_backlog()) {
+    fprintf(stderr, "%llu inotify events waiting to be handled\n",
+            (unsigned long long) inotify.backlog_cnt);
   }
 }
 
-void Watcher::process_queue() {
-  if (!recursive || is_failed) {
-    unprocessed.clear();
-    return;
-  }
-  while (unprocessed.size()) {
-    auto curr = unprocessed.front();
-    unprocessed.pop_front();
-
-    if (curr.expired()) {
-      continue;
-    }
-    auto dir = curr.lock();
-    auto dir_abs_path = dir->get_path();
-
-    by_wd[dir->wd] = curr;
-
-    std::vector<PDirectory> subdirs;
-    bool trustworthy = true;
-
-    for (auto entry : std::filesystem::directory_iterator{dir_abs_path}) {
-      if (!entry.is_directory() || entry.is_symlink()) {
-        continue;
-      }
-      std::string curr_path = entry.path().string();
-      int wd = inotify_add_watch(fd, curr_path.data(), INOTIFY_EVENTS | INOTIFY_FLAGS);
-      if (wd == -1) {
-        if (errno == EEXIST || errno == ENOTDIR || errno == ENOENT) {
-          trustworthy = (dir->already_added && errno == EEXIST);
-          if (!trustworthy) {
-            break;
-          }
-        } else {
-          fail();
-          return;
-        }
-      } else {
-        auto subdir =
-            std::make_shared<Directory>(wd, entry.path().filename().string(), dir, dir->watcher);
-        subdirs.push_back(subdir);
-      }
-    }
-    dir->subdirs = std::move(subdirs);
-
-    static int move_cookie = 1;
-
-    process_events(move_cookie);
-    if (dir->tree_deleted) {
-      continue;
-    }
-
-    auto ptr = curr;
-    while (!ptr.expired()) {
-      auto cdir = ptr.lock();
-      if (cdir->move_cookie == move_cookie) {
-        trustworthy = false;
-      }
-      ptr = cdir->parent;
-    }
-    ++move_cookie;
-
-    if (trustworthy) {
-      dir->in_queue = false;
-      dir->already_added = true;
-      for (auto subdir : dir->subdirs) {
-        add_to_queue(subdir);
-      }
-    } else {
-      if (++dir->fail_cnt == DIR_FAIL_CNT) {
-        fail();
-        return;
-      }
-      unprocessed.push_back(curr);
-    }
+void close_client(Client *client) {
+  std::erase_if(clients, [&](const PClient &other) { return other.get() == client; });
+  if (!shared_daemon.is_listening()) {
+    ev_break(loop, EVBREAK_ALL);
+  } else if (clients.empty()) {
+    shared_daemon.wait_idle();
   }
 }
 
-std::map<void *, PWatcher> watchers;
-
-void notify_cb(EV_P_ ev_io *w, int) {
-  auto watcher = reinterpret_cast<Watcher *>(w);
-  watcher->process_events(0);
-  watcher->process_queue();
+void usage(const char *argv0) {
+  fprintf(stderr,
+          "Usage: %s [--backend=fanotify|inotify] [--crawl-threads=N] [--cross-mounts]\n"
+          "          [--coalesce-ms=N] [--storm-dir-events=N] [--storm-watch-events=N]\n"
+          "          [--storm-window-ms=N] [--skip-unchanged] [--settle-ms=N]\n"
+          "          [--listen | --shared]\n"
+          "\n"
+          "  --backend=fanotify  watch whole filesystems where possible, falling back to\n"
+          "                      inotify (default)\n"
+          "  --backend=inotify   always use per-directory inotify watches\n"
+          "  --crawl-threads=N   list directories for inotify watches on N threads, 0 lists\n"
+          "                      them on the main thread (default: number of CPUs, at most 8)\n"
+          "  --cross-mounts      let recursive watches descend into other mounts, which are\n"
+          "                      skipped and reported to the client by default\n"
+          "  --coalesce-ms=N     hold events back for up to N ms to merge repeated changes of a\n"
+          "                      path (default: 0, send them right away)\n"
+          "  --storm-dir-events=N, --storm-watch-events=N\n"
+          "                      tell the client to rescan a directory that gets more than N\n"
+          "                      events in a storm window, or the whole tree if the watch does,\n"
+          "                      instead of sending them; 0 never does (default: 1000, 10000)\n"
+          "  --storm-window-ms=N length of a storm window (default: 1000)\n"
+          "  --skip-unchanged    drop modifications of files whose digest the client asked for\n"
+          "                      if their contents stayed the same\n"
+          "  --settle-ms=N       report writes once the file is closed, or after N ms if it stays\n"
+          "                      open (default: 0, report every write)\n"
+          "  --listen            serve clients on a Unix socket of the user instead of stdin and\n"
+          "                      stdout, and share watches of the same path and options between\n"
+          "                      them; exits once nobody was connected for a while\n"
+          "  --shared            relay stdin and stdout to the daemon listening with the same\n"
+          "                      options, starting it if there is none\n",
+          argv0);
 }
 
-void do_directory_watch(DirectoryWatchRequest *req, std::string_view path) {
-  int notify_fd = inotify_init1(IN_NONBLOCK);
-  auto watcher =
-      std::make_shared<Watcher>(notify_fd, path, req->directory, req->filter, req->recursive);
-
-  if (notify_fd != -1) {
-    ev_io_init(&watcher->ev_watcher, notify_cb, notify_fd, EV_READ);
-    ev_io_start(loop, &watcher->ev_watcher);
+int main(int argc, char **argv) {
+  bool use_fanotify = true;
+  bool listen = false, shared = false;
+  unsigned crawl_threads = std::clamp(std::thread::hardware_concurrency(), 1u, 8u);
+
+  const option long_options[] = {
+      {"backend", required_argument, nullptr, 'b'},
+      {"crawl-threads", required_argument, nullptr, 'c'},
+      {"cross-mounts", no_argument, nullptr, 'm'},
+      {"coalesce-ms", required_argument, nullptr, 'w'},
+      {"storm-dir-events", required_argument, nullptr, 'd'},
+      {"storm-watch-events", required_argument, nullptr, 'e'},
+      {"storm-window-ms", required_argument, nullptr, 's'},
+      {"skip-unchanged", no_argument, nullptr, 'u'},
+      {"settle-ms", required_argument, nullptr, 't'},
+      {"listen", no_argument, nullptr, 'l'},
+      {"shared", no_argument, nullptr, 'r'},
+      {"help", no_argument, nullptr, 'h'},
+      {nullptr, 0, nullptr, 0},
+  };
+  int opt;
+  while ((opt = getopt_long(argc, argv, "h", long_options, nullptr)) != -1) {
+    if (opt == 'b' && !strcmp(optarg, "fanotify")) {
+      use_fanotify = true;
+    } else if (opt == 'b' && !strcmp(optarg, "inotify")) {
+      use_fanotify = false;
+    } else if (opt == 'c') {
+      crawl_threads = (unsigned) atoi(optarg);
+    } else if (opt == 'm') {
+      cross_mounts = true;
+    } else if (opt == 'w') {
+      coalesce_window = atoi(optarg) / 1000.0;
+    } else if (opt == 'd') {
+      storm_dir_events = (uint32_t) atoi(optarg);
+    } else if (opt == 'e') {
+      storm_watch_events = (uint32_t) atoi(optarg);
+    } else if (opt == 's' && atoi(optarg) > 0) {
+      storm_window = atoi(optarg) / 1000.0;
+    } else if (opt == 'u') {
+      skip_unchanged = true;
+    } else if (opt == 't') {
+      settle_window = atoi(optarg) / 1000.0;
+    } else if (opt == 'l') {
+      listen = true;
+    } else if (opt == 'r') {
+      shared = true;
+    } else {
+      usage(argv[0]);
+      return opt == 'h' ? 0 : 1;
+    }
   }
 
-  int wd = inotify_add_watch(notify_fd, watcher->path.data(), INOTIFY_EVENTS | INOTIFY_FLAGS);
-  if (wd == -1) {
-    watcher->fail();
-    return;
+  // Daemons with different options must not share watches, so each set gets its own socket.
+  char options[256];
+  snprintf(options, sizeof(options), "b%d m%d w%g d%u e%u s%g u%d t%g", use_fanotify,
+           cross_mounts, coalesce_window, storm_dir_events, storm_watch_events, storm_window,
+           skip_unchanged, settle_window);
+  if (shared && !listen) {
+    return run_relay(get_socket_path(options), argv);
   }
 
-  auto root = std::make_shared<Directory>(wd, "", WDirectory{}, watcher);
-  watcher->root = root;
-  watcher->unprocessed.push_back(root);
-
-  watchers[req->directory] = watcher;
-  watcher->process_queue();
-}
-
-void do_directory_unwatch(DirectoryUnwatchRequest *req) {
-  watchers.erase(req->directory);
-}
-
-void stdin_cb(EV_P_ ev_io *w, int) {
-  const int BUFF = 4096;
-  static char buff[BUFF];
-
-  ssize_t buff_len = read(STDIN_FILENO, buff, BUFF);
-  if (buff_len <= 0) {
-    ev_io_stop(EV_A_ w);
-    ev_break(EV_A_ EVBREAK_ALL);
+  inotify.init();
+  if (use_fanotify) {
+    fanotify.init();
   }
-  in_stream.feed(buff, buff_len);
-
-  while (in_stream.has_message()) {
-    auto msg = *in_stream.get_message();
 
-    if (msg->data[0] == 'D') {
-      do_directory_watch(msg->as<DirectoryWatchRequest>(),
-                         msg->get_trailer<DirectoryWatchRequest>());
-    } else if (msg->data[0] == 'S') {
-      do_directory_unwatch(msg->as<DirectoryUnwatchRequest>());
+  if (listen) {
+    auto path = get_socket_path(options);
+    if (!shared_daemon.listen(path)) {
+      fprintf(stderr, "cannot listen on %s: %s\n", path.c_str(), strerror(errno));
+      return 1;
     }
+  } else {
+    clients.push_back(std::make_unique<Client>(STDIN_FILENO, STDOUT_FILENO));
   }
-}
 
-int main() {
-  in_stream.set_fd(STDIN_FILENO);
-
-  auto client_hello = in_stream.pull_message();
-  assert(client_hello);
-  assert((*client_hello)->as<HelloRequest>()->is_eq(CLIENT_HELLO));
+  if (inotify.fd != -1) {
+    ev_io_init(&inotify.ev_watcher, notify_cb, inotify.fd, EV_READ);
+    ev_io_start(loop, &inotify.ev_watcher);
+  }
+  if (fanotify.fd != -1) {
+    ev_io_init(&fanotify.ev_watcher, fanotify_cb, fanotify.fd, EV_READ);
+    ev_io_start(loop, &fanotify.ev_watcher);
+  }
 
-  HelloRequest req;
-  memcpy(req.data, SERVER_HELLO, HELLO_LENGTH);
-  Message::from(req)->write_to(STDOUT_FILENO);
+  ev_async_init(&crawler.ev_watcher, crawler_cb);
+  ev_async_start(loop, &crawler.ev_watcher);
+  crawler.start(loop, crawl_threads);
+  ev_idle_init(&crawl_idle, crawl_idle_cb);
+  ev_check_init(&crawl_check, crawl_check_cb);
+  ev_check_start(loop, &crawl_check);
 
-  ev_io stdin_watcher;
-  ev_io_init(&stdin_watcher, stdin_cb, STDIN_FILENO, EV_READ);
-  ev_io_start(loop, &stdin_watcher);
+  ev_signal stats_watcher;
+  ev_signal_init(&stats_watcher, stats_cb, SIGUSR1);
+  ev_signal_start(loop, &stats_watcher);
 
   ev_run(loop, 0);
+  // Drop clients first so the watches they hold are released while the watchers and inotify
+  // they refer to still exist.
+  clients.clear();
 }
@@ -7,6 +7,7 @@
 #include <cstring>
 #include <iostream>
 #include <memory>
+#include <string>
 
 #ifdef WIN32
 #  include <Windows.h>
@@ -32,52 +33,119 @@ PMessage Message::from(const char *body, uint64_t body_size, const char *trailin
   return msg;
 }
 
-void MessageStream::feed(const char *buff, size_t length) {
-  avail += length;
-  stream.sputn(buff, length);
+bool write_message(fd_t handle, const char *body, uint64_t body_size, std::string_view trailer) {
+  thread_local std::string buff;
+
+  uint64_t length = body_size + trailer.size();
+  buff.clear();
+  buff.append((const char *) &length, sizeof(length));
+  buff.append(body, body_size);
+  buff.append(trailer);
+  return write_exactly(handle, buff);
 }
 
-bool MessageStream::has_message() const {
-  if (next_length == NO_MESSAGE) {
-    if (avail < 8) {
-      return false;
+PMessage MessageView::to_owned() const {
+  return Message::from(data, length, nullptr, 0);
+}
+
+void MessageStream::copy_out(size_t offset, char *dst, size_t length) const {
+  size_t pos = (head + offset) & (capacity - 1);
+  size_t first = std::min(length, capacity - pos);
+  memcpy(dst, buff.get() + pos, first);
+  memcpy(dst + first, buff.get(), length - first);
+}
+
+uint64_t MessageStream::peek_length() const {
+  uint64_t length;
+  copy_out(0, (char *) &length, sizeof(length));
+  return length & LENGTH_MASK;
+}
+
+std::span<char> MessageStream::prepare(size_t length) {
+  if (capacity - size < length || !capacity) {
+    size_t new_capacity = std::max(capacity, INITIAL_CAPACITY);
+    while (new_capacity - size < length) {
+      new_capacity *= 2;
+    }
+    auto new_buff = std::make_unique<char[]>(new_capacity);
+    if (size) {
+      copy_out(0, new_buff.get(), size);
     }
-    stream.sgetn((char *) &next_length, 8);
-    avail -= 8;
-    next_length &= LENGTH_MASK;
+    buff = std::move(new_buff);
+    capacity = new_capacity;
+    head = 0;
   }
-  return avail >= next_length;
+
+  size_t tail = (head + size) & (capacity - 1);
+  if (tail < head || size == capacity) {
+    return {buff.get() + tail, head - tail};
+  }
+  return {buff.get() + tail, capacity - tail};
 }
 
-std::optional<PMessage> MessageStream::get_message() {
+void MessageStream::commit(size_t length) {
+  assert(size + length <= capacity);
+  size += length;
+}
+
+void MessageStream::feed(const char *data, size_t length) {
+  while (length) {
+    auto space = prepare(length);
+    size_t part = std::min(length, space.size());
+    memcpy(space.data(), data, part);
+    commit(part);
+    data += part;
+    length -= part;
+  }
+}
+
+bool MessageStream::has_message() const {
+  return size >= sizeof(uint64_t) && size - sizeof(uint64_t) >= peek_length();
+}
+
+void MessageStream::feed_message(const MessageView &msg) {
+  feed((const char *) &msg.length, sizeof(msg.length));
+  feed(msg.data, msg.length);
+}
+
+std::optional<MessageView> MessageStream::peek_message() {
   if (!has_message()) {
     return {};
   }
-  auto raw = (Message *) std::malloc(sizeof(Message) + next_length);
-  assert(raw != nullptr);
-  PMessage msg{raw};
-  msg->length = next_length;
-  stream.sgetn(msg->data, next_length);
-  avail -= next_length;
-  next_length = NO_MESSAGE;
-  return msg;
-}
+  auto length = peek_length();
+  size_t start = (head + sizeof(uint64_t)) & (capacity - 1);
+  if (start + length <= capacity) {
+    return MessageView{length, buff.get() + start};
+  }
 
-std::optional<PMessage> MessageStream::pull_message() {
-  if (has_message()) {
-    return get_message();
+  if (wrapped_capacity < length) {
+    wrapped = std::make_unique<char[]>(length);
+    wrapped_capacity = length;
   }
-  if (next_length == NO_MESSAGE) {
-    if (!pull(8 - avail)) {
-      return {};
-    }
-    assert(avail >= 8);
-    stream.sgetn((char *) &next_length, 8);
-    avail -= 8;
-    next_length &= LENGTH_MASK;
+  copy_out(sizeof(uint64_t), wrapped.get(), length);
+  return MessageView{length, wrapped.get()};
+}
+
+void MessageStream::skip_message() {
+  assert(has_message());
+  size_t length = sizeof(uint64_t) + peek_length();
+  size -= length;
+  head = size ? (head + length) & (capacity - 1) : 0;
+}
+
+std::optional<MessageView> MessageStream::get_message() {
+  auto msg = peek_message();
+  if (msg) {
+    skip_message();
   }
-  if (avail < next_length) {
-    if (!pull(next_length - avail)) {
+  return msg;
+}
+
+std::optional<MessageView> MessageStream::pull_message() {
+  while (!has_message()) {
+    size_t missing = size < sizeof(uint64_t) ? sizeof(uint64_t) - size
+                                             : sizeof(uint64_t) + peek_length() - size;
+    if (!pull(missing)) {
       return {};
     }
   }
@@ -85,26 +153,26 @@ std::optional<PMessage> MessageStream::pull_message() {
 }
 
 bool PullableMessageStream::pull(size_t length) {
-  const int BUFF = 4096;
-  static char buff[BUFF];
+  const size_t BUFF = 4096;
 
   if (fd == INVALID_FD) {
     return false;
   }
 
   while (length) {
+    auto space = prepare(std::max(length, BUFF));
 #ifdef WIN32
     DWORD res;
-    if (!ReadFile(fd, buff, BUFF, &res, nullptr)) {
+    if (!ReadFile(fd, space.data(), (DWORD) space.size(), &res, nullptr)) {
       return false;
     }
 #else
-    ssize_t res = read(fd, buff, BUFF);
+    ssize_t res = read(fd, space.data(), space.size());
     if (res <= 0) {
       return false;
     }
 #endif
-    feed(buff, res);
+    commit(res);
     if ((size_t) res >= length) {
       break;
     }
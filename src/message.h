@@ -1,10 +1,12 @@
 #pragma once
 
+#include <algorithm>
 #include <cassert>
 #include <cstdint>
+#include <cstring>
 #include <memory>
 #include <optional>
-#include <sstream>
+#include <span>
 #include <string_view>
 
 #include "utils.h"
@@ -19,24 +21,60 @@ struct MessageDeleter {
 
 using PMessage = std::unique_ptr<Message, MessageDeleter>;
 
-struct Message {
+// A message that lives in a buffer owned by someone else, e.g. a MessageStream.
+struct MessageView {
   uint64_t length;
-  char data[0];
+  char *data;
 
   template <typename T>
-  T *as() {
+  T *as() const {
     assert(sizeof(T) <= length);
     return (T *) data;
   }
 
-  bool write_to(fd_t handle) const;
-  void write_to(std::string &s) const;
+  // For messages that gained fields over time: copies as much as the peer sent, the rest keeps
+  // its default value.
+  template <typename T>
+  T read() const {
+    T obj;
+    memcpy((void *) &obj, data, std::min<uint64_t>(sizeof(T), length));
+    return obj;
+  }
 
   template <typename T>
   std::string_view get_trailer() const {
     return {data + sizeof(T), data + length};
   }
 
+  PMessage to_owned() const;
+};
+
+struct Message {
+  uint64_t length;
+  char data[0];
+
+  MessageView view() {
+    return {length, data};
+  }
+
+  template <typename T>
+  T *as() {
+    return view().as<T>();
+  }
+
+  template <typename T>
+  T read() {
+    return view().read<T>();
+  }
+
+  template <typename T>
+  std::string_view get_trailer() {
+    return view().get_trailer<T>();
+  }
+
+  bool write_to(fd_t handle) const;
+  void write_to(std::string &s) const;
+
   template <typename T>
   static PMessage from(const T &obj, const char *trailing = nullptr, uint64_t tlen = 0) {
     return from((const char *) &obj, sizeof(T), trailing, tlen);
@@ -45,13 +83,32 @@ struct Message {
   static PMessage from(const char *body, uint64_t body_size, const char *trailing, uint64_t tlen);
 };
 
+// Serializes a message into a per-thread buffer that is reused between calls and writes it at
+// once.
+bool write_message(fd_t handle, const char *body, uint64_t body_size, std::string_view trailer);
+
+template <typename T>
+bool write_message(fd_t handle, const T &obj, std::string_view trailer = {}) {
+  return write_message(handle, (const char *) &obj, sizeof(T), trailer);
+}
+
+// Incoming messages are kept in a ring buffer that grows as needed. Messages are handed out as
+// views into the ring and are only copied when they wrap around its end. A view stays valid
+// until the stream is fed or asked for another message.
 class MessageStream {
   private:
-  const int64_t NO_MESSAGE = -1, LENGTH_MASK = 0x7fffffffffffffff;
+  static constexpr uint64_t LENGTH_MASK = 0x7fffffffffffffff;
+  static constexpr size_t INITIAL_CAPACITY = 4096;
+
+  std::unique_ptr<char[]> buff;
+  size_t capacity = 0;  // always a power of two
+  size_t head = 0;
+  size_t size = 0;
+  std::unique_ptr<char[]> wrapped;
+  size_t wrapped_capacity = 0;
 
-  mutable std::stringbuf stream;
-  mutable int64_t avail = 0;
-  mutable int64_t next_length = NO_MESSAGE;
+  void copy_out(size_t offset, char *dst, size_t length) const;
+  uint64_t peek_length() const;
 
   protected:
   virtual bool pull([[maybe_unused]] size_t length) {
@@ -59,13 +116,24 @@ class MessageStream {
   }
 
   public:
+  MessageStream() = default;
+  MessageStream(MessageStream &&) = default;
+  MessageStream &operator=(MessageStream &&) = default;
   virtual ~MessageStream() {}
 
-  void feed(const char *buff, size_t length);
+  // Returns free space right after the buffered data to read into, growing the ring when less
+  // than `length` bytes are free. The span may be shorter than `length` where the ring wraps.
+  std::span<char> prepare(size_t length);
+  void commit(size_t length);
+  void feed(const char *data, size_t length);
+  void feed_message(const MessageView &msg);
 
   bool has_message() const;
-  std::optional<PMessage> get_message();
-  std::optional<PMessage> pull_message();
+  // Like get_message(), but leaves the message in the stream until skip_message().
+  std::optional<MessageView> peek_message();
+  void skip_message();
+  std::optional<MessageView> get_message();
+  std::optional<MessageView> pull_message();
 };
 
 class PullableMessageStream : public MessageStream {
@@ -0,0 +1,90 @@
+#include "mount-table.h"
+
+#include <fcntl.h>
+#include <linux/limits.h>
+#include <poll.h>
+#include <sys/sysmacros.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cstdio>
+
+MountTable mount_table;
+
+void MountTable::refresh() {
+  if (fd == -1) {
+    fd = open("/proc/self/mountinfo", O_RDONLY | O_CLOEXEC);
+    if (fd == -1) {
+      return;
+    }
+    load();
+    return;
+  }
+  pollfd pfd{.fd = fd, .events = POLLPRI, .revents = 0};
+  if (poll(&pfd, 1, 0) == 1 && (pfd.revents & (POLLPRI | POLLERR))) {
+    load();
+  }
+}
+
+void MountTable::load() {
+  std::string text;
+  char buff[16 * 1024];
+  ssize_t len;
+  lseek(fd, 0, SEEK_SET);
+  while ((len = read(fd, buff, sizeof(buff))) > 0) {
+    text.append(buff, len);
+  }
+
+  mounts.clear();
+  for (size_t pos = 0; pos < text.size();) {
+    auto eol = text.find('\n', pos);
+    if (eol == text.npos) {
+      eol = text.size();
+    }
+    auto line = text.substr(pos, eol - pos);
+    pos = eol + 1;
+
+    unsigned major, minor;
+    char escaped[PATH_MAX];
+    if (sscanf(line.data(), "%*u %*u %u:%u %*s %4095s", &major, &minor, escaped) != 3) {
+      continue;
+    }
+    // Whitespace and backslashes are escaped as \ooo.
+    std::string mount_point;
+    for (const char *c = escaped; *c; ++c) {
+      if (c[0] == '\\' && c[1] && c[2] && c[3]) {
+        mount_point += (char) ((c[1] - '0') << 6 | (c[2] - '0') << 3 | (c[3] - '0'));
+        c += 3;
+      } else {
+        mount_point += *c;
+      }
+    }
+    mounts[mount_point] = makedev(major, minor);
+  }
+}
+
+std::vector<std::string> MountTable::get_other_mounts(std::string_view root, dev_t dev) const {
+  std::string prefix{root};
+  if (prefix != "/") {
+    prefix += '/';
+  }
+  std::vector<std::string> below;
+  for (const auto &[mount_point, mount_dev] : mounts) {
+    if (mount_dev != dev && mount_point.size() > prefix.size() &&
+        mount_point.starts_with(prefix)) {
+      below.push_back(mount_point.substr(prefix.size()));
+    }
+  }
+
+  std::sort(below.begin(), below.end());
+  std::vector<std::string> res;
+  for (auto &mount : below) {
+    if (std::none_of(res.begin(), res.end(), [&](const std::string &outer) {
+          return mount.size() > outer.size() && mount.starts_with(outer) &&
+                 mount[outer.size()] == '/';
+        })) {
+      res.push_back(std::move(mount));
+    }
+  }
+  return res;
+}
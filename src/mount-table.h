@@ -0,0 +1,31 @@
+#pragma once
+
+#include <sys/types.h>
+
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+// The mount points of the process, from /proc/self/mountinfo.
+class MountTable {
+  private:
+  int fd = -1;
+  std::unordered_map<std::string, dev_t> mounts;  // mount point -> device
+
+  void load();
+
+  public:
+  // Reads the table again if the kernel reports that it changed, which costs a poll.
+  void refresh();
+
+  bool is_mount_point(const std::string &path) const {
+    return mounts.count(path);
+  }
+
+  // Mount points below `root` that are not on the device `dev`, relative to `root`. Mounts below
+  // those are left out.
+  std::vector<std::string> get_other_mounts(std::string_view root, dev_t dev) const;
+};
+
+extern MountTable mount_table;
@@ -0,0 +1,134 @@
+#include "output.h"
+
+#include <fcntl.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#include <cerrno>
+#include <cstring>
+
+const size_t OUTPUT_CHUNK = 64 * 1024;
+const size_t OUTPUT_FLUSH_SIZE = 4 * OUTPUT_CHUNK;
+const int OUTPUT_IOV = 64;
+// Bytes a reader may leave unread before it is given up on, rather than letting a client that
+// hangs grow the daemon without bounds.
+const size_t OUTPUT_MAX_BUFFERED = 1024 * OUTPUT_CHUNK;
+// Written chunks kept for reuse, enough for a flush. The rest is freed.
+const size_t OUTPUT_SPARE = OUTPUT_FLUSH_SIZE / OUTPUT_CHUNK;
+
+void Output::start(struct ev_loop *loop_, int fd_) {
+  loop = loop_;
+  fd = fd_;
+  fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+
+  ev_prepare_init(&ev_flush, flush_cb);
+  ev_flush.data = this;
+  ev_prepare_start(loop, &ev_flush);
+  ev_io_init(&ev_writer, writer_cb, fd, EV_WRITE);
+  ev_writer.data = this;
+}
+
+Output::~Output() {
+  if (loop) {
+    ev_prepare_stop(loop, &ev_flush);
+    ev_io_stop(loop, &ev_writer);
+  }
+}
+
+void Output::append(const char *data, size_t length) {
+  if (overflowed) {
+    return;
+  }
+  if (buffered + length > OUTPUT_MAX_BUFFERED) {
+    overflowed = true;
+    ev_io_stop(loop, &ev_writer);
+    chunks.clear();
+    spare.clear();
+    head = 0;
+    buffered = 0;
+    return;
+  }
+  buffered += length;
+  while (length) {
+    if (chunks.empty() || chunks.back().size == OUTPUT_CHUNK) {
+      if (spare.size()) {
+        chunks.push_back({std::move(spare.back()), 0});
+        spare.pop_back();
+      } else {
+        chunks.push_back({std::make_unique<char[]>(OUTPUT_CHUNK), 0});
+      }
+    }
+    auto &chunk = chunks.back();
+    size_t part = std::min(length, OUTPUT_CHUNK - chunk.size);
+    memcpy(chunk.data.get() + chunk.size, data, part);
+    chunk.size += part;
+    data += part;
+    length -= part;
+  }
+}
+
+void Output::consume(size_t length) {
+  buffered -= length;
+  while (length) {
+    auto &chunk = chunks.front();
+    size_t part = std::min(length, chunk.size - head);
+    head += part;
+    length -= part;
+    if (head == chunk.size) {
+      if (spare.size() < OUTPUT_SPARE) {
+        spare.push_back(std::move(chunk.data));
+      }
+      chunks.pop_front();
+      head = 0;
+    }
+  }
+}
+
+void Output::flush_if_full() {
+  if (buffered >= OUTPUT_FLUSH_SIZE) {
+    flush();
+  }
+}
+
+void Output::flush() {
+  if (ev_is_active(&ev_writer)) {
+    return;
+  }
+  while (buffered) {
+    iovec iov[OUTPUT_IOV];
+    int iov_cnt = 0;
+    size_t offset = head;
+    for (auto &chunk : chunks) {
+      if (iov_cnt == OUTPUT_IOV) {
+        break;
+      }
+      iov[iov_cnt++] = {chunk.data.get() + offset, chunk.size - offset};
+      offset = 0;
+    }
+
+    ssize_t written = writev(fd, iov, iov_cnt);
+    if (written < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      if (errno == EAGAIN || errno == EWOULDBLOCK) {
+        ev_io_start(loop, &ev_writer);
+        return;
+      }
+      // Nobody is going to read the rest.
+      consume(buffered);
+      return;
+    }
+    consume(written);
+  }
+}
+
+void Output::flush_cb(struct ev_loop *, ev_prepare *w, int) {
+  ((Output *) w->data)->flush();
+}
+
+void Output::writer_cb(struct ev_loop *, ev_io *w, int) {
+  auto output = (Output *) w->data;
+  ev_io_stop(output->loop, w);
+  output->flush();
+}
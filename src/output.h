@@ -0,0 +1,78 @@
+#pragma once
+
+#include <ev.h>
+
+#include <cstdint>
+#include <deque>
+#include <initializer_list>
+#include <memory>
+#include <string_view>
+#include <vector>
+
+// Messages sent by the daemon. They are serialized straight into a list of fixed-size chunks
+// and written with writev once per loop iteration, or as soon as OUTPUT_FLUSH_SIZE bytes are
+// buffered. While the pipe is full, an ev_io watcher waits for it to drain instead of blocking
+// the loop, up to OUTPUT_MAX_BUFFERED bytes. There is one per client.
+class Output {
+  private:
+  struct Chunk {
+    std::unique_ptr<char[]> data;
+    size_t size;
+  };
+
+  struct ev_loop *loop = nullptr;
+  int fd = -1;
+  ev_prepare ev_flush;
+  ev_io ev_writer;
+
+  std::deque<Chunk> chunks;
+  std::vector<std::unique_ptr<char[]>> spare;
+  size_t head = 0;  // bytes of the first chunk that are already written
+  size_t buffered = 0;
+  bool overflowed = false;
+
+  void append(const char *data, size_t length);
+  void consume(size_t length);
+
+  static void flush_cb(struct ev_loop *, ev_prepare *w, int);
+  static void writer_cb(struct ev_loop *, ev_io *w, int);
+
+  public:
+  Output() = default;
+  Output(const Output &) = delete;
+  Output &operator=(const Output &) = delete;
+  ~Output();
+
+  // Makes `fd_` non-blocking.
+  void start(struct ev_loop *loop_, int fd_);
+
+  template <typename T>
+  void write(const T &obj, std::initializer_list<std::string_view> trailer = {}) {
+    if (overflowed) {
+      return;
+    }
+    uint64_t length = sizeof(T);
+    for (auto part : trailer) {
+      length += part.size();
+    }
+    append((const char *) &length, sizeof(length));
+    append((const char *) &obj, sizeof(T));
+    for (auto part : trailer) {
+      append(part.data(), part.size());
+    }
+    flush_if_full();
+  }
+
+  void flush_if_full();
+  void flush();
+
+  size_t get_buffered() const {
+    return buffered;
+  }
+
+  // Whether the reader fell so far behind that everything it did not read yet was dropped. The
+  // output ignores writes from then on, and its client is to be closed.
+  bool is_overflowed() const {
+    return overflowed;
+  }
+};
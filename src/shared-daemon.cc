@@ -0,0 +1,285 @@
+#include "shared-daemon.h"
+
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <sys/file.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include <cerrno>
+#include <cinttypes>
+#include <cstdio>
+#include <cstring>
+#include <vector>
+
+#include "client.h"
+#include "file-digest.h"
+#include "utils.h"
+
+SharedDaemon shared_daemon;
+
+// How long the daemon stays around without clients, so that tools that are restarted or
+// started one after the other keep using the same daemon.
+const ev_tstamp IDLE_EXIT = 10;
+// How long a new daemon waits for the lock of one that is about to exit.
+const useconds_t LOCK_RETRY = 10 * 1000;
+const int LOCK_TRIES = 100;
+// How long a relay waits for the daemon it started to listen.
+const useconds_t CONNECT_RETRY = 10 * 1000;
+const int CONNECT_TRIES = 300;
+// How often a relay starts over with a new daemon when the daemon drops it without an answer.
+const int RELAY_TRIES = 3;
+const size_t RELAY_BUFF = 64 * 1024;
+
+namespace {
+  std::string get_socket_dir() {
+    return "/tmp/wsl-fs-notify-" + std::to_string(getuid());
+  }
+
+  // Whether nobody but the user can put a socket into `dir`, which is not a symlink either.
+  bool is_private_dir(const std::string &dir) {
+    struct stat st;
+    return lstat(dir.data(), &st) == 0 && S_ISDIR(st.st_mode) && st.st_uid == getuid() &&
+           !(st.st_mode & (S_IRWXG | S_IRWXO));
+  }
+
+  bool fill_address(const std::string &path, sockaddr_un &addr) {
+    addr = {};
+    addr.sun_family = AF_UNIX;
+    if (path.size() >= sizeof(addr.sun_path)) {
+      errno = ENAMETOOLONG;
+      return false;
+    }
+    memcpy(addr.sun_path, path.data(), path.size());
+    return true;
+  }
+
+  int connect_to(const std::string &path) {
+    sockaddr_un addr;
+    if (!fill_address(path, addr)) {
+      return -1;
+    }
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd == -1) {
+      return -1;
+    }
+    if (connect(fd, (const sockaddr *) &addr, sizeof(addr)) == -1) {
+      close(fd);
+      return -1;
+    }
+    return fd;
+  }
+
+  // Starts the daemon detached from the relay, which may be gone long before it.
+  void spawn_daemon(char **argv) {
+    std::vector<char *> args{argv[0]};
+    for (char **arg = argv + 1; *arg; arg++) {
+      if (strcmp(*arg, "--shared")) {
+        args.push_back(*arg);
+      }
+    }
+    args.push_back((char *) "--listen");
+    args.push_back(nullptr);
+
+    if (fork() != 0) {
+      return;
+    }
+    setsid();
+    int null_fd = open("/dev/null", O_RDWR);
+    if (null_fd != -1) {
+      dup2(null_fd, STDIN_FILENO);
+      dup2(null_fd, STDOUT_FILENO);
+      dup2(null_fd, STDERR_FILENO);
+    }
+    execv("/proc/self/exe", args.data());
+    _exit(127);
+  }
+
+  // Connects to the daemon listening on `path`, which is started first if there is none.
+  int connect_daemon(const std::string &path, char **argv) {
+    int fd = is_private_dir(get_socket_dir()) ? connect_to(path) : -1;
+    if (fd == -1) {
+      spawn_daemon(argv);
+      for (int i = 0; i < CONNECT_TRIES && fd == -1; i++) {
+        usleep(CONNECT_RETRY);
+        if (is_private_dir(get_socket_dir())) {
+          fd = connect_to(path);
+        }
+      }
+    }
+    if (fd == -1) {
+      fprintf(stderr, "cannot connect to %s: %s\n", path.c_str(), strerror(errno));
+    }
+    return fd;
+  }
+}  // namespace
+
+bool SharedDaemon::listen(const std::string &path) {
+  auto dir = get_socket_dir();
+  if ((mkdir(dir.data(), 0700) == -1 && errno != EEXIST) || !is_private_dir(dir)) {
+    return false;
+  }
+  // Two relays may start a daemon at the same time, only one of them gets to serve.
+  lock_fd = open((path + ".lock").data(), O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+  if (lock_fd == -1) {
+    return false;
+  }
+  for (int i = 0; flock(lock_fd, LOCK_EX | LOCK_NB) == -1; i++) {
+    if (errno != EWOULDBLOCK || i == LOCK_TRIES) {
+      return false;
+    }
+    usleep(LOCK_RETRY);
+  }
+
+  sockaddr_un addr;
+  if (!fill_address(path, addr)) {
+    return false;
+  }
+  // Left behind by a daemon that did not exit cleanly, as the lock tells.
+  unlink(path.data());
+  socket_path = path;
+  fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+  if (fd == -1) {
+    return false;
+  }
+  if (bind(fd, (const sockaddr *) &addr, sizeof(addr)) == -1 || ::listen(fd, SOMAXCONN) == -1) {
+    close(fd);
+    fd = -1;
+    return false;
+  }
+  // Clients that went away must not take the daemon with them.
+  signal(SIGPIPE, SIG_IGN);
+
+  ev_io_init(&listener, accept_cb, fd, EV_READ);
+  ev_set_priority(&listener, EV_MAXPRI);
+  ev_io_start(loop, &listener);
+  ev_timer_init(&idle_timer, idle_cb, IDLE_EXIT, 0);
+  // The relay that started the daemon may have given up on it already.
+  wait_idle();
+  return true;
+}
+
+void SharedDaemon::wait_idle() {
+  if (!ev_is_active(&idle_timer)) {
+    ev_timer_set(&idle_timer, IDLE_EXIT, 0);
+    ev_timer_start(loop, &idle_timer);
+  }
+}
+
+void SharedDaemon::accept_cb(struct ev_loop *, ev_io *w, int) {
+  int client_fd;
+  while ((client_fd = accept4(w->fd, nullptr, nullptr, SOCK_NONBLOCK | SOCK_CLOEXEC)) != -1) {
+    // The directory already keeps others out, this is for sockets passed around.
+    ucred cred;
+    socklen_t len = sizeof(cred);
+    if (getsockopt(client_fd, SOL_SOCKET, SO_PEERCRED, &cred, &len) == -1 ||
+        cred.uid != getuid()) {
+      close(client_fd);
+      continue;
+    }
+    ev_timer_stop(loop, &shared_daemon.idle_timer);
+    clients.push_back(std::make_unique<Client>(client_fd, client_fd));
+  }
+}
+
+void SharedDaemon::idle_cb(struct ev_loop *, ev_timer *, int) {
+  auto &daemon = shared_daemon;
+  // Connections may be waiting in the backlog without the loop having seen them yet.
+  accept_cb(loop, &daemon.listener, EV_READ);
+  if (!clients.empty()) {
+    return;
+  }
+  // Relays that come too late start a new daemon, which waits for the lock until this one
+  // is gone. Those that connected in between are dropped, and try again the same way.
+  ev_io_stop(loop, &daemon.listener);
+  unlink(daemon.socket_path.data());
+  close(daemon.fd);
+  ev_break(loop, EVBREAK_ALL);
+}
+
+std::string get_socket_path(std::string_view options) {
+  Hasher hasher;
+  hasher.update(options);
+  char name[32];
+  snprintf(name, sizeof(name), "/%016" PRIx64 ".sock", hasher.digest());
+  return get_socket_dir() + name;
+}
+
+int run_relay(const std::string &path, char **argv) {
+  // Without a daemon, writes to it fail instead of killing the relay.
+  signal(SIGPIPE, SIG_IGN);
+  // Daemons that exit while the relay still runs are reaped right away.
+  signal(SIGCHLD, SIG_IGN);
+
+  int fd = connect_daemon(path, argv);
+  if (fd == -1) {
+    return 1;
+  }
+
+  // What went to the daemon before it answered anything. A daemon that was exiting as the
+  // relay connected closes the socket without reading it, and a new one is sent all of it.
+  std::string unanswered;
+  bool is_answered = false;
+  int tries = 1;
+  std::vector<char> buff(RELAY_BUFF);
+  pollfd fds[2] = {{.fd = STDIN_FILENO, .events = POLLIN, .revents = 0},
+                   {.fd = fd, .events = POLLIN, .revents = 0}};
+  auto start_over = [&]() {
+    if (is_answered || unanswered.empty() || tries++ == RELAY_TRIES) {
+      return false;
+    }
+    close(fd);
+    fds[1].fd = fd = connect_daemon(path, argv);
+    if (fd == -1 || !write_exactly(fd, unanswered)) {
+      return false;
+    }
+    if (fds[0].fd == -1) {
+      shutdown(fd, SHUT_WR);
+    }
+    return true;
+  };
+
+  while (true) {
+    if (poll(fds, 2, -1) == -1) {
+      if (errno == EINTR) {
+        continue;
+      }
+      return 1;
+    }
+    if (fds[0].revents) {
+      ssize_t len = read(STDIN_FILENO, buff.data(), buff.size());
+      if (len <= 0) {
+        // The daemon drops the client and closes the socket, which ends the relay.
+        shutdown(fd, SHUT_WR);
+        fds[0].fd = -1;
+      } else {
+        if (!is_answered) {
+          unanswered.append(buff.data(), (size_t) len);
+        }
+        if (!write_exactly(fd, {buff.data(), (size_t) len})) {
+          if (!start_over()) {
+            return 1;
+          }
+          continue;
+        }
+      }
+    }
+    if (fds[1].revents) {
+      ssize_t len = read(fd, buff.data(), buff.size());
+      if (len <= 0) {
+        if (start_over()) {
+          continue;
+        }
+        return len == 0 && fds[0].fd == -1 ? 0 : 1;
+      }
+      is_answered = true;
+      unanswered = {};
+      if (!write_exactly(STDOUT_FILENO, {buff.data(), (size_t) len})) {
+        return 1;
+      }
+    }
+  }
+}
@@ -0,0 +1,45 @@
+#pragma once
+
+#include <ev.h>
+
+#include <string>
+#include <string_view>
+
+// Lets one daemon per user and set of options serve every DLL in the distro, so that tools
+// watching the same tree share the crawl and the kernel watches. The daemon listens on a Unix
+// socket, and the processes that the DLLs launch only relay their stdin and stdout to it. See
+// --listen and --shared.
+class SharedDaemon {
+  private:
+  int fd = -1;
+  int lock_fd = -1;  // held while the daemon serves `socket_path`
+  std::string socket_path;
+  ev_io listener;
+  ev_timer idle_timer;  // runs while nobody is connected
+
+  static void accept_cb(struct ev_loop *, ev_io *w, int);
+  static void idle_cb(struct ev_loop *, ev_timer *w, int);
+
+  public:
+  bool is_listening() const {
+    return fd != -1;
+  }
+
+  // Starts accepting clients on `path`. Fails if another daemon holds it already.
+  bool listen(const std::string &path);
+
+  // To be called once the last client is gone: the daemon exits unless another one connects
+  // soon.
+  void wait_idle();
+};
+
+extern SharedDaemon shared_daemon;
+
+// The socket of the daemon started with `options`, in a directory that only the user can
+// access.
+std::string get_socket_path(std::string_view options);
+
+// Relays stdin and stdout to the daemon listening on `path`. If there is none, it is started
+// in the background with `argv`, the command line of this process, where --shared is replaced
+// with --listen. Returns the exit code for the relay.
+int run_relay(const std::string &path, char **argv);
@@ -0,0 +1,61 @@
+#include "storm-detector.h"
+
+namespace {
+  bool is_below(std::string_view path, std::string_view subtree) {
+    return subtree.empty() || (path.size() > subtree.size() && path.starts_with(subtree) &&
+                               path[subtree.size()] == '/');
+  }
+}  // namespace
+
+StormDetector::Verdict StormDetector::add(std::string_view path) {
+  for (auto &subtree : dirty) {
+    if (is_below(path, subtree.path)) {
+      ++subtree.events;
+      ++suppressed_cnt;
+      subtree.has_suppressed = true;
+      return SUPPRESS;
+    }
+  }
+
+  ++watch_events;
+  auto slash = path.rfind('/');
+  auto dir = slash == path.npos ? std::string_view{} : path.substr(0, slash);
+  auto events = ++dir_events[std::string{dir}];
+  if (watch_limit && watch_events > watch_limit) {
+    make_dirty({}, watch_limit);
+  } else if (dir_limit && events > dir_limit) {
+    make_dirty(dir, dir_limit);
+  } else {
+    return SEND;
+  }
+  ++suppressed_cnt;
+  return STORM;
+}
+
+void StormDetector::make_dirty(std::string_view subtree, uint32_t limit) {
+  // Storms below the new one are covered by it now.
+  std::erase_if(dirty, [&](const Subtree &other) { return is_below(other.path, subtree); });
+  // Count the window so far, so that the subtree stays dirty at least until the next one.
+  dirty.push_back({
+      .path = std::string{subtree},
+      .limit = limit,
+      .events = limit + 1,
+      .has_suppressed = false,
+  });
+  storm_path = subtree;
+  ++storm_cnt;
+}
+
+size_t StormDetector::memory_usage() const {
+  size_t res = dir_events.bucket_count() * sizeof(void *) +
+               dir_events.size() * (sizeof(std::pair<const std::string, uint32_t>) +
+                                    sizeof(void *)) +
+               dirty.capacity() * sizeof(Subtree) + storm_path.capacity();
+  for (const auto &[dir, events] : dir_events) {
+    res += dir.capacity();
+  }
+  for (const auto &subtree : dirty) {
+    res += subtree.path.capacity();
+  }
+  return res;
+}
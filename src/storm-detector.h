@@ -0,0 +1,67 @@
+#pragma once
+
+#include <cstdint>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+// Counts the events of a watch per directory over fixed windows. A directory with more than
+// `dir_limit` events in a window, or a watch with more than `watch_limit` (0 disables either),
+// becomes a dirty subtree: the client is told to rescan it and its events are suppressed until a
+// window goes by with fewer events than that.
+class StormDetector {
+  private:
+  struct Subtree {
+    std::string path;     // relative to the watch, "" for the whole watch
+    uint32_t limit;       // the limit it crossed
+    uint32_t events;      // in the current window
+    bool has_suppressed;  // since the client was last told to rescan it
+  };
+
+  std::unordered_map<std::string, uint32_t> dir_events;  // directory -> events in the window
+  uint32_t watch_events = 0;
+  std::vector<Subtree> dirty;
+
+  void make_dirty(std::string_view subtree, uint32_t limit);
+
+  public:
+  enum Verdict { SEND, SUPPRESS, STORM };
+
+  uint32_t dir_limit = 0, watch_limit = 0;
+  uint64_t storm_cnt = 0, suppressed_cnt = 0;
+  std::string storm_path;  // the subtree of the last STORM
+
+  bool is_enabled() const {
+    return dir_limit || watch_limit;
+  }
+
+  bool is_idle() const {
+    return !watch_events && dirty.empty();
+  }
+
+  // What to do with an event for `path`. On STORM, the event is suppressed like the ones after it
+  // and the client has to be told that `storm_path` is dirty.
+  Verdict add(std::string_view path);
+
+  // Ends the window. Calls f(path) for every subtree that calmed down after events were
+  // suppressed, as its last rescan may have missed them.
+  template <typename F>
+  void end_window(F &&f);
+
+  size_t memory_usage() const;
+};
+
+template <typename F>
+void StormDetector::end_window(F &&f) {
+  std::erase_if(dirty, [&](Subtree &subtree) {
+    bool is_calm = subtree.events < subtree.limit;
+    if (is_calm && subtree.has_suppressed) {
+      f(std::string_view{subtree.path});
+    }
+    subtree.events = 0;
+    return is_calm;
+  });
+  dir_events.clear();
+  watch_events = 0;
+}
@@ -0,0 +1,440 @@
+#include "watcher.h"
+
+#include <dirent.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <algorithm>
+
+#include "crawler.h"
+
+std::set<Watcher *> watchers;
+
+const ev_tstamp PROGRESS_INTERVAL = 0.25;
+// Listings are sent in chunks of about this many bytes.
+const size_t LIST_CHUNK = 64 * 1024;
+// Crawl tokens of listings have this bit set, those of InotifyWatcher do not.
+const uint64_t LISTING_TOKEN = 1ULL << 63;
+
+namespace {
+  // A DirectoryListRequest whose directory is being listed by the crawler.
+  struct PendingListing {
+    Watcher *watcher;
+    Output *output;
+    DirectoryListRequest req;
+    std::string rel_path;
+  };
+
+  std::map<uint64_t, PendingListing> pending_listings;  // by crawl token
+  uint64_t next_listing_token = LISTING_TOKEN;
+
+  // Whether `rel_path` stays inside the watch: no leading slash, and no empty, "." or ".."
+  // components. Empty stands for the watched directory itself.
+  bool is_valid_rel_path(std::string_view rel_path) {
+    if (rel_path.empty()) {
+      return true;
+    }
+    while (true) {
+      auto end = std::min(rel_path.find('/'), rel_path.size());
+      auto name = rel_path.substr(0, end);
+      if (name.empty() || name == "." || name == ".." || name.find('\0') != name.npos) {
+        return false;
+      }
+      if (end == rel_path.size()) {
+        return true;
+      }
+      rel_path.remove_prefix(end + 1);
+    }
+  }
+
+  void coalesce_cb(EV_P_ ev_timer *w, int) {
+    ((Watcher *) w->data)->flush_events();
+  }
+
+  void settle_cb(EV_P_ ev_timer *w, int) {
+    auto watcher = (Watcher *) w->data;
+    watcher->writes.expire(ev_now(EV_A) - watcher->settle_time, [&](std::string_view filename) {
+      ++watcher->writes.reported_cnt;
+      watcher->send_event(FILE_ACTION_MODIFIED, filename);
+    });
+    if (watcher->writes.empty()) {
+      ev_timer_stop(EV_A_ w);
+    }
+  }
+
+  void storm_cb(EV_P_ ev_timer *w, int) {
+    auto watcher = (Watcher *) w->data;
+    watcher->storms.end_window(
+        [&](std::string_view rel_path) { watcher->send_subtree_dirty(rel_path); });
+    if (watcher->storms.is_idle()) {
+      ev_timer_stop(EV_A_ w);
+    }
+  }
+}  // namespace
+
+Watcher::Watcher(std::string_view path_, uint32_t filter_, bool recursive_,
+                 uint32_t capabilities_)
+    : path(path_),
+      filter(filter_),
+      recursive(recursive_),
+      capabilities(capabilities_),
+      settle_time(settle_window) {
+  watchers.insert(this);
+  ev_timer_init(&coalesce_timer, coalesce_cb, 0, 0);
+  coalesce_timer.data = this;
+  ev_timer_init(&settle_timer, settle_cb, 0, 0);
+  settle_timer.data = this;
+  ev_timer_init(&storm_timer, storm_cb, 0, 0);
+  storm_timer.data = this;
+  if (capabilities & CAP_SUBTREE_DIRTY) {
+    storms.dir_limit = storm_dir_events;
+    storms.watch_limit = storm_watch_events;
+  }
+  has_credits = (capabilities & CAP_EVENT_CREDITS) && (capabilities & CAP_SUBTREE_DIRTY);
+}
+
+Watcher::~Watcher() {
+  std::erase_if(pending_listings, [&](const auto &entry) { return entry.second.watcher == this; });
+  ev_timer_stop(loop, &coalesce_timer);
+  ev_timer_stop(loop, &settle_timer);
+  ev_timer_stop(loop, &storm_timer);
+  watchers.erase(this);
+}
+
+void Watcher::subscribe(Output &output, void *directory) {
+  auto &subscriber = subscribers.emplace_back();
+  subscriber.output = &output;
+  subscriber.directory = directory;
+  for (const auto &rel_path : skipped_mounts) {
+    output.write(MountSkipped{.directory = directory}, {rel_path});
+  }
+  if (is_ready) {
+    output.write(WatchReady{.directory = directory});
+  }
+}
+
+void Watcher::unsubscribe(Output &output, void *directory) {
+  std::erase_if(subscribers, [&](const Subscriber &subscriber) {
+    return subscriber.output == &output && subscriber.directory == directory;
+  });
+  std::erase_if(pending_listings, [&](const auto &entry) {
+    return entry.second.output == &output && entry.second.req.directory == directory;
+  });
+}
+
+const std::string &Watcher::join(std::initializer_list<std::string_view> parts) {
+  joined_buf.clear();
+  for (auto part : parts) {
+    joined_buf += part;
+  }
+  return joined_buf;
+}
+
+const char *Watcher::get_abs_path(std::initializer_list<std::string_view> parts) {
+  abs_path_buf = path;
+  abs_path_buf += '/';
+  for (auto part : parts) {
+    abs_path_buf += part;
+  }
+  return abs_path_buf.data();
+}
+
+void Watcher::send_event(FileAction action, std::initializer_list<std::string_view> parts) {
+  if (is_failed) {
+    return;
+  }
+  if (action == FILE_ACTION_FAILED) {
+    flush_events();
+    is_failed = true;
+  } else {
+    if (!writes.empty() &&
+        (action == FILE_ACTION_REMOVED || action == FILE_ACTION_RENAMED_OLD_NAME)) {
+      // The removal or rename is what the client needs to know now.
+      writes.forget(join(parts));
+    }
+    if (storms.is_enabled() && !check_storm(parts)) {
+      return;
+    }
+    if (coalesce_window > 0) {
+      // The window starts with the first event, so none waits longer than that.
+      if (coalescer.empty()) {
+        ev_timer_set(&coalesce_timer, coalesce_window, 0);
+        ev_timer_start(loop, &coalesce_timer);
+      }
+      coalescer.add(action, parts);
+      return;
+    }
+  }
+  write_event(action, parts);
+}
+
+void Watcher::report_write(std::initializer_list<std::string_view> parts) {
+  if (settle_time <= 0) {
+    send_event(FILE_ACTION_MODIFIED, parts);
+    return;
+  }
+  if (!ev_is_active(&settle_timer)) {
+    // Checking twice per window keeps files that stay open from waiting much longer than that.
+    ev_timer_set(&settle_timer, settle_time / 2, settle_time / 2);
+    ev_timer_start(loop, &settle_timer);
+  }
+  writes.write(join(parts), ev_now(loop));
+}
+
+void Watcher::report_close_write(std::initializer_list<std::string_view> parts) {
+  if (writes.empty()) {
+    return;
+  }
+  if (writes.close(join(parts))) {
+    ++writes.reported_cnt;
+    send_event(FILE_ACTION_MODIFIED, parts);
+  }
+}
+
+bool Watcher::check_storm(std::initializer_list<std::string_view> parts) {
+  if (storms.is_idle()) {
+    ev_timer_set(&storm_timer, storm_window, storm_window);
+    ev_timer_start(loop, &storm_timer);
+  }
+  auto verdict = storms.add(join(parts));
+  if (verdict == StormDetector::STORM) {
+    send_subtree_dirty(storms.storm_path);
+  }
+  return verdict == StormDetector::SEND;
+}
+
+bool Watcher::check_digest(FileAction action, std::initializer_list<std::string_view> parts) {
+  auto &filename = join(parts);
+  if (action == FILE_ACTION_MODIFIED && skip_unchanged) {
+    return digests.has_changed(get_abs_path(parts), filename);
+  }
+  digests.forget(filename);
+  return true;
+}
+
+void Watcher::write_event(FileAction action, std::initializer_list<std::string_view> parts) {
+  // Only now, as a coalesced burst of writes has settled.
+  if (!digests.empty() && action != FILE_ACTION_FAILED && !check_digest(action, parts)) {
+    return;
+  }
+  bool has_stat = !(capabilities & CAP_EVENT_STAT) || action == FILE_ACTION_REMOVED ||
+                  action == FILE_ACTION_RENAMED_OLD_NAME || action == FILE_ACTION_FAILED;
+  EventStat event{.directory = nullptr, .action = action, .stat = {}};
+  std::string_view filename;
+  for (auto &subscriber : subscribers) {
+    if (has_credits && action != FILE_ACTION_FAILED) {
+      if (!subscriber.credits) {
+        ++subscriber.overdrawn_cnt;
+        if (filename.empty()) {
+          filename = join(parts);
+        }
+        auto slash = filename.rfind('/');
+        auto rel_dir = slash == filename.npos ? "" : filename.substr(0, slash);
+        subscriber.overdrawn.add(rel_dir);
+        continue;
+      }
+      --subscriber.credits;
+    }
+    if (!(capabilities & CAP_EVENT_STAT)) {
+      subscriber.output->write(Event{.directory = subscriber.directory, .action = action}, parts);
+      continue;
+    }
+    // Only once somebody has the credits for it.
+    if (!has_stat) {
+      has_stat = true;
+      get_file_stat(AT_FDCWD, get_abs_path(parts), event.stat);
+    }
+    event.directory = subscriber.directory;
+    subscriber.output->write(event, parts);
+  }
+}
+
+void Watcher::flush_events() {
+  ev_timer_stop(loop, &coalesce_timer);
+  coalescer.drain([this](FileAction action, std::string_view filename) {
+    write_event(action, {filename});
+  });
+}
+
+void Watcher::add_credits(Output &output, void *directory, uint32_t cnt) {
+  auto it = std::find_if(subscribers.begin(), subscribers.end(), [&](const Subscriber &s) {
+    return s.output == &output && s.directory == directory;
+  });
+  if (it == subscribers.end()) {
+    return;
+  }
+  it->credits += cnt;
+  if (is_failed || !it->credits) {
+    return;
+  }
+  // Not through send_subtree_dirty: the events it flushes would need the credits already.
+  it->overdrawn.drain([&](std::string_view rel_dir) {
+    output.write(SubtreeDirty{.directory = directory}, {rel_dir});
+  });
+}
+
+void Watcher::send_subtree_dirty(std::string_view rel_path) {
+  if (is_failed) {
+    return;
+  }
+  // What is held back came before the storm, and the client should see it before the rescan.
+  flush_events();
+  broadcast(SubtreeDirty{}, {rel_path});
+}
+
+void Watcher::report_skipped_mount(std::initializer_list<std::string_view> parts) {
+  if (is_failed || !(capabilities & CAP_MOUNT_SKIPPED)) {
+    return;
+  }
+  auto &rel_path = join(parts);
+  if (!skipped_mounts.insert(rel_path).second) {
+    return;
+  }
+  broadcast(MountSkipped{}, {rel_path});
+}
+
+void Watcher::send_listing(Output &output, const DirectoryListRequest &req,
+                           std::string_view rel_path) {
+  if (!is_valid_rel_path(rel_path)) {
+    output.write(DirectoryListChunk{
+        .directory = req.directory,
+        .id = req.id,
+        .error = EINVAL,
+        .is_last = true,
+    });
+    return;
+  }
+  CrawlResult result;
+  result.request.path = path + "/";
+  if (rel_path.size()) {
+    result.request.path += rel_path;
+    result.request.path += '/';
+  }
+  if (get_cached_listing(rel_path, result)) {
+    write_listing(output, req, rel_path, result, true);
+    return;
+  }
+  // Listing a huge directory would hold up everything else.
+  auto token = next_listing_token++;
+  pending_listings[token] = {this, &output, req, std::string{rel_path}};
+  result.request.token = token;
+  crawler.submit(std::move(result.request));
+}
+
+void Watcher::write_listing(Output &output, const DirectoryListRequest &req,
+                            std::string_view rel_path, const CrawlResult &result,
+                            bool is_cached) {
+  bool with_stat = req.with_stat;
+  DirectoryListChunk chunk{
+      .directory = req.directory,
+      .id = req.id,
+      .error = (uint32_t) result.error,
+      .is_cached = is_cached,
+  };
+  // Cached entries that are only known from events still need their type.
+  int fd = -1;
+  if (!chunk.error && (with_stat || is_cached)) {
+    fd = open(result.request.path.data(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (fd == -1) {
+      chunk.error = errno;
+    }
+  }
+  if (chunk.error) {
+    chunk.is_last = true;
+    output.write(chunk);
+    return;
+  }
+
+  std::string rel_dir{rel_path};
+  if (rel_dir.size()) {
+    rel_dir += '/';
+  }
+  std::string entries;
+  auto add = [&](std::string_view name, uint8_t type) {
+    FileStat stat;
+    if (with_stat || type == DT_UNKNOWN) {
+      // Names in a CrawlResult end with a NUL.
+      if (!get_file_stat(fd, name.data(), stat)) {
+        return;  // gone already
+      }
+      type = (uint8_t) IFTODT(stat.mode);
+    }
+    if (excludes.is_excluded({rel_dir, name}, type == DT_DIR)) {
+      return;
+    }
+    DirectoryListEntry entry{.type = DTTOIF(type), .name_length = (uint32_t) name.size()};
+    entries.append((const char *) &entry, sizeof(entry));
+    entries += name;
+    if (with_stat) {
+      entries.append((const char *) &stat, sizeof(stat));
+    }
+    if (entries.size() >= LIST_CHUNK) {
+      output.write(chunk, {entries});
+      entries.clear();
+    }
+  };
+  for (const auto &name : result.subdirs) {
+    add(name, DT_DIR);
+  }
+  for (const auto &file : result.files) {
+    add(result.get_name(file), file.type);
+  }
+  if (fd != -1) {
+    close(fd);
+  }
+  chunk.is_last = true;
+  output.write(chunk, {entries});
+}
+
+void Watcher::send_digests(Output &output, const FileDigestRequest &req,
+                           std::string_view paths) {
+  std::string res;
+  while (paths.size()) {
+    auto end = std::min(paths.find('\0'), paths.size());
+    auto rel_path = paths.substr(0, end);
+    paths.remove_prefix(std::min(end + 1, paths.size()));
+    FileDigest digest;
+    if (!is_valid_rel_path(rel_path)) {
+      digest.error = EINVAL;
+    } else {
+      digest.error = digests.get(get_abs_path({rel_path}), join({rel_path}), digest);
+    }
+    res.append((const char *) &digest, sizeof(digest));
+  }
+  output.write(FileDigestReply{.directory = req.directory, .id = req.id}, {res});
+}
+
+void Watcher::report_progress() {
+  if (is_ready || is_failed || !(capabilities & CAP_WATCH_PROGRESS)) {
+    return;
+  }
+  auto queued = get_queued_cnt();
+  if (!queued) {
+    is_ready = true;
+    broadcast(WatchReady{});
+    return;
+  }
+  auto now = ev_now(loop);
+  if (now - last_progress >= PROGRESS_INTERVAL) {
+    last_progress = now;
+    broadcast(WatchProgress{
+        .directory = nullptr,
+        .watched = get_watched_cnt(),
+        .queued = queued,
+    });
+  }
+}
+
+void send_listings(std::vector<CrawlResult> &results) {
+  std::erase_if(results, [](const CrawlResult &result) {
+    if (!(result.request.token & LISTING_TOKEN)) {
+      return false;
+    }
+    if (auto node = pending_listings.extract(result.request.token)) {
+      auto &listing = node.mapped();
+      listing.watcher->write_listing(*listing.output, listing.req, listing.rel_path, result,
+                                     false);
+    }
+    return true;
+  });
+}
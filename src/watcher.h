@@ -0,0 +1,221 @@
+#pragma once
+
+#include <ev.h>
+
+#include <cstdint>
+#include <initializer_list>
+#include <map>
+#include <memory>
+#include <set>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "config.h"
+#include "crawler.h"
+#include "dirty-set.h"
+#include "event-coalescer.h"
+#include "exclude-rules.h"
+#include "file-digest.h"
+#include "latency-stats.h"
+#include "output.h"
+#include "storm-detector.h"
+#include "write-settler.h"
+
+extern struct ev_loop *loop;
+
+// Whether recursive watches descend into other mounts, see --cross-mounts.
+extern bool cross_mounts;
+// How long events are held back to be coalesced, 0 sends them right away. See --coalesce-ms.
+extern ev_tstamp coalesce_window;
+// Events per directory and per watch in `storm_window` above which a subtree is reported as dirty
+// instead, 0 never does. See --storm-dir-events, --storm-watch-events and --storm-window-ms.
+extern uint32_t storm_dir_events, storm_watch_events;
+extern ev_tstamp storm_window;
+// Whether MODIFIED events of files whose digest was asked for are dropped if the contents stayed
+// the same. See --skip-unchanged.
+extern bool skip_unchanged;
+// How long a write to a file that is not closed is held back, 0 reports every write right away.
+// See --settle-ms and DirectorySettleRequest.
+extern ev_tstamp settle_window;
+
+// The FILE_NOTIFY_CHANGE_* bits that each kind of kernel event can stand for. Linux does not
+// tell a size change from any other write, and utimes() shows up as an attribute change. Reads
+// are not watched at all: they would flood the daemon, while atime rarely changes with relatime
+// and Windows does not update last access times by default either.
+const uint32_t NOTIFY_MODIFY = FILE_NOTIFY_CHANGE_SIZE | FILE_NOTIFY_CHANGE_LAST_WRITE;
+const uint32_t NOTIFY_ATTRIB = FILE_NOTIFY_CHANGE_ATTRIBUTES | FILE_NOTIFY_CHANGE_LAST_WRITE |
+                               FILE_NOTIFY_CHANGE_LAST_ACCESS | FILE_NOTIFY_CHANGE_CREATION |
+                               FILE_NOTIFY_CHANGE_SECURITY;
+
+struct Watcher;
+using PWatcher = std::shared_ptr<Watcher>;
+using WWatcher = std::weak_ptr<Watcher>;
+
+// A directory handle of a client that gets the events of a watch.
+struct Subscriber {
+  Output *output;
+  void *directory;
+  uint64_t credits = INITIAL_EVENT_CREDITS;
+  DirtySet overdrawn;  // directories with events dropped for lack of credits
+  uint64_t overdrawn_cnt = 0;
+};
+
+// Common part of a watch requested by clients. Backends derive from it and feed everything
+// they observe into send_event, which goes to every subscriber. Clients that ask for the same
+// watch with the same options share it, see Client::do_directory_watch.
+struct Watcher {
+  std::string path;
+  uint32_t filter;
+  bool recursive;
+  uint32_t capabilities;  // negotiated with the subscribers in the hello
+  std::vector<Subscriber> subscribers;
+  ExcludeRules excludes;
+  std::set<std::string> skipped_mounts;  // already reported to the client
+  bool is_failed = false;
+  bool is_ready = false;
+  ev_tstamp last_progress = 0;
+  EventCoalescer coalescer;
+  ev_timer coalesce_timer;  // runs while `coalescer` holds events
+  StormDetector storms;
+  ev_timer storm_timer;  // ends the windows of `storms` while it is not idle
+  DigestCache digests;
+  ev_tstamp settle_time;  // see `settle_window`, to be set before the watch starts
+  WriteSettler writes;
+  ev_timer settle_timer;  // runs while `writes` holds any
+  bool has_credits = false;  // whether events take credits, see EventCredits
+  LatencyStats latency;  // from reading events to handling them
+  // Reused by join and get_abs_path, so that events need no allocations of their own.
+  std::string joined_buf, abs_path_buf;
+
+  Watcher(std::string_view path_, uint32_t filter_, bool recursive_, uint32_t capabilities_);
+
+  virtual ~Watcher();
+
+  // Starts sending events to `directory` of the client behind `output`, and catches it up on
+  // what the other subscribers were told about the watch itself.
+  void subscribe(Output &output, void *directory);
+
+  void unsubscribe(Output &output, void *directory);
+
+  // Writes `msg` to every subscriber, with its `directory`.
+  template <typename T>
+  void broadcast(T msg, std::initializer_list<std::string_view> trailer = {}) {
+    for (auto &subscriber : subscribers) {
+      msg.directory = subscriber.directory;
+      subscriber.output->write(msg, trailer);
+    }
+  }
+
+  // The concatenation of `parts`, valid until the next call. None of the parts may point into
+  // the result of an earlier call.
+  const std::string &join(std::initializer_list<std::string_view> parts);
+
+  // Likewise, the absolute path of the file that `parts` make up relative to `path`.
+  const char *get_abs_path(std::initializer_list<std::string_view> parts);
+
+  // The filename is the concatenation of `parts`, which are written straight into the output.
+  void send_event(FileAction action, std::initializer_list<std::string_view> parts);
+
+  void send_event(FileAction action, std::string_view filename = "") {
+    send_event(action, {filename});
+  }
+
+  // A write to a file. With a `settle_time`, it is reported once the file is closed, or once the
+  // write is that old.
+  void report_write(std::initializer_list<std::string_view> parts);
+
+  // A file that was open for writing got closed.
+  void report_close_write(std::initializer_list<std::string_view> parts);
+
+  // Feeds the event into `storms`, returns whether it should be sent.
+  bool check_storm(std::initializer_list<std::string_view> parts);
+
+  // Drops the digest of the path, returns false if the event is a MODIFIED that left the
+  // contents as they were and `skip_unchanged` is set.
+  bool check_digest(FileAction action, std::initializer_list<std::string_view> parts);
+
+  // Writes the event to the output, as EventStat if the client asked for it.
+  void write_event(FileAction action, std::initializer_list<std::string_view> parts);
+
+  // Sends the events held back by `coalescer`.
+  void flush_events();
+
+  // Takes credits returned by a subscriber, and reports what was dropped without them.
+  void add_credits(Output &output, void *directory, uint32_t cnt);
+
+  // Tells the client to rescan `rel_path`, see SubtreeDirty.
+  void send_subtree_dirty(std::string_view rel_path);
+
+  // Whether the client asked for a change covered by `notify_filter`, see NOTIFY_*.
+  bool wants(uint32_t notify_filter) const {
+    return filter & notify_filter;
+  }
+
+  // Whether the client asked for names of files or directories to be reported, by `is_dir`.
+  bool wants_name(bool is_dir) const {
+    return wants(is_dir ? FILE_NOTIFY_CHANGE_DIR_NAME : FILE_NOTIFY_CHANGE_FILE_NAME);
+  }
+
+  void fail() {
+    send_event(FILE_ACTION_FAILED);
+  }
+
+  // The concatenation of `parts`, relative to `path` and without a trailing slash. Each mount is
+  // reported once.
+  void report_skipped_mount(std::initializer_list<std::string_view> parts);
+
+  // Answers a DirectoryListRequest for `rel_path`, which has no trailing slash. Directories
+  // that the watch has no cached listing of are listed by the crawler, see send_listings.
+  void send_listing(Output &output, const DirectoryListRequest &req, std::string_view rel_path);
+
+  // Sends the entries of `result`, the listing of `rel_path`, in DirectoryListChunks.
+  void write_listing(Output &output, const DirectoryListRequest &req, std::string_view rel_path,
+                     const CrawlResult &result, bool is_cached);
+
+  // Answers a FileDigestRequest for `paths`, which are separated by NULs.
+  void send_digests(Output &output, const FileDigestRequest &req, std::string_view paths);
+
+  // Sends WatchReady once nothing is left to crawl, and WatchProgress every now and then
+  // before that.
+  void report_progress();
+
+  virtual bool has_work() {
+    return false;
+  }
+
+  virtual void process_queue() {}
+
+  virtual uint64_t get_watched_cnt() {
+    return 0;
+  }
+
+  // Directories waiting for the crawl, whether they are still queued or being listed.
+  virtual uint64_t get_queued_cnt() {
+    return 0;
+  }
+
+  // Fills `result` like Crawler::list from what the watch knows about `rel_path`, if that is
+  // up to date. Types may be DT_UNKNOWN.
+  virtual bool get_cached_listing([[maybe_unused]] std::string_view rel_path,
+                                  [[maybe_unused]] CrawlResult &result) {
+    return false;
+  }
+
+  // Bytes spent on bookkeeping for this watch.
+  virtual size_t get_memory_usage() {
+    size_t res = sizeof(*this) + excludes.memory_usage() + coalescer.memory_usage() +
+                 storms.memory_usage() + digests.memory_usage() + writes.memory_usage() +
+                 subscribers.capacity() * sizeof(Subscriber);
+    for (const auto &subscriber : subscribers) {
+      res += subscriber.overdrawn.memory_usage();
+    }
+    return res;
+  }
+};
+
+// Every watch that is alive, whoever subscribed to it.
+extern std::set<Watcher *> watchers;
+
+// Answers the DirectoryListRequests that `results` has listings for, and takes those out.
+void send_listings(std::vector<CrawlResult> &results);
@@ -0,0 +1,10 @@
+#include "write-settler.h"
+
+size_t WriteSettler::memory_usage() const {
+  size_t res = held.bucket_count() * sizeof(void *) +
+               held.size() * (sizeof(std::pair<const std::string, ev_tstamp>) + sizeof(void *));
+  for (const auto &[path, since] : held) {
+    res += path.capacity();
+  }
+  return res;
+}
@@ -0,0 +1,60 @@
+#pragma once
+
+#include <ev.h>
+
+#include <cstdint>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+// Holds back the writes to the files of a watch until the files are closed, so that a file
+// written in many pieces is reported once. Files that stay open for long, like logs, are
+// reported once the write that is held back got old enough.
+class WriteSettler {
+  private:
+  std::unordered_map<std::string, ev_tstamp> held;  // path -> first write that is held back
+
+  public:
+  uint64_t write_cnt = 0, reported_cnt = 0;
+
+  bool empty() const {
+    return held.empty();
+  }
+
+  void write(const std::string &path, ev_tstamp now) {
+    ++write_cnt;
+    held.try_emplace(path, now);
+  }
+
+  // Returns whether the file was written to since it was last reported.
+  bool close(const std::string &path) {
+    return held.erase(path);
+  }
+
+  void forget(const std::string &path) {
+    held.erase(path);
+  }
+
+  // Calls f(path) for every file with a write held back since `before` or earlier, and forgets
+  // them.
+  template <typename F>
+  void expire(ev_tstamp before, F &&f);
+
+  size_t memory_usage() const;
+};
+
+template <typename F>
+void WriteSettler::expire(ev_tstamp before, F &&f) {
+  std::vector<std::string> expired;
+  std::erase_if(held, [&](const auto &item) {
+    if (item.second > before) {
+      return false;
+    }
+    expired.push_back(item.first);
+    return true;
+  });
+  for (const auto &path : expired) {
+    f(std::string_view{path});
+  }
+}
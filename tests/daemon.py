@@ -0,0 +1,188 @@
+# Talks to wsl-fs-notify over stdin and stdout the way the DLL does, see src/config.h for the
+# messages. Shared by the protocol tests and the benchmarks in bench/.
+import os
+import select
+import signal
+import struct
+import subprocess
+import time
+
+CLIENT_HELLO = b'WFN\n\0'
+SERVER_HELLO = b'WFN\n\1'
+
+CAP_WATCH_PROGRESS = 1 << 0
+CAP_EXCLUDE_RULES = 1 << 1
+CAP_MOUNT_SKIPPED = 1 << 2
+CAP_SUBTREE_DIRTY = 1 << 3
+CAP_EVENT_STAT = 1 << 4
+CAP_DIRECTORY_LIST = 1 << 5
+CAP_FILE_DIGEST = 1 << 6
+CAP_SETTLE_WRITES = 1 << 7
+CAP_EVENT_CREDITS = 1 << 8
+
+INITIAL_EVENT_CREDITS = 4096
+
+FILE_ACTION_FAILED = -1
+FILE_ACTION_ADDED = 1
+FILE_ACTION_REMOVED = 2
+FILE_ACTION_MODIFIED = 3
+FILE_ACTION_RENAMED_OLD_NAME = 4
+FILE_ACTION_RENAMED_NEW_NAME = 5
+
+FILE_NOTIFY_CHANGE_FILE_NAME = 0x01
+FILE_NOTIFY_CHANGE_DIR_NAME = 0x02
+FILE_NOTIFY_CHANGE_ATTRIBUTES = 0x04
+FILE_NOTIFY_CHANGE_LAST_WRITE = 0x10
+DEFAULT_FILTER = 0x17f
+
+
+class Daemon:
+    def __init__(self, binary, args=(), capabilities=0):
+        self.process = subprocess.Popen([binary, *args], stdin=subprocess.PIPE,
+                                        stdout=subprocess.PIPE)
+        self.buff = b''
+        self.send(CLIENT_HELLO + struct.pack('<I', capabilities))
+        hello = self.recv(5)
+        if hello is None or hello[:5] != SERVER_HELLO:
+            raise RuntimeError('no hello from the daemon')
+        self.capabilities = struct.unpack('<I', hello[5:9])[0] if len(hello) >= 9 else 0
+
+    def send(self, body):
+        self.process.stdin.write(struct.pack('<Q', len(body)) + body)
+        self.process.stdin.flush()
+
+    def watch(self, handle, path, recursive=True, filter=DEFAULT_FILTER):
+        self.send(b'D' + struct.pack('<QIB', handle, filter, recursive) + path.encode())
+
+    def exclude(self, handle, rules):
+        """Sets the rules for the following watch of `handle`."""
+        self.send(b'X' + struct.pack('<Q', handle) + rules.encode())
+
+    def settle(self, handle, settle_ms):
+        """Sets the settle time for the following watch of `handle`."""
+        self.send(b'W' + struct.pack('<QI', handle, settle_ms))
+
+    def unwatch(self, handle):
+        self.send(b'S' + struct.pack('<Q', handle))
+
+    def list(self, handle, request_id, rel_path=''):
+        self.send(b'L' + struct.pack('<QQB', handle, request_id, 0) + rel_path.encode())
+
+    def digest(self, handle, request_id, rel_paths):
+        self.send(b'H' + struct.pack('<QQ', handle, request_id) +
+                  b''.join(path.encode() + b'\0' for path in rel_paths))
+
+    def credit(self, handle, credits):
+        self.send(b'C' + struct.pack('<QI', handle, credits))
+
+    def recv(self, timeout=2):
+        """The body of the next message, or None if none arrived in time."""
+        deadline = time.monotonic() + timeout
+        while True:
+            if len(self.buff) >= 8:
+                length = struct.unpack('<Q', self.buff[:8])[0]
+                if len(self.buff) >= 8 + length:
+                    msg = self.buff[8:8 + length]
+                    self.buff = self.buff[8 + length:]
+                    return msg
+            left = deadline - time.monotonic()
+            if left <= 0 or not select.select([self.process.stdout], [], [], left)[0]:
+                return None
+            data = os.read(self.process.stdout.fileno(), 1 << 16)
+            if not data:
+                return None
+            self.buff += data
+
+    def recv_until(self, predicate, timeout=5):
+        """Messages up to and including the first one that `predicate` accepts."""
+        res = []
+        deadline = time.monotonic() + timeout
+        while (left := deadline - time.monotonic()) > 0:
+            msg = self.recv(left)
+            if msg is None:
+                break
+            res.append(msg)
+            if predicate(msg):
+                return res
+        raise TimeoutError('gave up after %d messages' % len(res))
+
+    def wait_ready(self, handle, timeout=10):
+        self.recv_until(lambda msg: msg[:1] == b'R' and parse_handle(msg) == handle, timeout)
+
+    def events(self, timeout=0.5):
+        """(handle, action, path) of the events until none came for `timeout`."""
+        res = []
+        while (msg := self.recv(timeout)) is not None:
+            if msg[:1] == b'U':
+                res.append(parse_event(msg))
+        return res
+
+    def stats(self):
+        self.process.send_signal(signal.SIGUSR1)
+
+    def close(self):
+        self.process.stdin.close()
+        return self.process.wait(10)
+
+
+def parse_handle(msg):
+    return struct.unpack('<Q', msg[1:9])[0]
+
+
+def parse_progress(msg):
+    """(handle, watched, queued) of a WatchProgress."""
+    return struct.unpack('<QQQ', msg[1:25])
+
+
+def parse_mount(msg):
+    """(handle, path) of a MountSkipped."""
+    return parse_handle(msg), msg[9:].decode()
+
+
+def parse_event_stat(msg):
+    """(handle, action, path, (mode, size, allocated, ino, btime, mtime, ctime, atime)) of an
+    EventStat."""
+    handle, action = struct.unpack('<QI', msg[1:13])
+    stat = struct.unpack('<IQQQqqqq', msg[13:73])
+    return handle, FILE_ACTION_FAILED if action == 0xffffffff else action, msg[73:].decode(), stat
+
+
+def parse_subtree(msg):
+    """(handle, path) of a SubtreeDirty."""
+    return parse_handle(msg), msg[9:].decode()
+
+
+def parse_event(msg):
+    handle, action = struct.unpack('<QI', msg[1:13])
+    return handle, FILE_ACTION_FAILED if action == 0xffffffff else action, msg[13:].decode()
+
+
+def parse_listing(msg):
+    """(id, error, is_last, names) of a DirectoryListChunk without stats."""
+    request_id, error, is_last = struct.unpack('<QI?', msg[9:22])
+    names, pos = [], 23
+    while pos < len(msg):
+        name_length = struct.unpack('<I', msg[pos + 4:pos + 8])[0]
+        names.append(msg[pos + 8:pos + 8 + name_length].decode())
+        pos += 8 + name_length
+    return request_id, error, is_last, names
+
+
+def parse_digests(msg):
+    """(id, [(digest, size, mtime, error)]) of a FileDigestReply."""
+    request_id = struct.unpack('<Q', msg[9:17])[0]
+    data = msg[17:]
+    return request_id, [struct.unpack('<QQqI', data[pos:pos + 28])
+                        for pos in range(0, len(data), 28)]
+
+
+def get_cpu_time(pid):
+    fields = open('/proc/%d/stat' % pid).read().rsplit(')', 1)[1].split()
+    return (int(fields[11]) + int(fields[12])) / os.sysconf('SC_CLK_TCK')
+
+
+def get_rss_kb(pid):
+    for line in open('/proc/%d/status' % pid):
+        if line.startswith('VmRSS:'):
+            return int(line.split()[1])
+    return 0
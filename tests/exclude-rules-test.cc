@@ -0,0 +1,122 @@
+// Matches paths against sets of rules and compares with what gitignore does for them.
+#include <cstdio>
+#include <string>
+
+#include "exclude-rules.h"
+
+namespace {
+  struct Case {
+    const char *path;
+    bool is_dir;
+    bool is_excluded;
+  };
+
+  int failed = 0;
+
+  void check(std::string_view rules, std::initializer_list<Case> cases) {
+    ExcludeRules excludes;
+    excludes.compile(rules);
+    // Twice, the second time with the DFA states from the first.
+    for (int round = 0; round < 2; round++) {
+      for (auto &c : cases) {
+        std::string_view path = c.path;
+        auto slash = path.rfind('/');
+        // Watchers pass the relative path of the parent with a trailing slash and the name.
+        auto parent = slash == path.npos ? std::string_view{} : path.substr(0, slash + 1);
+        if (excludes.is_excluded({parent, path.substr(parent.size())}, c.is_dir) !=
+            c.is_excluded) {
+          ++failed;
+          printf("rules \"%.*s\": %s%s should %sbe excluded\n", (int) rules.size(),
+                 rules.data(), c.path, c.is_dir ? "/" : "", c.is_excluded ? "" : "not ");
+        }
+      }
+    }
+  }
+}  // namespace
+
+int main() {
+  check("", {
+                {"a", false, false},
+                {"a/b", true, false},
+            });
+  check("# comment\n\n  \n", {
+                                 {"# comment", false, false},
+                             });
+  // Names without a slash match at any depth.
+  check("build\n*.o\n", {
+                            {"build", true, true},
+                            {"src/build", true, true},
+                            {"src/build/x", false, true},
+                            {"builder", true, false},
+                            {"x.o", false, true},
+                            {"src/deep/x.o", false, true},
+                            {"x.o.d", false, false},
+                            {"src", true, false},
+                        });
+  // A slash anywhere but at the end anchors the rule at the root.
+  check("/out\nsrc/gen\n", {
+                               {"out", true, true},
+                               {"out/x", false, true},
+                               {"sub/out", true, false},
+                               {"src/gen", true, true},
+                               {"lib/src/gen", true, false},
+                           });
+  check("tmp/\n", {
+                      {"tmp", true, true},
+                      {"tmp", false, false},
+                      {"a/tmp", true, true},
+                      {"a/tmp/file", false, true},
+                  });
+  check("a?c\n[0-9]x\n[!a]y\n[]]z\n", {
+                                          {"abc", false, true},
+                                          {"a/c", false, false},
+                                          {"ac", false, false},
+                                          {"5x", false, true},
+                                          {"ax", false, false},
+                                          {"by", false, true},
+                                          {"ay", false, false},
+                                          {"]z", false, true},
+                                      });
+  // '*' stops at slashes, '**' does not.
+  check("/doc/*.html\n**/cache\nlogs/**\na/**/z\n", {
+                                                       {"doc/x.html", false, true},
+                                                       {"doc/sub/x.html", false, false},
+                                                       {"cache", true, true},
+                                                       {"x/y/cache", true, true},
+                                                       {"logs", true, false},
+                                                       {"logs/x", false, true},
+                                                       {"logs/x/y", false, true},
+                                                       {"a/z", false, true},
+                                                       {"a/b/c/z", false, true},
+                                                       {"b/a/z", false, false},
+                                                   });
+  // The last matching rule wins, but nothing below an excluded directory comes back.
+  check("*.log\n!keep.log\nvendor/\n!vendor/x\n", {
+                                                      {"a.log", false, true},
+                                                      {"keep.log", false, false},
+                                                      {"sub/keep.log", false, false},
+                                                      {"vendor", true, true},
+                                                      {"vendor/x", false, true},
+                                                  });
+  // An unclosed '[' is literal.
+  check("a[b\n", {
+                     {"a[b", false, true},
+                     {"ab", false, false},
+                 });
+  // Many rules share one automaton.
+  std::string many;
+  for (int i = 0; i < 2000; i++) {
+    many += "/dir" + std::to_string(i) + "/*.tmp\n";
+  }
+  check(many, {
+                  {"dir0/x.tmp", false, true},
+                  {"dir1999/x.tmp", false, true},
+                  {"dir2000/x.tmp", false, false},
+                  {"dir5/x.txt", false, false},
+              });
+
+  if (failed) {
+    return 1;
+  }
+  puts("ok");
+}
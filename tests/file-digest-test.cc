@@ -0,0 +1,56 @@
+// Compares Hasher with digests from the reference xxHash implementation, for inputs fed at once
+// and in pieces that split its 32-byte stripes anywhere.
+#include <cinttypes>
+#include <cstdio>
+#include <string>
+
+#include "file-digest.h"
+
+namespace {
+  struct Case {
+    size_t length;
+    uint64_t seed;
+    uint64_t digest;  // xxhash.xxh64(data(length), seed) in Python
+  };
+
+  const Case CASES[] = {
+      {0, 0, 0xef46db3751d8e999},      {1, 0, 0x1f25c8d0bc1f4bb6},
+      {3, 0, 0x31d2363f52e564c9},      {4, 0, 0x9bb64b7d66ee9fda},
+      {8, 0, 0xdab99d95c6f90092},      {31, 0, 0xa2aa5f33cc4a6119},
+      {32, 0, 0x23c3c17ef790fd97},     {33, 0, 0x50a7cfc7ba588784},
+      {63, 0, 0x5e3e54b431c7493c},     {100, 0, 0xa61f8d4c170fe531},
+      {1000, 0, 0x5f235fa033f1a3fb},   {100003, 0, 0x924a64f3ae9ea839},
+      {100, 12345, 0xacb8a02891fea7d2},
+  };
+
+  std::string make_data(size_t length) {
+    std::string data(length, '\0');
+    for (size_t i = 0; i < length; i++) {
+      data[i] = (char) ((i * 7 + 3) & 0xff);
+    }
+    return data;
+  }
+}  // namespace
+
+int main() {
+  int failed = 0;
+  for (auto &c : CASES) {
+    auto data = make_data(c.length);
+    for (size_t piece : {data.size() + 1, (size_t) 1, (size_t) 7, (size_t) 33, (size_t) 4096}) {
+      Hasher hasher{c.seed};
+      for (size_t pos = 0; pos < data.size(); pos += piece) {
+        hasher.update(std::string_view{data}.substr(pos, piece));
+      }
+      if (hasher.digest() != c.digest) {
+        ++failed;
+        printf("%zu bytes with seed %" PRIu64 " in pieces of %zu: %016" PRIx64
+               " instead of %016" PRIx64 "\n",
+               c.length, c.seed, piece, hasher.digest(), c.digest);
+      }
+    }
+  }
+  if (failed) {
+    return 1;
+  }
+  puts("ok");
+}
@@ -0,0 +1,86 @@
+// Splits streams of messages that arrive in pieces of various sizes and checks that every message
+// comes out whole, including the ones that wrap around the end of the ring and the ones that
+// make it grow while its data wraps.
+#include <cassert>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <vector>
+
+#include "message.h"
+
+namespace {
+  std::string make_body(size_t length, int seed) {
+    std::string body(length, '\0');
+    for (size_t i = 0; i < length; i++) {
+      body[i] = (char) ((seed * 31 + i * 7) & 0xff);
+    }
+    return body;
+  }
+
+  void append(std::string &wire, const std::string &body) {
+    uint64_t length = body.size();
+    wire.append((const char *) &length, sizeof(length));
+    wire += body;
+  }
+
+  // Feeds `wire` in pieces of `piece` bytes, or through prepare()/commit() with `use_prepare`,
+  // and takes the messages out after each piece.
+  void check_split(const std::vector<std::string> &bodies, size_t piece, bool use_prepare) {
+    std::string wire;
+    for (auto &body : bodies) {
+      append(wire, body);
+    }
+
+    MessageStream stream;
+    size_t next = 0;
+    for (size_t pos = 0; pos < wire.size();) {
+      size_t length = std::min(piece, wire.size() - pos);
+      if (use_prepare) {
+        auto space = stream.prepare(length);
+        assert(!space.empty());
+        length = std::min(length, space.size());
+        memcpy(space.data(), wire.data() + pos, length);
+        stream.commit(length);
+      } else {
+        stream.feed(wire.data() + pos, length);
+      }
+      pos += length;
+
+      while (auto msg = stream.get_message()) {
+        assert(next < bodies.size());
+        assert(msg->length == bodies[next].size());
+        assert(!memcmp(msg->data, bodies[next].data(), msg->length));
+        ++next;
+      }
+    }
+    assert(next == bodies.size());
+    assert(!stream.has_message());
+  }
+}
+
+int main() {
+  // Lengths that do not divide the initial 4 KiB ring, so that message boundaries land
+  // everywhere, including inside the length prefix.
+  std::vector<std::string> small;
+  for (int i = 0; i < 2000; i++) {
+    small.push_back(make_body((i * 37) % 300, i));
+  }
+  // Messages larger than the ring while older data still wraps around its end.
+  std::vector<std::string> mixed;
+  for (int i = 0; i < 200; i++) {
+    mixed.push_back(make_body(i % 10 == 9 ? 4096 * (1 + i % 3) + 5 : (i * 53) % 700, i));
+  }
+  // Empty bodies only carry the length.
+  std::vector<std::string> empty(100);
+
+  for (size_t piece : {1, 7, 1000, 4093, 4096, 65536}) {
+    for (bool use_prepare : {false, true}) {
+      check_split(small, piece, use_prepare);
+      check_split(mixed, piece, use_prepare);
+      check_split(empty, piece, use_prepare);
+    }
+  }
+  puts("ok");
+}
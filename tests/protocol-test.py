@@ -0,0 +1,672 @@
+#!/usr/bin/env python3
+# Runs the scenarios below against a daemon over the stdio protocol.
+#
+#   protocol-test.py path/to/wsl-fs-notify --backend=inotify|fanotify [scenario...]
+#
+# Recursive watches use fanotify with --backend=fanotify if the kernel lets this process use it
+# on the test directory, otherwise the test is skipped with exit code 77.
+import ctypes
+import os
+import shutil
+import signal
+import stat
+import subprocess
+import sys
+import tempfile
+import time
+
+from daemon import *
+
+SKIPPED = 77
+
+binary = None
+backend_args = []
+is_fanotify = False
+scenarios = []
+
+
+class Skipped(Exception):
+    pass
+
+
+def scenario(fn):
+    scenarios.append(fn)
+    return fn
+
+
+def start(root, capabilities=0, recursive=True, filter=DEFAULT_FILTER, args=()):
+    daemon = Daemon(binary, backend_args + list(args), capabilities | CAP_WATCH_PROGRESS)
+    daemon.watch(1, root, recursive, filter)
+    daemon.wait_ready(1)
+    return daemon
+
+
+def expect_events(daemon, expected, timeout=5):
+    """Waits for `expected` (action, path) events of handle 1 to come in this order, others may
+    come in between."""
+    got = []
+    deadline = time.monotonic() + timeout
+    left = list(expected)
+    while left and time.monotonic() < deadline:
+        msg = daemon.recv(deadline - time.monotonic())
+        if msg is None:
+            break
+        if msg[:1] != b'U':
+            continue
+        handle, action, path = parse_event(msg)
+        got.append((action, path))
+        if handle == 1 and (action, path) == left[0]:
+            left.pop(0)
+    assert not left, 'missing %s, got %s' % (left, got)
+    return got
+
+
+def renamed(old, new):
+    """The events of a move in recursive watches, which fanotify cannot pair up."""
+    if is_fanotify:
+        return [(FILE_ACTION_REMOVED, old), (FILE_ACTION_ADDED, new)]
+    return [(FILE_ACTION_RENAMED_OLD_NAME, old), (FILE_ACTION_RENAMED_NEW_NAME, new)]
+
+
+@scenario
+def files_in_tree(root):
+    os.mkdir(root + '/sub')
+    daemon = start(root)
+    open(root + '/sub/file', 'w').close()
+    with open(root + '/sub/file', 'a') as f:
+        f.write('contents')
+    # fanotify merges queued events of a name, which loses their order.
+    expect_events(daemon, [(FILE_ACTION_ADDED, 'sub/file'), (FILE_ACTION_MODIFIED, 'sub/file')])
+    os.unlink(root + '/sub/file')
+    open(root + '/top', 'w').close()
+    expect_events(daemon, [(FILE_ACTION_REMOVED, 'sub/file'), (FILE_ACTION_ADDED, 'top')])
+    daemon.close()
+
+
+@scenario
+def rename(root):
+    os.mkdir(root + '/sub')
+    open(root + '/old', 'w').close()
+    daemon = start(root)
+    os.rename(root + '/old', root + '/sub/new')
+    expect_events(daemon, renamed('old', 'sub/new'))
+    os.rename(root + '/sub', root + '/moved')
+    open(root + '/moved/file', 'w').close()
+    expect_events(daemon, renamed('sub', 'moved') + [(FILE_ACTION_ADDED, 'moved/file')])
+    # Moves out of and into the watch have only one end in it. The removal waits for the rest
+    # of the move, while other names go through.
+    os.rename(root + '/moved/file', os.path.dirname(root) + '/outside')
+    os.rename(os.path.dirname(root) + '/outside', root + '/back')
+    got = daemon.events()
+    assert (1, FILE_ACTION_REMOVED, 'moved/file') in got and (1, FILE_ACTION_ADDED, 'back') in got
+    # A name that a move left and that comes back right away is not left removed.
+    os.rename(root + '/back', os.path.dirname(root) + '/outside')
+    open(root + '/back', 'w').close()
+    expect_events(daemon, [(FILE_ACTION_REMOVED, 'back'), (FILE_ACTION_ADDED, 'back')])
+    os.unlink(os.path.dirname(root) + '/outside')
+    # Directories below a moved one are known by their new path.
+    os.makedirs(root + '/outer/inner')
+    open(root + '/outer/inner/before', 'w').close()
+    expect_events(daemon, [(FILE_ACTION_ADDED, 'outer/inner/before')])
+    os.rename(root + '/outer', root + '/renamed')
+    open(root + '/renamed/inner/after', 'w').close()
+    expect_events(daemon, renamed('outer', 'renamed') + [(FILE_ACTION_ADDED, 'renamed/inner/after')])
+    daemon.close()
+
+
+@scenario
+def rename_under_load(root):
+    os.mkdir(root + '/files')
+    for i in range(300):
+        open('%s/files/a%d' % (root, i), 'w').close()
+    daemon = start(root)
+    # Other processes writing at the same time may get their events between the two halves of a
+    # rename, at least on machines with more than one CPU.
+    writers = []
+    for k in range(4):
+        os.mkdir('%s/busy%d' % (root, k))
+        writers.append(subprocess.Popen([
+            sys.executable, '-c',
+            'import sys\nwhile True:\n  for i in range(50):\n'
+            '    open("%s/f%d" % (sys.argv[1], i), "w").write("x")',
+            '%s/busy%d' % (root, k)]))
+    try:
+        time.sleep(0.1)
+        for i in range(300):
+            os.rename('%s/files/a%d' % (root, i), '%s/files/b%d' % (root, i))
+    finally:
+        for writer in writers:
+            writer.kill()
+            writer.wait()
+    got = set(daemon.events(1))
+    missing = [i for i in range(300)
+               if any((1, action, path) not in got
+                      for action, path in renamed('files/a%d' % i, 'files/b%d' % i))]
+    assert not missing, '%d renames missing' % len(missing)
+    daemon.close()
+
+
+@scenario
+def new_directories(root):
+    daemon = start(root)
+    os.makedirs(root + '/a/b')
+    time.sleep(0.2)
+    open(root + '/a/b/file', 'w').close()
+    expect_events(daemon, [(FILE_ACTION_ADDED, 'a'), (FILE_ACTION_ADDED, 'a/b/file')])
+    shutil.rmtree(root + '/a')
+    expect_events(daemon, [(FILE_ACTION_REMOVED, 'a/b/file'), (FILE_ACTION_REMOVED, 'a')])
+    daemon.close()
+
+
+@scenario
+def progress(root):
+    for i in range(20):
+        os.makedirs('%s/d%d/%s' % (root, i, '/'.join('n%d' % k for k in range(20))))
+    daemon = Daemon(binary, backend_args, CAP_WATCH_PROGRESS)
+    assert daemon.capabilities == CAP_WATCH_PROGRESS, daemon.capabilities
+    daemon.watch(1, root)
+    msgs = daemon.recv_until(lambda msg: msg[:1] == b'R')
+    progress = [parse_progress(msg) for msg in msgs if msg[:1] == b'P']
+    assert all(handle == 1 and queued for handle, watched, queued in progress), progress
+    # Ready means that the deepest directories have their watches too.
+    deepest = 'd19/' + '/'.join('n%d' % k for k in range(20)) + '/file'
+    open(root + '/' + deepest, 'w').close()
+    expect_events(daemon, [(FILE_ACTION_ADDED, deepest)], timeout=0.5)
+    daemon.close()
+
+
+@scenario
+def no_progress(root):
+    daemon = Daemon(binary, backend_args)
+    assert daemon.capabilities == 0, daemon.capabilities
+    daemon.watch(1, root)
+    time.sleep(0.2)
+    open(root + '/file', 'w').close()
+    msgs = daemon.recv_until(lambda msg: msg[:1] == b'U')
+    assert all(msg[:1] == b'U' for msg in msgs), msgs
+    daemon.close()
+
+
+@scenario
+def non_recursive(root):
+    os.mkdir(root + '/sub')
+    daemon = start(root, recursive=False)
+    open(root + '/sub/file', 'w').close()
+    open(root + '/top', 'w').close()
+    got = expect_events(daemon, [(FILE_ACTION_ADDED, 'top')])
+    assert (FILE_ACTION_ADDED, 'sub/file') not in got + daemon.events(), got
+    daemon.close()
+
+
+@scenario
+def name_filter(root):
+    open(root + '/file', 'w').close()
+    daemon = start(root, filter=FILE_NOTIFY_CHANGE_FILE_NAME)
+    with open(root + '/file', 'a') as f:
+        f.write('contents')
+    os.mkdir(root + '/dir')
+    open(root + '/other', 'w').close()
+    got = expect_events(daemon, [(FILE_ACTION_ADDED, 'other')])
+    got += daemon.events()
+    assert (FILE_ACTION_MODIFIED, 'file') not in got, got
+    assert (FILE_ACTION_ADDED, 'dir') not in got, got
+    daemon.close()
+
+
+@scenario
+def attribute_filter(root):
+    os.mkdir(root + '/sub')
+    open(root + '/sub/file', 'w').close()
+    daemon = start(root, filter=FILE_NOTIFY_CHANGE_ATTRIBUTES)
+    open(root + '/sub/new', 'w').close()
+    os.chmod(root + '/sub/file', 0o600)
+    got = expect_events(daemon, [(FILE_ACTION_MODIFIED, 'sub/file')])
+    assert (FILE_ACTION_ADDED, 'sub/new') not in got + daemon.events(), got
+    daemon.close()
+
+
+@scenario
+def exclude_rules(root):
+    for path in ('build', 'src', 'src/gen'):
+        os.mkdir(root + '/' + path)
+    daemon = Daemon(binary, backend_args, CAP_WATCH_PROGRESS | CAP_EXCLUDE_RULES)
+    assert daemon.capabilities & CAP_EXCLUDE_RULES, daemon.capabilities
+    daemon.exclude(1, 'build/\n/src/gen\n*.o\n!keep.o\n')
+    daemon.watch(1, root)
+    daemon.wait_ready(1)
+    for path in ('build/x', 'src/gen/x', 'src/a.o', 'src/keep.o', 'src/a.c'):
+        open(root + '/' + path, 'w').close()
+    # Excluded directories that show up later are skipped too.
+    os.mkdir(root + '/src/build')
+    time.sleep(0.2)
+    open(root + '/src/build/x', 'w').close()
+    open(root + '/top', 'w').close()
+    got = expect_events(daemon, [(FILE_ACTION_ADDED, 'src/keep.o'), (FILE_ACTION_ADDED, 'src/a.c'),
+                                 (FILE_ACTION_ADDED, 'top')])
+    got += [(action, path) for handle, action, path in daemon.events()]
+    excluded = [path for action, path in got
+                if path.startswith(('build', 'src/gen', 'src/build')) or path == 'src/a.o']
+    assert not excluded, got
+    daemon.close()
+
+
+@scenario
+def mount_skipped(root):
+    os.mkdir(root + '/mnt')
+    if subprocess.run(['mount', '-t', 'tmpfs', 'none', root + '/mnt'],
+                      stderr=subprocess.DEVNULL).returncode:
+        raise Skipped('cannot mount a tmpfs')
+    try:
+        os.mkdir(root + '/mnt/sub')
+        daemon = Daemon(binary, backend_args, CAP_WATCH_PROGRESS | CAP_MOUNT_SKIPPED)
+        daemon.watch(1, root)
+        msgs = daemon.recv_until(lambda msg: msg[:1] == b'R')
+        mounts = [parse_mount(msg) for msg in msgs if msg[:1] == b'M']
+        assert mounts == [(1, 'mnt')], mounts
+        open(root + '/mnt/sub/file', 'w').close()
+        open(root + '/top', 'w').close()
+        got = expect_events(daemon, [(FILE_ACTION_ADDED, 'top')])
+        assert (FILE_ACTION_ADDED, 'mnt/sub/file') not in got + daemon.events(), got
+        daemon.close()
+
+        # --cross-mounts watches them like any other directory.
+        daemon = Daemon(binary, backend_args + ['--cross-mounts'], CAP_WATCH_PROGRESS)
+        daemon.watch(1, root)
+        daemon.wait_ready(1)
+        open(root + '/mnt/sub/other', 'w').close()
+        expect_events(daemon, [(FILE_ACTION_ADDED, 'mnt/sub/other')])
+        daemon.close()
+    finally:
+        subprocess.run(['umount', root + '/mnt'])
+
+
+@scenario
+def overflow(root):
+    os.mkdir(root + '/sub')
+    open(root + '/sub/changed', 'w').close()
+    open(root + '/gone', 'w').close()
+    for name in ('backdated', 'resized'):
+        open(root + '/' + name, 'w').write('contents')
+        os.utime(root + '/' + name, ns=(10**18, 10**18))
+    daemon = start(root)
+    # Enough events to overflow the queue of the kernel while the daemon cannot read them.
+    cnt = int(open('/proc/sys/fs/inotify/max_queued_events').read()) + 1000
+    daemon.process.send_signal(signal.SIGSTOP)
+    try:
+        for i in range(cnt):
+            open('%s/sub/f%d' % (root, i), 'w').close()
+        os.unlink(root + '/gone')
+        time.sleep(0.01)
+        with open(root + '/sub/changed', 'a') as f:
+            f.write('contents')
+        # Like cp -p or unpacking an archive.
+        open(root + '/backdated', 'w').write('other contents')
+        os.utime(root + '/backdated', ns=(10**17, 10**17))
+        open(root + '/resized', 'a').write('more')
+        os.utime(root + '/resized', ns=(10**18, 10**18))
+    finally:
+        daemon.process.send_signal(signal.SIGCONT)
+    got = daemon.events(2)
+    if is_fanotify:
+        # There is no tree to rescan.
+        assert (1, FILE_ACTION_FAILED, '') in got, got[-10:]
+    else:
+        got = set(got)
+        missing = [i for i in range(cnt) if (1, FILE_ACTION_ADDED, 'sub/f%d' % i) not in got]
+        assert not missing, '%d files missing' % len(missing)
+        assert (1, FILE_ACTION_REMOVED, 'gone') in got
+        assert (1, FILE_ACTION_MODIFIED, 'sub/changed') in got
+        assert (1, FILE_ACTION_MODIFIED, 'backdated') in got
+        assert (1, FILE_ACTION_MODIFIED, 'resized') in got
+    daemon.close()
+
+
+@scenario
+def coalescing(root):
+    open(root + '/old', 'w').close()
+    daemon = start(root, args=['--coalesce-ms=300'])
+    with open(root + '/file', 'w') as f:
+        for i in range(5):
+            f.write('contents')
+            f.flush()
+    open(root + '/temp', 'w').close()
+    os.unlink(root + '/temp')
+    os.unlink(root + '/old')
+    got = [(action, path) for handle, action, path in daemon.events(1)]
+    assert got == [(FILE_ACTION_ADDED, 'file'), (FILE_ACTION_REMOVED, 'old')], got
+    daemon.close()
+
+
+@scenario
+def subtree_dirty(root):
+    os.mkdir(root + '/sub')
+    args = ['--storm-dir-events=50', '--storm-window-ms=300']
+    daemon = start(root, CAP_SUBTREE_DIRTY, args=args)
+    for i in range(200):
+        open('%s/sub/f%d' % (root, i), 'w').close()
+    open(root + '/top', 'w').close()
+    msgs = daemon.recv_until(lambda msg: msg[:1] == b'U' and parse_event(msg)[2] == 'top')
+    dirty = [parse_subtree(msg) for msg in msgs if msg[:1] == b'O']
+    assert dirty == [(1, 'sub')], dirty
+    events = [msg for msg in msgs if msg[:1] == b'U']
+    assert len(events) < 100, len(events)
+    # Events were suppressed after the first notification, so another one follows the storm.
+    msgs = daemon.recv_until(lambda msg: msg[:1] == b'O')
+    assert parse_subtree(msgs[-1]) == (1, 'sub'), msgs
+    time.sleep(0.4)
+    open(root + '/sub/calm', 'w').close()
+    expect_events(daemon, [(FILE_ACTION_ADDED, 'sub/calm')])
+    daemon.close()
+
+    # Clients without the capability get every event.
+    daemon = start(root, args=args)
+    for i in range(200):
+        os.unlink('%s/sub/f%d' % (root, i))
+    got = daemon.events()
+    assert len(got) == 200, len(got)
+    daemon.close()
+
+
+@scenario
+def event_stat(root):
+    daemon = start(root, CAP_EVENT_STAT)
+    assert daemon.capabilities & CAP_EVENT_STAT, daemon.capabilities
+    os.mkdir(root + '/dir')
+    with open(root + '/file', 'w') as f:
+        f.write('contents')
+    msgs = daemon.recv_until(lambda msg: msg[:1] == b'E' and parse_event_stat(msg)[2] == 'file')
+    time.sleep(0.2)
+    os.unlink(root + '/file')
+    msgs += daemon.recv_until(lambda msg: msg[:1] == b'E' and parse_event_stat(msg)[1] == 2)
+    assert not [msg for msg in msgs if msg[:1] == b'U'], msgs
+    events = {(action, path): stat_ for handle, action, path, stat_ in
+              (parse_event_stat(msg) for msg in msgs if msg[:1] == b'E')}
+
+    st = os.stat(root + '/dir')
+    mode, size, allocated, ino, btime, mtime, ctime, atime = events[(FILE_ACTION_ADDED, 'dir')]
+    assert stat.S_ISDIR(mode) and ino == st.st_ino and mtime == st.st_mtime_ns, events
+    mode, size, allocated, ino, btime, mtime, ctime, atime = events[(FILE_ACTION_ADDED, 'file')]
+    assert stat.S_ISREG(mode) and ino and mtime and ctime, events
+    assert events[(FILE_ACTION_MODIFIED, 'file')][1] == 8, events
+    # Removals come with zeros.
+    assert events[(FILE_ACTION_REMOVED, 'file')] == (0,) * 8, events
+    daemon.close()
+
+
+@scenario
+def settle_writes(root):
+    for name in ('closed', 'log', 'gone'):
+        open(root + '/' + name, 'w').close()
+    daemon = Daemon(binary, backend_args, CAP_WATCH_PROGRESS | CAP_SETTLE_WRITES)
+    daemon.settle(1, 600)
+    daemon.watch(1, root)
+    daemon.wait_ready(1)
+
+    def modified(got):
+        return [path for handle, action, path in got if action == FILE_ACTION_MODIFIED]
+
+    # Writes are reported once the file is closed.
+    with open(root + '/closed', 'w') as f:
+        for i in range(5):
+            f.write('contents')
+            f.flush()
+        assert not modified(daemon.events(0.3))
+    assert modified(daemon.events(0.3)) == ['closed']
+
+    # Or once they are older than the settle time while the file stays open.
+    with open(root + '/log', 'a') as f, open(root + '/gone', 'a') as g:
+        f.write('line\n')
+        f.flush()
+        g.write('line\n')
+        g.flush()
+        # Removals drop the held write.
+        os.unlink(root + '/gone')
+        start = time.monotonic()
+        got = expect_events(daemon, [(FILE_ACTION_REMOVED, 'gone'), (FILE_ACTION_MODIFIED, 'log')])
+        assert time.monotonic() - start > 0.3 and (FILE_ACTION_MODIFIED, 'gone') not in got, got
+        assert modified(daemon.events(0.3)) == [], got
+    daemon.close()
+
+
+@scenario
+def event_credits(root):
+    os.mkdir(root + '/sub')
+    for i in range(300):
+        os.mkdir('%s/d%d' % (root, i))
+    # Without storms, which would take over before the credits run out.
+    daemon = start(root, CAP_SUBTREE_DIRTY | CAP_EVENT_CREDITS,
+                   args=['--storm-dir-events=0', '--storm-watch-events=0'])
+    cnt = INITIAL_EVENT_CREDITS + 1000
+    for i in range(cnt):
+        open('%s/sub/f%d' % (root, i), 'w').close()
+    got = daemon.events()
+    assert len(got) == INITIAL_EVENT_CREDITS, len(got)
+    # The dropped events come back as a dirty subtree once there are credits again.
+    daemon.credit(1, len(got))
+    msgs = daemon.recv_until(lambda msg: msg[:1] == b'O')
+    assert parse_subtree(msgs[-1]) == (1, 'sub'), msgs
+    open(root + '/top', 'w').close()
+    expect_events(daemon, [(FILE_ACTION_ADDED, 'top')])
+    daemon.credit(1, 1)
+
+    # Too many dirty directories make the whole watch dirty.
+    for i in range(INITIAL_EVENT_CREDITS):
+        os.unlink('%s/sub/f%d' % (root, i))
+    for i in range(300):
+        open('%s/d%d/file' % (root, i), 'w').close()
+    got = daemon.events()
+    assert len(got) == INITIAL_EVENT_CREDITS, len(got)
+    daemon.credit(1, len(got))
+    msgs = daemon.recv_until(lambda msg: msg[:1] == b'O')
+    assert parse_subtree(msgs[-1]) == (1, ''), msgs
+    daemon.close()
+
+    # Clients without the capability are not limited.
+    daemon = start(root, CAP_SUBTREE_DIRTY, args=['--storm-dir-events=0', '--storm-watch-events=0'])
+    for i in range(INITIAL_EVENT_CREDITS, cnt):
+        os.unlink('%s/sub/f%d' % (root, i))
+    for i in range(300):
+        os.unlink('%s/d%d/file' % (root, i))
+    assert len(daemon.events()) == cnt - INITIAL_EVENT_CREDITS + 300
+    daemon.close()
+
+
+@scenario
+def unwatch(root):
+    daemon = start(root)
+    daemon.unwatch(1)
+    # The unwatch is handled before anything the file does.
+    time.sleep(0.2)
+    open(root + '/file', 'w').close()
+    got = daemon.events()
+    assert not got, got
+    daemon.close()
+
+
+@scenario
+def missing_directory(root):
+    daemon = Daemon(binary, backend_args)
+    daemon.watch(1, root + '/missing')
+    msgs = daemon.recv_until(lambda msg: msg[:1] == b'U')
+    assert parse_event(msgs[-1])[:2] == (1, FILE_ACTION_FAILED), msgs
+    daemon.close()
+
+
+@scenario
+def listing(root):
+    os.mkdir(root + '/sub')
+    for name in ('a', 'b', 'sub/c'):
+        open(root + '/' + name, 'w').close()
+    daemon = start(root, CAP_DIRECTORY_LIST)
+    names = {}
+    for request_id, rel_path in ((1, ''), (2, 'sub'), (3, 'missing')):
+        daemon.list(1, request_id, rel_path)
+        msgs = daemon.recv_until(lambda msg: msg[:1] == b'l' and parse_listing(msg)[2])
+        chunks = [parse_listing(msg) for msg in msgs if msg[:1] == b'l']
+        names[rel_path] = (chunks[-1][1], sorted(sum((chunk[3] for chunk in chunks), [])))
+    assert names == {'': (0, ['a', 'b', 'sub']), 'sub': (0, ['c']), 'missing': (2, [])}, names
+
+    # Huge directories come in several chunks.
+    os.mkdir(root + '/wide')
+    wide = ['some-longer-file-name-%05d' % i for i in range(5000)]
+    for name in wide:
+        open(root + '/wide/' + name, 'w').close()
+    daemon.events()
+    daemon.list(1, 4, 'wide')
+    msgs = daemon.recv_until(lambda msg: msg[:1] == b'l' and parse_listing(msg)[2])
+    chunks = [parse_listing(msg) for msg in msgs if msg[:1] == b'l']
+    assert len(chunks) > 1 and all(chunk[0] == 4 for chunk in chunks), len(chunks)
+    assert sorted(sum((chunk[3] for chunk in chunks), [])) == wide
+
+    # Nothing outside the watch.
+    for request_id, rel_path in enumerate(('..', '../tmp', 'sub/../..', '/etc', 'sub/', '.'), 5):
+        daemon.list(1, request_id, rel_path)
+        msgs = daemon.recv_until(lambda msg: msg[:1] == b'l' and parse_listing(msg)[2])
+        assert parse_listing(msgs[-1])[:2] == (request_id, 22), (rel_path, msgs)  # EINVAL
+    daemon.close()
+
+
+@scenario
+def digests(root):
+    open(root + '/file', 'w').write('contents')
+    os.mkdir(root + '/dir')
+    daemon = start(root, CAP_FILE_DIGEST)
+
+    def get(request_id, paths):
+        daemon.digest(1, request_id, paths)
+        msgs = daemon.recv_until(lambda msg: msg[:1] == b'h')
+        return parse_digests(msgs[-1])[1]
+
+    first, directory, missing = get(1, ['file', 'dir', 'missing'])
+    assert first[1] == 8 and first[3] == 0, first
+    assert directory[3] == 21 and missing[3] == 2, (directory, missing)  # EISDIR, ENOENT
+    # Nothing outside the watch.
+    escapes = ['../' + os.path.basename(root) + '/file', '/etc/passwd', 'dir/../file', './file']
+    assert all(digest[3] == 22 for digest in get(4, escapes)), escapes  # EINVAL
+    assert get(2, ['file'])[0] == first
+    open(root + '/file', 'w').write('changed!')
+    daemon.events()
+    changed = get(3, ['file'])[0]
+    assert changed[0] != first[0] and changed[3] == 0, (first, changed)
+    daemon.close()
+
+    # Rewriting files with a digest with the same contents is not reported. Without coalescing,
+    # the truncation alone could be.
+    daemon = start(root, CAP_FILE_DIGEST, args=['--skip-unchanged', '--coalesce-ms=200'])
+    get(1, ['file'])
+    open(root + '/file', 'w').write('changed!')
+    open(root + '/other', 'w').close()
+    got = expect_events(daemon, [(FILE_ACTION_ADDED, 'other')])
+    assert (FILE_ACTION_MODIFIED, 'file') not in got + daemon.events(), got
+    open(root + '/file', 'w').write('contents')
+    expect_events(daemon, [(FILE_ACTION_MODIFIED, 'file')])
+    daemon.close()
+
+
+@scenario
+def output_cap(root):
+    os.mkdir(root + '/wide')
+    for i in range(2000):
+        open('%s/wide/some-longer-file-name-%05d' % (root, i), 'w').close()
+    daemon = start(root, CAP_DIRECTORY_LIST)
+    # About 100 KB each, none of which is read.
+    for request_id in range(1000):
+        daemon.list(1, request_id, 'wide')
+    # Giving up on the only client ends the daemon.
+    assert daemon.process.wait(20) == 0
+
+
+@scenario
+def shared_daemon(root):
+    # Relays with the same options connect to this one instead of starting their own.
+    listener = subprocess.Popen([binary, *backend_args, '--listen'], stderr=subprocess.DEVNULL)
+    try:
+        time.sleep(0.2)
+        if listener.poll() is not None:
+            raise Skipped('a daemon with the same options is running already')
+        args = backend_args + ['--shared']
+        capabilities = CAP_WATCH_PROGRESS | CAP_DIRECTORY_LIST
+        first, second = Daemon(binary, args, capabilities), Daemon(binary, args, capabilities)
+        first.watch(1, root)
+        first.wait_ready(1)
+        # The second watch of the same tree subscribes to the first one, under its own handle.
+        second.watch(7, root)
+        second.wait_ready(7)
+        open(root + '/file', 'w').close()
+        assert (1, FILE_ACTION_ADDED, 'file') in first.events()
+        assert (7, FILE_ACTION_ADDED, 'file') in second.events()
+
+        # Replies go only to the client that asked.
+        first.list(1, 5)
+        msgs = first.recv_until(lambda msg: msg[:1] == b'l' and parse_listing(msg)[2])
+        assert parse_listing(msgs[-1])[0] == 5, msgs
+        assert second.recv(0.3) is None
+
+        # A malformed request costs only its sender the connection.
+        for body in (b'D' + struct.pack('<Q', 3), b'C\1', b'L', b'H' + struct.pack('<Q', 1)):
+            rogue = Daemon(binary, args, capabilities)
+            rogue.send(body)
+            assert rogue.recv(1) is None
+            rogue.process.wait(5)
+        open(root + '/after', 'w').close()
+        assert (1, FILE_ACTION_ADDED, 'after') in first.events()
+        assert (7, FILE_ACTION_ADDED, 'after') in second.events()
+
+        # The watch stays for the clients that are left.
+        assert second.close() == 0
+        open(root + '/more', 'w').close()
+        assert (1, FILE_ACTION_ADDED, 'more') in first.events()
+        assert first.close() == 0
+    finally:
+        listener.terminate()
+        listener.wait()
+
+
+def can_use_fanotify(path):
+    FAN_CLASS_NOTIF, FAN_REPORT_DFID_NAME = 0, 0xc00
+    FAN_MARK_ADD, FAN_MARK_FILESYSTEM, FAN_CREATE = 1, 0x100, 0x100
+    libc = ctypes.CDLL(None, use_errno=True)
+    fd = libc.fanotify_init(FAN_CLASS_NOTIF | FAN_REPORT_DFID_NAME, os.O_RDONLY)
+    if fd == -1:
+        return False
+    res = libc.fanotify_mark(fd, FAN_MARK_ADD | FAN_MARK_FILESYSTEM,
+                             ctypes.c_uint64(FAN_CREATE), -100, path.encode())
+    os.close(fd)
+    return res == 0
+
+
+def main():
+    global binary, backend_args, is_fanotify
+    if len(sys.argv) < 3:
+        print('usage: protocol-test.py BINARY --backend=inotify|fanotify [SCENARIO...]')
+        return 2
+    binary, backend_args = sys.argv[1], [sys.argv[2]]
+    is_fanotify = sys.argv[2] == '--backend=fanotify'
+    only = sys.argv[3:]
+
+    base = tempfile.mkdtemp(prefix='wfn-test-')
+    try:
+        if is_fanotify and not can_use_fanotify(base):
+            print('fanotify is not available here')
+            return SKIPPED
+        failed = 0
+        for fn in scenarios:
+            if only and fn.__name__ not in only:
+                continue
+            root = os.path.join(base, fn.__name__)
+            os.mkdir(root)
+            try:
+                fn(root)
+                print('ok', fn.__name__)
+            except Skipped as e:
+                print('skipped', fn.__name__, e)
+            except Exception as e:
+                failed += 1
+                print('FAILED', fn.__name__, type(e).__name__, e)
+        return 1 if failed else 0
+    finally:
+        shutil.rmtree(base, ignore_errors=True)
+
+
+if __name__ == '__main__':
+    sys.exit(main())